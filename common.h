@@ -10,6 +10,9 @@
 //#define USE_INTRINSICS_OPERATIONS
 //#define USE_INTRINSICS_INTERSECTION
 
+// Count BVH traversal work per ray and write a cost heatmap next to the image, see bvh_stats.h
+//#define BVH_TRAVERSAL_STATS
+
 #include "math.hpp"
 
 //#include "ray_tracer/math/math.hpp"
@@ -25,7 +28,6 @@
 #include <algorithm>
 #include <numeric>
 #include <numbers>
-#include <execution>
 
 using resource_id_t = size_t;
 constexpr const resource_id_t invalid_index{ std::numeric_limits<size_t>::max() };
\ No newline at end of file
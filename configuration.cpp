@@ -7,11 +7,47 @@
 
 namespace fs = std::filesystem;
 
+const char* to_string(EPixelFilter filter)
+{
+	switch (filter)
+	{
+	case EPixelFilter::eTent: return "tent";
+	case EPixelFilter::eGaussian: return "gaussian";
+	case EPixelFilter::eBlackmanHarris: return "blackman_harris";
+	default: return "box";
+	}
+}
+
+bool from_string(const std::string& name, EPixelFilter& filter)
+{
+	for (auto candidate : { EPixelFilter::eBox, EPixelFilter::eTent, EPixelFilter::eGaussian, EPixelFilter::eBlackmanHarris })
+	{
+		if (name == to_string(candidate))
+		{
+			filter = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+void to_json(nlohmann::json& json, const EPixelFilter& type)
+{
+	json = to_string(type);
+}
+
+void from_json(const nlohmann::json& json, EPixelFilter& type)
+{
+	from_string(json.get<std::string>(), type);
+}
+
 void to_json(nlohmann::json& json, const FFramebufferConfig& type)
 {
     utl::serialize_to("width", json, type.m_width, type.m_width != 0u);
     utl::serialize_to("height", json, type.m_height, type.m_height != 0u);
     utl::serialize_to("antialiasing", json, type.m_antialiasing, type.m_antialiasing);
+    utl::serialize_to("filter", json, type.m_filter, type.m_antialiasing);
+    utl::serialize_to("filter_radius", json, type.m_filter_radius, type.m_filter_radius > 0.f);
 }
 
 void from_json(const nlohmann::json& json, FFramebufferConfig& type)
@@ -19,6 +55,8 @@ void from_json(const nlohmann::json& json, FFramebufferConfig& type)
     utl::parse_from("width", json, type.m_width);
     utl::parse_from("height", json, type.m_height);
     utl::parse_from("antialiasing", json, type.m_antialiasing);
+    utl::parse_from("filter", json, type.m_filter);
+    utl::parse_from("filter_radius", json, type.m_filter_radius);
 }
 
 
@@ -33,6 +71,72 @@ void from_json(const nlohmann::json& json, FOutputConfig& type)
 }
 
 
+const char* to_string(EIntegratorMode mode)
+{
+	switch (mode)
+	{
+	case EIntegratorMode::eStream: return "stream";
+	case EIntegratorMode::eWavefront: return "wavefront";
+	default: return "path";
+	}
+}
+
+bool from_string(const std::string& name, EIntegratorMode& mode)
+{
+	for (auto candidate : { EIntegratorMode::ePath, EIntegratorMode::eStream, EIntegratorMode::eWavefront })
+	{
+		if (name == to_string(candidate))
+		{
+			mode = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+void to_json(nlohmann::json& json, const EIntegratorMode& type)
+{
+	json = to_string(type);
+}
+
+void from_json(const nlohmann::json& json, EIntegratorMode& type)
+{
+	from_string(json.get<std::string>(), type);
+}
+
+const char* to_string(ETileOrder order)
+{
+	switch (order)
+	{
+	case ETileOrder::eScanline: return "scanline";
+	case ETileOrder::eMorton: return "morton";
+	default: return "hilbert";
+	}
+}
+
+bool from_string(const std::string& name, ETileOrder& order)
+{
+	for (auto candidate : { ETileOrder::eScanline, ETileOrder::eMorton, ETileOrder::eHilbert })
+	{
+		if (name == to_string(candidate))
+		{
+			order = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+void to_json(nlohmann::json& json, const ETileOrder& type)
+{
+	json = to_string(type);
+}
+
+void from_json(const nlohmann::json& json, ETileOrder& type)
+{
+	from_string(json.get<std::string>(), type);
+}
+
 void to_json(nlohmann::json& json, const FIntegratorConfig& type)
 {
 	utl::serialize_to("sample_count", json, type.m_sample_count, type.m_sample_count > 1u);
@@ -41,6 +145,10 @@ void to_json(nlohmann::json& json, const FIntegratorConfig& type)
 
 	utl::serialize_to("use_estimator", json, type.m_use_estimator, type.m_use_estimator);
 	utl::serialize_to("estimator_tolerance", json, type.m_estimator_tolerance, true);
+	utl::serialize_to("mode", json, type.m_mode, true);
+	utl::serialize_to("primary_hit_cache", json, type.m_primary_hit_cache, true);
+	utl::serialize_to("tile_size", json, type.m_tile_size, true);
+	utl::serialize_to("tile_order", json, type.m_tile_order, true);
 }
 
 void from_json(const nlohmann::json& json, FIntegratorConfig& type)
@@ -51,6 +159,153 @@ void from_json(const nlohmann::json& json, FIntegratorConfig& type)
 
 	utl::parse_from("use_estimator", json, type.m_use_estimator);
 	utl::parse_from("estimator_tolerance", json, type.m_estimator_tolerance);
+
+	// Older configurations switch stream mode on with a flag
+	bool stream_traversal{ false };
+	utl::parse_from("stream_traversal", json, stream_traversal);
+	if (stream_traversal)
+		type.m_mode = EIntegratorMode::eStream;
+	utl::parse_from("mode", json, type.m_mode);
+	utl::parse_from("primary_hit_cache", json, type.m_primary_hit_cache);
+	utl::parse_from("tile_size", json, type.m_tile_size);
+	utl::parse_from("tile_order", json, type.m_tile_order);
+}
+
+
+const char* to_string(EBVHBuilder builder)
+{
+	switch (builder)
+	{
+	case EBVHBuilder::eLBVH: return "lbvh";
+	case EBVHBuilder::ePLOC: return "ploc";
+	default: return "sah";
+	}
+}
+
+bool from_string(const std::string& name, EBVHBuilder& builder)
+{
+	for (auto candidate : { EBVHBuilder::eBinnedSAH, EBVHBuilder::eLBVH, EBVHBuilder::ePLOC })
+	{
+		if (name == to_string(candidate))
+		{
+			builder = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char* to_string(EBVHPreset preset)
+{
+	switch (preset)
+	{
+	case EBVHPreset::eFast: return "fast";
+	case EBVHPreset::eHighQuality: return "high_quality";
+	default: return "balanced";
+	}
+}
+
+bool from_string(const std::string& name, EBVHPreset& preset)
+{
+	for (auto candidate : { EBVHPreset::eFast, EBVHPreset::eBalanced, EBVHPreset::eHighQuality })
+	{
+		if (name == to_string(candidate))
+		{
+			preset = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+void apply_preset(FBVHConfig& config, EBVHPreset preset)
+{
+	// Triangles are intersected four at a time, so a node visit costs about as much as a full leaf block
+	config.m_preset = preset;
+	config.m_intersection_cost = 1.f;
+	switch (preset)
+	{
+	case EBVHPreset::eFast:
+		config.m_bins = 4u;
+		config.m_traversal_cost = 8.f;
+		config.m_max_leaf_size = 32u;
+		config.m_spatial_splits = false;
+		break;
+	case EBVHPreset::eHighQuality:
+		config.m_bins = 32u;
+		config.m_traversal_cost = 4.f;
+		config.m_max_leaf_size = 16u;
+		config.m_spatial_splits = true;
+		break;
+	default:
+		config.m_bins = 8u;
+		config.m_traversal_cost = 4.f;
+		config.m_max_leaf_size = 16u;
+		config.m_spatial_splits = false;
+		break;
+	}
+}
+
+void to_json(nlohmann::json& json, const EBVHBuilder& type)
+{
+	json = to_string(type);
+}
+
+void from_json(const nlohmann::json& json, EBVHBuilder& type)
+{
+	from_string(json.get<std::string>(), type);
+}
+
+void to_json(nlohmann::json& json, const EBVHPreset& type)
+{
+	json = to_string(type);
+}
+
+void from_json(const nlohmann::json& json, EBVHPreset& type)
+{
+	from_string(json.get<std::string>(), type);
+}
+
+void to_json(nlohmann::json& json, const FBVHConfig& type)
+{
+	utl::serialize_to("preset", json, type.m_preset, true);
+	utl::serialize_to("bins", json, type.m_bins, true);
+	utl::serialize_to("traversal_cost", json, type.m_traversal_cost, true);
+	utl::serialize_to("intersection_cost", json, type.m_intersection_cost, true);
+	utl::serialize_to("max_leaf_size", json, type.m_max_leaf_size, true);
+	utl::serialize_to("builder", json, type.m_builder, true);
+	utl::serialize_to("preview_builder", json, type.m_preview_builder, true);
+	utl::serialize_to("ploc_radius", json, type.m_ploc_radius, true);
+	utl::serialize_to("spatial_splits", json, type.m_spatial_splits, type.m_spatial_splits);
+	utl::serialize_to("spatial_split_alpha", json, type.m_spatial_split_alpha, true);
+	utl::serialize_to("duplication_budget", json, type.m_duplication_budget, true);
+	utl::serialize_to("refit_rebuild_threshold", json, type.m_refit_rebuild_threshold, true);
+	utl::serialize_to("compressed_nodes", json, type.m_compressed_nodes, type.m_compressed_nodes);
+	utl::serialize_to("out_of_core", json, type.m_out_of_core, type.m_out_of_core);
+	utl::serialize_to("memory_budget", json, type.m_memory_budget, type.m_out_of_core);
+	utl::serialize_to("paging_directory", json, type.m_paging_directory, !type.m_paging_directory.empty());
+}
+
+void from_json(const nlohmann::json& json, FBVHConfig& type)
+{
+	// The preset goes first so the other keys can override it
+	if (auto obj = json.find("preset"); obj != json.end())
+		apply_preset(type, obj->get<EBVHPreset>());
+	utl::parse_from("bins", json, type.m_bins);
+	utl::parse_from("traversal_cost", json, type.m_traversal_cost);
+	utl::parse_from("intersection_cost", json, type.m_intersection_cost);
+	utl::parse_from("max_leaf_size", json, type.m_max_leaf_size);
+	utl::parse_from("builder", json, type.m_builder);
+	utl::parse_from("preview_builder", json, type.m_preview_builder);
+	utl::parse_from("ploc_radius", json, type.m_ploc_radius);
+	utl::parse_from("spatial_splits", json, type.m_spatial_splits);
+	utl::parse_from("spatial_split_alpha", json, type.m_spatial_split_alpha);
+	utl::parse_from("duplication_budget", json, type.m_duplication_budget);
+	utl::parse_from("refit_rebuild_threshold", json, type.m_refit_rebuild_threshold);
+	utl::parse_from("compressed_nodes", json, type.m_compressed_nodes);
+	utl::parse_from("out_of_core", json, type.m_out_of_core);
+	utl::parse_from("memory_budget", json, type.m_memory_budget);
+	utl::parse_from("paging_directory", json, type.m_paging_directory);
 }
 
 
@@ -129,22 +384,39 @@ void from_json(const nlohmann::json& json, FSceneConfig& type)
 }
 
 
+void to_json(nlohmann::json& json, const FThreadingConfig& type)
+{
+	utl::serialize_to("threads", json, type.m_thread_count, true);
+	utl::serialize_to("affinity", json, type.m_affinity, true);
+}
+
+void from_json(const nlohmann::json& json, FThreadingConfig& type)
+{
+	utl::parse_from("threads", json, type.m_thread_count);
+	utl::parse_from("affinity", json, type.m_affinity);
+}
+
+
 void to_json(nlohmann::json& json, const FConfiguration& type)
 {
 	utl::serialize_to("framebuffer", json, type.m_fbcfg, true);
 	utl::serialize_to("integrator", json, type.m_icfg, true);
+	utl::serialize_to("bvh", json, type.m_bvhcfg, true);
 	utl::serialize_to("output", json, type.m_ocfg, true);
 	utl::serialize_to("scene", json, type.m_scfg, true);
 	utl::serialize_to("tonemapping", json, type.m_tmcfg, true);
+	utl::serialize_to("threading", json, type.m_thcfg, true);
 }
 
 void from_json(const nlohmann::json& json, FConfiguration& type)
 {
 	utl::parse_from("framebuffer", json, type.m_fbcfg, true);
 	utl::parse_from("integrator", json, type.m_icfg, true);
+	utl::parse_from("bvh", json, type.m_bvhcfg);
 	utl::parse_from("output", json, type.m_ocfg, true);
 	utl::parse_from("scene", json, type.m_scfg, true);
 	utl::parse_from("tonemapping", json, type.m_tmcfg, true);
+	utl::parse_from("threading", json, type.m_thcfg);
 }
 
 void CConfiguration::load(const std::string& path)
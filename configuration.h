@@ -2,13 +2,30 @@
 
 #include <upattern.hpp>
 
+// Pixel reconstruction filters, all separable
+enum class EPixelFilter
+{
+	eBox,
+	eTent,
+	eGaussian,
+	eBlackmanHarris
+};
+
+// "box", "tent", "gaussian" and "blackman_harris"
+const char* to_string(EPixelFilter filter);
+bool from_string(const std::string& name, EPixelFilter& filter);
+
 struct FFramebufferConfig
 {
 	uint32_t m_width{ 1280u };
 	uint32_t m_height{ 720u };
 	float m_aspect_ratio{ 1.777777779f };
 	std::string m_aspect_mode{ "config" }; // camera - use aspect from camera, config - use aspect from config, none - calculate aspect from resolution
+	// Jitter camera rays over the filter footprint, otherwise they go through pixel centers
 	bool m_antialiasing{ false };
+	EPixelFilter m_filter{ EPixelFilter::eBox };
+	// Filter radius in pixels, 0 uses the filter's default
+	float m_filter_radius{ 0.f };
 };
 
 struct FOutputConfig
@@ -16,6 +33,33 @@ struct FOutputConfig
 	std::string m_image_name{ "final.png" };
 };
 
+enum class ETileOrder
+{
+	eScanline,
+	// Z-order curve over the tile grid
+	eMorton,
+	// Hilbert curve, consecutive tiles are always neighbours
+	eHilbert
+};
+
+// "scanline", "morton" and "hilbert"
+const char* to_string(ETileOrder order);
+bool from_string(const std::string& name, ETileOrder& order);
+
+enum class EIntegratorMode
+{
+	// One path at a time, bounce by bounce
+	ePath,
+	// All paths of a tile advance together, scattered rays are traced as direction-sorted packets
+	eStream,
+	// Like stream, with every stage run in bulk: extend, shade grouped by material and shadow
+	eWavefront
+};
+
+// "path", "stream" and "wavefront"
+const char* to_string(EIntegratorMode mode);
+bool from_string(const std::string& name, EIntegratorMode& mode);
+
 struct FIntegratorConfig
 {
 	uint32_t m_sample_count{ 5u };
@@ -25,8 +69,82 @@ struct FIntegratorConfig
 	// Estimator settings
 	bool m_use_estimator{ false };
 	float m_estimator_tolerance{ 0.05f };
+
+	// How paths are scheduled. All modes compute the same estimator.
+	EIntegratorMode m_mode{ EIntegratorMode::ePath };
+	// Resolve each pixel's primary hit and its textures once and share them between its samples
+	bool m_primary_hit_cache{ true };
+
+	// Pixels per side of the tiles handed to render threads, also the stream mode block size
+	uint32_t m_tile_size{ 32u };
+	// Order in which tiles are split between and taken by the threads
+	ETileOrder m_tile_order{ ETileOrder::eHilbert };
 };
 
+enum class EBVHBuilder
+{
+	// Binned SAH, optionally with spatial splits. Best trees, slowest build.
+	eBinnedSAH,
+	// Morton-ordered radix splits. Fastest build.
+	eLBVH,
+	// Agglomerative clustering over the Morton order. Fast, close to SAH quality.
+	ePLOC
+};
+
+// Names used in the configuration file and on the command line: "sah", "lbvh" and "ploc"
+const char* to_string(EBVHBuilder builder);
+bool from_string(const std::string& name, EBVHBuilder& builder);
+
+enum class EBVHPreset
+{
+	eFast,
+	eBalanced,
+	eHighQuality
+};
+
+// "fast", "balanced" and "high_quality"
+const char* to_string(EBVHPreset preset);
+bool from_string(const std::string& name, EBVHPreset& preset);
+
+struct FBVHConfig
+{
+	EBVHBuilder m_builder{ EBVHBuilder::eBinnedSAH };
+	// Builder used while the interactive preview runs, the tree is rebuilt with m_builder for the full render
+	EBVHBuilder m_preview_builder{ EBVHBuilder::eLBVH };
+	// PLOC nearest neighbour search radius in clusters
+	uint32_t m_ploc_radius{ 8u };
+
+	// SAH build settings, initialised from m_preset. Keys given next to the preset override it.
+	EBVHPreset m_preset{ EBVHPreset::eBalanced };
+	// Object split bins per axis: 4, 8, 16 or 32
+	uint32_t m_bins{ 8u };
+	// SAH cost of visiting a node, relative to intersecting one triangle
+	float m_traversal_cost{ 4.f };
+	float m_intersection_cost{ 1.f };
+	// Larger nodes are split even where the SAH would keep a leaf
+	uint32_t m_max_leaf_size{ 16u };
+	// SBVH: also try spatial splits, duplicating references that straddle the split plane
+	bool m_spatial_splits{ false };
+	// Spatial splits are only tried when child overlap exceeds this fraction of the root area
+	float m_spatial_split_alpha{ 1e-5f };
+	// Extra references spatial splits may add, as a fraction of the triangle count
+	float m_duplication_budget{ 0.3f };
+	// Store nodes with 8-bit quantized child bounds, halving node memory
+	bool m_compressed_nodes{ false };
+	// Refitting moved instances rebuilds the top level once its SAH cost exceeds this multiple of the built cost
+	float m_refit_rebuild_threshold{ 1.5f };
+
+	// Out of core: bottom-level leaves and primitives are paged from a memory-mapped file
+	bool m_out_of_core{ false };
+	// Resident paged geometry, in megabytes
+	uint32_t m_memory_budget{ 4096u };
+	// Directory of the paging file, the system temporary directory if empty
+	std::string m_paging_directory{};
+};
+
+// Overwrites the SAH build settings of config with those of preset
+void apply_preset(FBVHConfig& config, EBVHPreset preset);
+
 struct FTonemapConfig
 {
 	float m_gamma{ 2.2f };
@@ -50,13 +168,23 @@ struct FSceneConfig
 	FSkyboxConfig m_skybox{};
 };
 
+struct FThreadingConfig
+{
+	// Threads rendering and building, counting the main thread. 0 uses every hardware thread.
+	uint32_t m_thread_count{ 0u };
+	// Pin each worker thread to its own logical core
+	bool m_affinity{ false };
+};
+
 struct FConfiguration
 {
 	FFramebufferConfig m_fbcfg{};
 	FOutputConfig m_ocfg{};
 	FIntegratorConfig m_icfg{};
+	FBVHConfig m_bvhcfg{};
 	FTonemapConfig m_tmcfg{};
 	FSceneConfig m_scfg{};
+	FThreadingConfig m_thcfg{};
 };
 
 class CConfiguration : public utl::singleton<CConfiguration>
@@ -1,6 +1,8 @@
 #include "ray_tracer/engine.h"
 #include "ray_tracer/math/math.hpp"
+#include "ray_tracer/render/benchmark.h"
 #include "ray_tracer/render/preview_session.h"
+#include "ray_tracer/thread_pool.h"
 #include "util.h"
 
 #include "argparser.h"
@@ -45,21 +47,79 @@ int main(int argc, char** argv)
 	config.m_ocfg.m_image_name = argparse.try_get("--out", config.m_ocfg.m_image_name);
 	config.m_fbcfg.m_width = argparse.try_get("--width", config.m_fbcfg.m_width);
 	config.m_fbcfg.m_height = argparse.try_get("--height", config.m_fbcfg.m_height);
+	config.m_fbcfg.m_antialiasing = argparse.exists("--antialiasing") ? true : config.m_fbcfg.m_antialiasing;
+	if (auto filter = argparse.get("--filter"); filter && !from_string(*filter, config.m_fbcfg.m_filter))
+		log_warning("Unknown pixel filter {}, using {}.", *filter, to_string(config.m_fbcfg.m_filter));
+	config.m_fbcfg.m_filter_radius = argparse.try_get("--filter-radius", config.m_fbcfg.m_filter_radius);
 	config.m_icfg.m_sample_count = argparse.try_get("--samples", config.m_icfg.m_sample_count);
 	config.m_icfg.m_bounce_count = argparse.try_get("--bounces", config.m_icfg.m_bounce_count);
 	config.m_icfg.m_rr_threshold = argparse.try_get("--rr", config.m_icfg.m_rr_threshold);
 	config.m_icfg.m_use_estimator = argparse.exists("--use_estimator") ? true : config.m_icfg.m_use_estimator;
 	config.m_icfg.m_estimator_tolerance = argparse.try_get("--tolerance", config.m_icfg.m_estimator_tolerance);
+	if (auto mode = argparse.get("--mode"); mode && !from_string(*mode, config.m_icfg.m_mode))
+		log_warning("Unknown integrator mode {}, using {}.", *mode, to_string(config.m_icfg.m_mode));
+	config.m_icfg.m_primary_hit_cache = argparse.exists("--no-primary-cache") ? false : config.m_icfg.m_primary_hit_cache;
+	config.m_icfg.m_tile_size = argparse.try_get("--tile-size", config.m_icfg.m_tile_size);
+	if (auto order = argparse.get("--tile-order"); order && !from_string(*order, config.m_icfg.m_tile_order))
+		log_warning("Unknown tile order {}, using {}.", *order, to_string(config.m_icfg.m_tile_order));
+
+	if (auto preset = argparse.get("--bvh-preset"); preset)
+	{
+		EBVHPreset bvh_preset{};
+		if (from_string(*preset, bvh_preset))
+			apply_preset(config.m_bvhcfg, bvh_preset);
+		else
+			log_warning("Unknown BVH preset {}, using the configured build settings.", *preset);
+	}
+	if (auto builder = argparse.get("--bvh-builder"); builder && !from_string(*builder, config.m_bvhcfg.m_builder))
+		log_warning("Unknown BVH builder {}, using {}.", *builder, to_string(config.m_bvhcfg.m_builder));
+	config.m_bvhcfg.m_out_of_core = argparse.exists("--out-of-core") ? true : config.m_bvhcfg.m_out_of_core;
+	config.m_bvhcfg.m_memory_budget = argparse.try_get("--memory-budget", config.m_bvhcfg.m_memory_budget);
+	config.m_thcfg.m_thread_count = argparse.try_get("--threads", config.m_thcfg.m_thread_count);
+	config.m_thcfg.m_affinity = argparse.exists("--affinity") ? true : config.m_thcfg.m_affinity;
 
 	log_info("Configuration loaded by {}s", timer.stop<float>());
 
+	CThreadPool::getInstance()->create(config.m_thcfg.m_thread_count, config.m_thcfg.m_affinity);
+
+	// The preview starts on the fast builder, the full render rebuilds with the configured one
+	bool preview = argparse.exists("--preview");
+	auto render_builder = config.m_bvhcfg.m_builder;
+	if (preview)
+		config.m_bvhcfg.m_builder = config.m_bvhcfg.m_preview_builder;
+
 	auto engine = std::make_unique<CRayEngine>();
 	engine->create();
 
+	config.m_bvhcfg.m_builder = render_builder;
+
 	log_info("Path tracer initialized by {}s", timer.stop<float>());
 
+	// Only analyze the acceleration structure, nothing is rendered
+	if (argparse.exists("--bvh-stats"))
+	{
+		// The output path is optional
+		auto stats_path = argparse.get("--bvh-stats").value_or("bvh_stats.json");
+		if (stats_path.starts_with("--"))
+			stats_path = "bvh_stats.json";
+
+		engine->get_scene()->report_acceleration(config.m_bvhcfg, stats_path);
+		log_info("Running time {}s.", sw.stop<float>());
+		return 0;
+	}
+
+	// Times every integrator mode on the loaded scene, nothing is saved
+	if (argparse.exists("--benchmark"))
+	{
+		// The repeat count is optional
+		auto repeats = argparse.get("--benchmark").value_or("3");
+		run_benchmark(engine.get(), is_number(repeats) ? static_cast<uint32_t>(std::stoul(repeats)) : 3u);
+		log_info("Running time {}s.", sw.stop<float>());
+		return 0;
+	}
+
 	// Interactive preview: position the camera / tweak settings, then trigger a full render.
-	if (argparse.exists("--preview"))
+	if (preview)
 	{
 		run_preview(engine.get());
 		log_info("Preview session finished by {}s.", timer.stop<float>());
@@ -81,6 +141,13 @@ int main(int argc, char** argv)
 
 	image->save(config.m_ocfg.m_image_name);
 
+#if defined(BVH_TRAVERSAL_STATS)
+	std::filesystem::path heatmap_path{ config.m_ocfg.m_image_name };
+	heatmap_path.replace_filename(heatmap_path.stem().string() + "_heatmap" + heatmap_path.extension().string());
+	resource_manager->get_image(framebuffer->present_heatmap())->save(heatmap_path);
+	log_info("Traversal heatmap saved to {}.", heatmap_path.string());
+#endif
+
 	log_info("Result saved by {}s.", timer.stop<float>());
 	log_info("Running time {}s.", sw.stop<float>());
 
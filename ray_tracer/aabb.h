@@ -22,13 +22,18 @@ struct FAxixAlignedBoundingBox
 		return math::ray_aabb_intersect(ray.m_origin, ray.m_inv_direction, m_min, m_max, hit_result.m_distance);
 	}
 
+	float hit(const FRay& ray, float t_max) const
+	{
+		return math::ray_aabb_intersect(ray.m_origin, ray.m_inv_direction, m_min, m_max, t_max);
+	}
+
 	void grow(const FAxixAlignedBoundingBox& rhs)
 	{
 		m_min = glm::min(m_min, rhs.m_min);
 		m_max = glm::max(m_max, rhs.m_max);
 	}
 
-	float area()
+	float area() const
 	{
 		auto ext = extent();
 		return ext.x * ext.y + ext.y * ext.z + ext.z * ext.x;
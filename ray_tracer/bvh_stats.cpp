@@ -0,0 +1,103 @@
+#include "bvh_stats.h"
+
+#include <logger/logger.h>
+
+#include <array>
+#include <mutex>
+
+namespace bvh_stats
+{
+	// Exact up to the last bin, which also takes every larger value
+	constexpr const uint32_t histogram_bins{ 4096u };
+	constexpr const uint32_t counter_count{ 4u };
+
+	struct FHistogram
+	{
+		std::array<std::array<uint64_t, histogram_bins>, counter_count> m_bins{};
+		std::array<uint64_t, counter_count> m_sums{};
+		uint64_t m_rays{ 0u };
+	};
+
+	// The registry keeps histograms alive after their thread exits, so a report still sees them
+	std::mutex registry_mutex{};
+	std::vector<std::shared_ptr<FHistogram>> registry{};
+
+	FHistogram& histogram()
+	{
+		static thread_local std::shared_ptr<FHistogram> local{};
+		if (!local)
+		{
+			local = std::make_shared<FHistogram>();
+			std::lock_guard<std::mutex> lock(registry_mutex);
+			registry.emplace_back(local);
+		}
+		return *local;
+	}
+
+	void begin(uint32_t count)
+	{
+		std::fill_n(rays, count, FTraversalCounters{});
+		lane = 0u;
+	}
+
+	void end(uint32_t count)
+	{
+		auto& local = histogram();
+		for (uint32_t r = 0u; r < count; ++r)
+		{
+			auto& counters = rays[r];
+			const uint32_t values[counter_count]{ counters.m_inner_nodes, counters.m_leaves, counters.m_triangles, counters.m_stack_depth };
+			for (uint32_t c = 0u; c < counter_count; ++c)
+			{
+				++local.m_bins[c][glm::min(values[c], histogram_bins - 1u)];
+				local.m_sums[c] += values[c];
+			}
+			pixel_cost += counters.cost();
+		}
+		local.m_rays += count;
+		lane = 0u;
+	}
+
+	void reset()
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		for (auto& local : registry)
+			*local = FHistogram{};
+	}
+
+	void report()
+	{
+		FHistogram total{};
+		{
+			std::lock_guard<std::mutex> lock(registry_mutex);
+			for (auto& local : registry)
+			{
+				for (uint32_t c = 0u; c < counter_count; ++c)
+				{
+					for (uint32_t bin = 0u; bin < histogram_bins; ++bin)
+						total.m_bins[c][bin] += local->m_bins[c][bin];
+					total.m_sums[c] += local->m_sums[c];
+				}
+				total.m_rays += local->m_rays;
+			}
+		}
+
+		if (total.m_rays == 0u)
+			return;
+
+		float mean[counter_count]{};
+		uint32_t p99[counter_count]{};
+		for (uint32_t c = 0u; c < counter_count; ++c)
+		{
+			mean[c] = static_cast<float>(static_cast<double>(total.m_sums[c]) / static_cast<double>(total.m_rays));
+
+			uint64_t rank = (total.m_rays * 99u + 99u) / 100u;
+			uint64_t seen{ 0u };
+			while (p99[c] < histogram_bins - 1u && (seen += total.m_bins[c][p99[c]]) < rank)
+				++p99[c];
+		}
+
+		log_info("BVH traversal over {} rays, mean / p99 per ray: {:.1f} / {} inner nodes, {:.1f} / {} leaves, {:.1f} / {} triangles, {:.1f} / {} stack depth.",
+			total.m_rays, mean[0], p99[0], mean[1], p99[1], mean[2], p99[2], mean[3], p99[3]);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "shared.h"
+
+// Traversal counters of CBVHTreeNew::hit, compiled in by defining BVH_TRAVERSAL_STATS (see common.h).
+// Every thread counts into its own slots and histograms, nothing is shared until a report merges them.
+#if defined(BVH_TRAVERSAL_STATS)
+#define BVH_STATS(expression) expression
+#else
+#define BVH_STATS(expression)
+#endif
+
+struct FTraversalCounters
+{
+	uint32_t m_inner_nodes{ 0u };
+	uint32_t m_leaves{ 0u };
+	uint32_t m_triangles{ 0u };
+	uint32_t m_stack_depth{ 0u };
+
+	// Work shown by the heatmap
+	uint32_t cost() const
+	{
+		return m_inner_nodes + m_triangles;
+	}
+};
+
+namespace bvh_stats
+{
+	// Counters of the rays the thread is tracing, one slot per packet lane
+	inline thread_local FTraversalCounters rays[FRayPacket::max_size]{};
+	// Slot single-ray traversal counts into, packet traversal sets it before falling back to single rays
+	inline thread_local uint32_t lane{ 0u };
+	// Cost of every ray the thread finished since the integrator last took it
+	inline thread_local uint64_t pixel_cost{ 0u };
+
+	inline FTraversalCounters& current()
+	{
+		return rays[lane];
+	}
+
+	// Clears the slots of the next count rays
+	void begin(uint32_t count);
+	// Folds the slots of count rays into the thread's histograms
+	void end(uint32_t count);
+
+	// Drops the histograms of all threads
+	void reset();
+	// Logs mean and p99 per ray of every counter since the last reset
+	void report();
+}
\ No newline at end of file
@@ -1,27 +1,275 @@
 #include "bvh_tree.h"
 
 #include "util.h"
+#include "bvh_stats.h"
+#include "thread_pool.h"
+#include "traversal_stack.h"
+
+#include <logger/logger.h>
 
 #include <iostream>
 
-constexpr uint32_t bins = 8u;
+// SAH bin counts the build is specialised for, FBVHConfig::m_bins is rounded to one of them
+constexpr const uint32_t min_bins{ 4u };
+constexpr const uint32_t max_bins{ 32u };
+
+// Subtrees at least this large are built as separate tasks
+constexpr const uint32_t parallel_task_threshold{ 4096u };
+// Nodes at least this large bin their primitives in parallel chunks
+constexpr const uint32_t parallel_binning_threshold{ 65536u };
+constexpr const uint32_t binning_chunk_size{ 16384u };
+// Per-primitive loops hand out this many primitives at a time
+constexpr const size_t parallel_grain{ 1024ull };
+
+// Packet subtrees reached by fewer rays are traversed one ray at a time
+constexpr const int packet_min_rays{ 4 };
+
+constexpr const uint32_t spatial_bins = 32u;
+constexpr const uint32_t spatial_max_depth = 64u;
+
+// Morton-order builds stop splitting at one triangle block
+constexpr const uint32_t morton_leaf_size{ 4u };
+// Smallest chunk the parallel sort hands to one thread
+constexpr const size_t parallel_sort_chunk{ 16384ull };
+
+// Sorts keys on the thread pool: one chunk per worker is sorted in parallel, then neighbouring
+// chunks are merged pairwise, each round of merges in parallel
+void parallel_sort(std::vector<uint64_t>& keys)
+{
+    auto& pool = CThreadPool::getInstance();
+    size_t chunk_count = keys.size() / parallel_sort_chunk;
+    if (chunk_count > pool->worker_count())
+        chunk_count = pool->worker_count();
+    if (chunk_count <= 1ull)
+    {
+        std::sort(keys.begin(), keys.end());
+        return;
+    }
+
+    auto bound = [&keys, chunk_count](size_t chunk) { return static_cast<ptrdiff_t>(keys.size() * glm::min(chunk, chunk_count) / chunk_count); };
+    pool->parallel_for(chunk_count,
+        [&keys, &bound](size_t chunk, uint32_t)
+        {
+            std::sort(keys.begin() + bound(chunk), keys.begin() + bound(chunk + 1ull));
+        });
+
+    std::vector<uint64_t> buffer(keys.size());
+    auto* source = &keys;
+    auto* target = &buffer;
+    for (size_t width = 1ull; width < chunk_count; width *= 2ull)
+    {
+        pool->parallel_for((chunk_count + 2ull * width - 1ull) / (2ull * width),
+            [source, target, width, &bound](size_t pair, uint32_t)
+            {
+                auto begin = bound(pair * 2ull * width);
+                auto middle = bound(pair * 2ull * width + width);
+                auto end = bound(pair * 2ull * width + 2ull * width);
+                std::merge(source->begin() + begin, source->begin() + middle, source->begin() + middle, source->begin() + end, target->begin() + begin);
+            });
+        std::swap(source, target);
+    }
+
+    if (source != &keys)
+        keys.swap(buffer);
+}
+
+// Spreads the low 10 bits of value to every third bit
+uint32_t expand_bits(uint32_t value)
+{
+    value = (value * 0x00010001u) & 0xFF0000FFu;
+    value = (value * 0x00000101u) & 0x0F00F00Fu;
+    value = (value * 0x00000011u) & 0xC30C30C3u;
+    value = (value * 0x00000005u) & 0x49249249u;
+    return value;
+}
+
+// Last position of the left half of the sorted range [first, last]: where the highest bit in
+// which the codes differ flips. Ranges of equal codes are halved.
+uint32_t find_morton_split(const std::vector<uint32_t>& codes, uint32_t first, uint32_t last)
+{
+    uint32_t first_code = codes[first];
+    uint32_t last_code = codes[last];
+    if (first_code == last_code)
+        return (first + last) >> 1u;
+
+    int common_prefix = std::countl_zero(first_code ^ last_code);
+
+    // Binary search for the last code that still shares more than the common prefix with the first one
+    uint32_t split = first;
+    uint32_t step = last - first;
+    do
+    {
+        step = (step + 1u) >> 1u;
+        uint32_t new_split = split + step;
+        if (new_split < last && std::countl_zero(first_code ^ codes[new_split]) > common_prefix)
+            split = new_split;
+    } while (step > 1u);
+
+    return split;
+}
+
+// PLOC cluster: a triangle in Morton order, or the merge of two clusters
+struct FBVHCluster
+{
+    FAxixAlignedBoundingBox m_aabb{};
+    // Sorted triangle position for leaves, left cluster otherwise
+    uint32_t m_left{};
+    // bvh_invalid_child for leaves
+    uint32_t m_right{ bvh_invalid_child };
+    uint32_t m_count{ 1u };
+};
+
+// Bounds of the part of the triangle that lies between lo and hi along axis
+FAxixAlignedBoundingBox clip_triangle(const FTriangle& triangle, uint32_t axis, float lo, float hi)
+{
+    glm::vec3 vertices[3]{ triangle.m_v0, triangle.m_v0 + triangle.m_e0, triangle.m_v0 + triangle.m_e1 };
+
+    FAxixAlignedBoundingBox bounds{};
+    for (uint32_t i = 0u; i < 3u; ++i)
+    {
+        auto& a = vertices[i];
+        auto& b = vertices[(i + 1u) % 3u];
+
+        if (a[axis] >= lo && a[axis] <= hi)
+            bounds.grow(FAxixAlignedBoundingBox(a, a));
+
+        for (float plane : { lo, hi })
+        {
+            if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane))
+            {
+                auto point = glm::mix(a, b, (plane - a[axis]) / (b[axis] - a[axis]));
+                point[axis] = plane;
+                bounds.grow(FAxixAlignedBoundingBox(point, point));
+            }
+        }
+    }
+
+    return bounds;
+}
+
+// Intersection of two boxes; empty boxes have m_min > m_max on some axis
+FAxixAlignedBoundingBox overlap(const FAxixAlignedBoundingBox& lhs, const FAxixAlignedBoundingBox& rhs)
+{
+    return FAxixAlignedBoundingBox(glm::max(lhs.m_min, rhs.m_min), glm::min(lhs.m_max, rhs.m_max));
+}
+
+bool is_empty(const FAxixAlignedBoundingBox& aabb)
+{
+    return aabb.m_min.x > aabb.m_max.x || aabb.m_min.y > aabb.m_max.y || aabb.m_min.z > aabb.m_max.z;
+}
+
+void FBVHStats::add_inner(const FAxixAlignedBoundingBox& bounds, const FAxixAlignedBoundingBox* children, uint32_t count, uint32_t depth)
+{
+    ++m_inner_nodes;
+    m_inner_area += bounds.area();
+    m_max_depth = glm::max(m_max_depth, depth);
+
+    float area = bounds.area();
+    if (area <= 0.f)
+        return;
+
+    float overlap_area{ 0.f };
+    for (uint32_t i = 0u; i < count; ++i)
+    {
+        for (uint32_t j = i + 1u; j < count; ++j)
+        {
+            auto shared = overlap(children[i], children[j]);
+            if (!is_empty(shared))
+                overlap_area += shared.area();
+        }
+    }
+    m_overlap += overlap_area / area;
+}
+
+void FBVHStats::add_leaf(const FAxixAlignedBoundingBox& bounds, uint32_t primitives, uint32_t depth)
+{
+    ++m_leaves;
+    m_primitives += primitives;
+    m_leaf_area += bounds.area() * static_cast<float>(primitives);
+    m_depth_sum += depth;
+    m_max_depth = glm::max(m_max_depth, depth);
+
+    if (m_leaf_sizes.size() <= primitives)
+        m_leaf_sizes.resize(primitives + 1ull, 0ull);
+    ++m_leaf_sizes[primitives];
+}
+
+void FBVHStats::finish(const FAxixAlignedBoundingBox& root, const FBVHConfig& config)
+{
+    float root_area = glm::max(root.area(), std::numeric_limits<float>::min());
+    m_sah_cost = (config.m_traversal_cost * m_inner_area + config.m_intersection_cost * m_leaf_area) / root_area;
+    m_average_depth = m_leaves > 0ull ? static_cast<float>(static_cast<double>(m_depth_sum) / static_cast<double>(m_leaves)) : 0.f;
+    m_overlap = m_inner_nodes > 0ull ? m_overlap / static_cast<float>(m_inner_nodes) : 0.f;
+}
+
+void FBVHStats::merge(const FBVHStats& other)
+{
+    auto weighted = [](float lhs, size_t lhs_weight, float rhs, size_t rhs_weight)
+        {
+            size_t weight = lhs_weight + rhs_weight;
+            return weight > 0ull ? (lhs * static_cast<float>(lhs_weight) + rhs * static_cast<float>(rhs_weight)) / static_cast<float>(weight) : 0.f;
+        };
+
+    m_sah_cost = weighted(m_sah_cost, m_primitives, other.m_sah_cost, other.m_primitives);
+    m_average_depth = weighted(m_average_depth, m_leaves, other.m_average_depth, other.m_leaves);
+    m_overlap = weighted(m_overlap, m_inner_nodes, other.m_overlap, other.m_inner_nodes);
+
+    m_inner_nodes += other.m_inner_nodes;
+    m_leaves += other.m_leaves;
+    m_primitives += other.m_primitives;
+    m_max_depth = glm::max(m_max_depth, other.m_max_depth);
+    m_node_memory += other.m_node_memory;
+    m_leaf_memory += other.m_leaf_memory;
+
+    if (m_leaf_sizes.size() < other.m_leaf_sizes.size())
+        m_leaf_sizes.resize(other.m_leaf_sizes.size(), 0ull);
+    for (size_t size = 0ull; size < other.m_leaf_sizes.size(); ++size)
+        m_leaf_sizes[size] += other.m_leaf_sizes[size];
+}
 
 CBVHTreeNew::~CBVHTreeNew()
 {
 }
 
-void CBVHTreeNew::create()
+void CBVHTreeNew::create(const FBVHConfig& config)
 {
-    // Initialize node array
-    m_vNodes.resize(m_vHittables.size() * 2ull + 64ull);
+    // The build reads the primitives
+    page_in();
+
+    m_config = config;
+    m_config.m_bins = glm::clamp(std::bit_ceil(m_config.m_bins), min_bins, max_bins);
+    m_config.m_max_leaf_size = glm::max(m_config.m_max_leaf_size, 1u);
+    // Spatial splits clip triangles
+    m_config.m_spatial_splits = m_config.m_spatial_splits && !m_bShapes;
 
-    // Initialize triangle indices
-    m_vIndices.resize(m_vHittables.size());
+    // Initialize node array. Spatial splits may add references, and with them nodes
+    size_t max_references = size();
+    if (m_config.m_builder == EBVHBuilder::eBinnedSAH && m_config.m_spatial_splits)
+        max_references += static_cast<size_t>(static_cast<double>(size()) * glm::max(m_config.m_duplication_budget, 0.f));
+    m_vNodes.resize(max_references * 2ull + 64ull);
+
+    // Initialize primitive indices
+    m_vIndices.resize(size());
     std::iota(m_vIndices.begin(), m_vIndices.end(), 0u);
 
-    // Initialize triangles
-    for (auto& hittable : m_vHittables)
-        hittable.create();
+    // Initialize triangles, their bounds and centroids. Shapes are their own intersection record.
+    m_vTriangles.resize(m_vHittables.size());
+    m_vBounds.resize(size());
+    m_vCentroids.resize(size());
+    CThreadPool::getInstance()->parallel_for(m_vIndices.size(),
+        [this](size_t index, uint32_t)
+        {
+            if (m_bShapes)
+            {
+                m_vBounds[index] = m_vShapes[index].bounds();
+                m_vCentroids[index] = m_vShapes[index].centroid();
+                return;
+            }
+
+            m_vTriangles[index] = m_vHittables[index].create();
+            m_vBounds[index] = m_vTriangles[index].bounds();
+            m_vCentroids[index] = m_vTriangles[index].centroid();
+        }, parallel_grain);
 
     // Build tree
     build();
@@ -29,225 +277,1490 @@ void CBVHTreeNew::create()
 
 void CBVHTreeNew::emplace(const CTriangle& hittable)
 {
+    assert(!m_bShapes);
     m_vHittables.emplace_back(hittable);
 }
 
+void CBVHTreeNew::emplace(const CShape& shape)
+{
+    assert(m_vHittables.empty());
+    m_vShapes.emplace_back(shape);
+    m_bShapes = true;
+}
+
 size_t CBVHTreeNew::size() const
 {
-    return m_vHittables.size();
+    if (m_pPager)
+        return m_vSlots.size();
+    return m_vHittables.size() + m_vShapes.size();
+}
+
+bool CBVHTreeNew::has_shapes() const
+{
+    return m_bShapes;
 }
 
 const CTriangle& CBVHTreeNew::get_triangle(size_t index) const
 {
+    if (m_pPager)
+        return acquire_primitive<CTriangle>(index);
     return m_vHittables.at(index);
 }
 
-bool CBVHTreeNew::hit(const FRay& ray, float t_min, float t_max, FHitResult& hit_result) const
+FTriangle CBVHTreeNew::get_geometry(size_t index) const
 {
-    return hit(ray, t_min, t_max, hit_result, 0u);
+    // Paged trees drop the dense records, rebuilding one is cheap next to sampling a light
+    if (m_pPager)
+        return get_triangle(index).create();
+    return m_vTriangles.at(index);
 }
 
-bool CBVHTreeNew::hit(const FRay& ray, float t_min, float t_max, FHitResult& hit_result, uint32_t node_idx) const
+const FAxixAlignedBoundingBox& CBVHTreeNew::get_bounds() const
 {
-    auto* node = &m_vNodes[node_idx];
-    uint32_t search_stack[64u];
-    uint32_t stack_idx{ 0u };
+    return m_bounds;
+}
 
-    bool has_hit{ false };
-    float closest_hit{ std::numeric_limits<float>::max() };
+size_t CBVHTreeNew::node_memory() const
+{
+    return m_vWideNodes.capacity() * sizeof(FBVHWideNode) + m_vCompressedNodes.capacity() * sizeof(FBVHCompressedNode);
+}
 
-    while (true)
-    {
-        if (node->is_leaf())
-        {
-            for (uint32_t i = 0u; i < node->m_count; i++)
-            {
-                uint32_t inst_prim = (node_idx << 20u) + m_vIndices[node->m_left + i];
-                auto& hittable = m_vHittables[inst_prim & 0xfffff];
-                if (hittable.hit(ray, t_min, closest_hit, hit_result))
-                {
-                    has_hit = true;
-                    closest_hit = hit_result.m_distance;
-                }
-            }
+size_t CBVHTreeNew::leaf_memory() const
+{
+    return m_vTriangleBlocks.capacity() * sizeof(FTriangle4) + m_vShapeBlocks.capacity() * sizeof(FShape4);
+}
 
-            if (stack_idx == 0u) 
-                break; 
-            else 
-                node = &m_vNodes[search_stack[--stack_idx]];
-            continue;
-        }
+const FTriangle4* CBVHTreeNew::triangle_blocks() const
+{
+    if (m_pPager)
+        return reinterpret_cast<const FTriangle4*>(m_pPager->data(m_block_offset));
+    return m_vTriangleBlocks.data();
+}
 
-        uint32_t left_id{ node->m_left };
-        uint32_t right_id{ node->m_left + 1u };
+const FShape4* CBVHTreeNew::shape_blocks() const
+{
+    if (m_pPager)
+        return reinterpret_cast<const FShape4*>(m_pPager->data(m_block_offset));
+    return m_vShapeBlocks.data();
+}
 
-        auto dist1 = m_vNodes[left_id].m_aabb.hit(ray, hit_result);
-        auto dist2 = m_vNodes[right_id].m_aabb.hit(ray, hit_result);
+void CBVHTreeNew::write_clusters(CGeometryPager& pager)
+{
+    if (m_bShapes)
+        write_clusters(pager, m_vShapeBlocks, m_vShapes);
+    else
+        write_clusters(pager, m_vTriangleBlocks, m_vHittables);
+}
 
-        if (dist1 > dist2) 
-        { 
-            std::swap(dist1, dist2); 
-            std::swap(left_id, right_id);
-        }
+template<class _Block, class _Primitive>
+void CBVHTreeNew::write_clusters(CGeometryPager& pager, const cache_aligned_vector<_Block>& blocks, const std::vector<_Primitive>& primitives)
+{
+    static_assert(std::is_trivially_copyable_v<_Block> && std::is_trivially_copyable_v<_Primitive>);
 
-        if (math::compare_float(dist1, std::numeric_limits<float>::max()))
-        {
-            if (stack_idx == 0) 
-                break; 
-            else 
-                node = &m_vNodes[search_stack[--stack_idx]];
-        }
-        else
+    // Primitives in the order the leaves first reference them, so a leaf and the attributes of
+    // its hits are paged in from neighbouring clusters
+    constexpr const uint32_t unassigned{ std::numeric_limits<uint32_t>::max() };
+    m_vSlots.assign(primitives.size(), unassigned);
+    std::vector<_Primitive> ordered{};
+    ordered.reserve(primitives.size());
+    for (auto& block : blocks)
+    {
+        for (auto primitive_id : block.m_primitive_id)
         {
-            node = &m_vNodes[left_id];
-            if (!math::compare_float(dist2, std::numeric_limits<float>::max()))
-                search_stack[stack_idx++] = right_id;
+            if (primitive_id == _Block::invalid_primitive || m_vSlots[primitive_id] != unassigned)
+                continue;
+
+            m_vSlots[primitive_id] = static_cast<uint32_t>(ordered.size());
+            ordered.emplace_back(primitives[primitive_id]);
         }
     }
 
-    return has_hit;
+    m_block_count = blocks.size();
+    m_block_offset = pager.append(blocks.data(), blocks.size() * sizeof(_Block));
+    m_primitive_offset = pager.append(ordered.data(), ordered.size() * sizeof(_Primitive));
 }
 
-void CBVHTreeNew::build()
+void CBVHTreeNew::page_out(CGeometryPager* pager)
 {
-    m_size = 2ull;
+    m_pPager = pager;
 
-    auto& root = m_vNodes[0ull];
-    root.m_left = 0u;
-    root.m_count = m_vHittables.size();
+    // Each vector is swapped with an empty one so its memory is actually released
+    std::vector<FTriangle>().swap(m_vTriangles);
+    std::vector<CTriangle>().swap(m_vHittables);
+    std::vector<CShape>().swap(m_vShapes);
+    cache_aligned_vector<FTriangle4>().swap(m_vTriangleBlocks);
+    cache_aligned_vector<FShape4>().swap(m_vShapeBlocks);
+}
 
-    FAxixAlignedBoundingBox centroid_aabb{};
-    grow(0u, centroid_aabb);
+void CBVHTreeNew::page_in()
+{
+    if (!m_pPager)
+        return;
 
-    subdivide(0u, 0u, centroid_aabb);
+    if (m_bShapes)
+        page_in(m_vShapeBlocks, m_vShapes);
+    else
+        page_in(m_vTriangleBlocks, m_vHittables);
+
+    std::vector<uint32_t>().swap(m_vSlots);
+    m_pPager = nullptr;
 }
 
-void CBVHTreeNew::grow(uint32_t node_idx, FAxixAlignedBoundingBox& aabb)
+template<class _Block, class _Primitive>
+void CBVHTreeNew::page_in(cache_aligned_vector<_Block>& blocks, std::vector<_Primitive>& primitives)
 {
-    auto& node = m_vNodes[node_idx];
+    auto* paged_blocks = reinterpret_cast<const _Block*>(m_pPager->data(m_block_offset));
+    blocks.assign(paged_blocks, paged_blocks + m_block_count);
 
-    node.m_aabb.m_min = aabb.m_min = glm::vec3(std::numeric_limits<float>::max());
-    node.m_aabb.m_max = aabb.m_max = glm::vec3(-std::numeric_limits<float>::max());
+    auto* paged_primitives = reinterpret_cast<const _Primitive*>(m_pPager->data(m_primitive_offset));
+    primitives.clear();
+    primitives.reserve(m_vSlots.size());
+    for (auto slot : m_vSlots)
+        primitives.emplace_back(paged_primitives[slot]);
+}
 
-    for (uint32_t first = node.m_left, i = 0u; i < node.m_count; ++i)
+FBVHStats CBVHTreeNew::analyze() const
+{
+    FBVHStats stats{};
+    if (m_bShapes)
+        stats = !m_vCompressedNodes.empty() ? analyze(m_vCompressedNodes, shape_blocks()) : analyze(m_vWideNodes, shape_blocks());
+    else
+        stats = !m_vCompressedNodes.empty() ? analyze(m_vCompressedNodes, triangle_blocks()) : analyze(m_vWideNodes, triangle_blocks());
+    stats.m_node_memory = node_memory();
+    stats.m_leaf_memory = leaf_memory();
+    return stats;
+}
+
+template<class _Node, class _Block>
+FBVHStats CBVHTreeNew::analyze(const cache_aligned_vector<_Node>& nodes, const _Block* blocks) const
+{
+    struct FStackEntry
     {
-        uint32_t hittable_idx = m_vIndices[first + i];
-        auto& hittable = m_vHittables[hittable_idx];
+        uint32_t m_node;
+        uint32_t m_depth;
+        FAxixAlignedBoundingBox m_bounds;
+    };
 
-        auto& triangle_bounds = hittable.bounds();
-        node.m_aabb.grow(triangle_bounds);
+    FBVHStats stats{};
+    if (size() == 0ull || nodes.empty())
+        return stats;
 
-        auto& centroid = hittable.centroid();
-        aabb.m_min = glm::min(aabb.m_min, centroid);
-        aabb.m_max = glm::max(aabb.m_max, centroid);
+    std::vector<FStackEntry> search_stack{ { 0u, 0u, m_bounds } };
+    while (!search_stack.empty())
+    {
+        auto entry = search_stack.back();
+        search_stack.pop_back();
+
+        auto& node = nodes[entry.m_node];
+        int mask = node.child_mask();
+
+        // Decoded bounds, so compressed trees are measured as they are traversed
+        __m128 bmin[3], bmax[3];
+        node.get_bounds(bmin, bmax);
+        alignas(16) float lo[3][bvh_width], hi[3][bvh_width];
+        for (uint32_t axis = 0u; axis < 3u; ++axis)
+        {
+            _mm_store_ps(lo[axis], bmin[axis]);
+            _mm_store_ps(hi[axis], bmax[axis]);
+        }
+
+        FAxixAlignedBoundingBox children[bvh_width]{};
+        uint32_t child_count{ 0u };
+        for (uint32_t slot = 0u; slot < bvh_width; ++slot)
+        {
+            if ((mask & (1 << slot)) == 0)
+                continue;
+
+            auto& child = children[child_count++];
+            child = FAxixAlignedBoundingBox(glm::vec3(lo[0][slot], lo[1][slot], lo[2][slot]), glm::vec3(hi[0][slot], hi[1][slot], hi[2][slot]));
+            if (node.m_count[slot] == 0u)
+            {
+                search_stack.push_back({ node.m_child[slot], entry.m_depth + 1u, child });
+                continue;
+            }
+
+            uint32_t primitives{ 0u };
+            auto* leaf = acquire(blocks, node.m_child[slot], node.m_count[slot]);
+            for (uint32_t block = 0u; block < node.m_count[slot]; ++block)
+            {
+                for (auto primitive_id : leaf[block].m_primitive_id)
+                    primitives += primitive_id != _Block::invalid_primitive ? 1u : 0u;
+            }
+            stats.add_leaf(child, primitives, entry.m_depth + 1u);
+        }
+
+        stats.add_inner(entry.m_bounds, children, child_count, entry.m_depth);
     }
+
+    stats.finish(m_bounds, m_config);
+    return stats;
 }
 
-void CBVHTreeNew::subdivide(uint32_t node_idx, uint32_t depth, FAxixAlignedBoundingBox& centroid)
+bool CBVHTreeNew::hit(const FRay& ray, float t_min, float t_max, FHitResult& hit_result) const
 {
-    auto& node = m_vNodes[node_idx];
+    if (m_bShapes)
+    {
+        if (!m_vCompressedNodes.empty())
+            return hit(m_vCompressedNodes, shape_blocks(), 0u, ray, t_min, t_max, hit_result);
+        return hit(m_vWideNodes, shape_blocks(), 0u, ray, t_min, t_max, hit_result);
+    }
 
-    uint32_t axis{ 0u }, split_pos{ 0u };
-    float split_cost = find_best_split(node, axis, split_pos, centroid);
+    if (!m_vCompressedNodes.empty())
+        return hit(m_vCompressedNodes, triangle_blocks(), 0u, ray, t_min, t_max, hit_result);
+    return hit(m_vWideNodes, triangle_blocks(), 0u, ray, t_min, t_max, hit_result);
+}
 
-    auto nosplit_cost = node.cost();
-    if (math::greater_equal_float(split_cost, nosplit_cost))
+void CBVHTreeNew::hit(FRayPacket& packet, float t_min, float t_max) const
+{
+    if (m_bShapes)
+    {
+        if (!m_vCompressedNodes.empty())
+            hit(m_vCompressedNodes, shape_blocks(), packet, t_min, t_max);
+        else
+            hit(m_vWideNodes, shape_blocks(), packet, t_min, t_max);
         return;
+    }
 
-    uint32_t i = node.m_left;
-    uint32_t j = i + node.m_count - 1u;
+    if (!m_vCompressedNodes.empty())
+        hit(m_vCompressedNodes, triangle_blocks(), packet, t_min, t_max);
+    else
+        hit(m_vWideNodes, triangle_blocks(), packet, t_min, t_max);
+}
 
-    float scale = static_cast<float>(bins) / (centroid.m_max[axis] - centroid.m_min[axis]);
-    while (i <= j)
+void CBVHTreeNew::resolve_hit(const FRay& ray, const FHitResult& hit_result, const glm::mat3& normal, FSurfaceInteraction& surface) const
+{
+    if (m_pPager)
     {
-        auto hittable_idx = m_vIndices[i];
-        auto& hittable = m_vHittables[hittable_idx];
+        if (m_bShapes)
+            acquire_primitive<CShape>(hit_result.m_primitive_id).interpolate(ray, hit_result, normal, surface);
+        else
+            acquire_primitive<CTriangle>(hit_result.m_primitive_id).interpolate(ray, hit_result, normal, surface);
+    }
+    else if (m_bShapes)
+        m_vShapes[hit_result.m_primitive_id].interpolate(ray, hit_result, normal, surface);
+    else
+        m_vHittables[hit_result.m_primitive_id].interpolate(ray, hit_result, normal, surface);
+}
 
-        uint32_t bin_idx = glm::min(bins - 1u, static_cast<uint32_t>((hittable.centroid()[axis] - centroid.m_min[axis]) * scale));
-        if (bin_idx < split_pos) 
-            i++; 
-        else 
-            std::swap(m_vIndices[i], m_vIndices[j--]);
+bool CBVHTreeNew::occluded(const FRay& ray, float t_min, float t_max) const
+{
+    if (m_bShapes)
+    {
+        if (!m_vCompressedNodes.empty())
+            return occluded(m_vCompressedNodes, shape_blocks(), ray, t_min, t_max);
+        return occluded(m_vWideNodes, shape_blocks(), ray, t_min, t_max);
     }
 
-    uint32_t left_count = i - node.m_left;
-    if (left_count == 0u || left_count == node.m_count)
-        return;
+    if (!m_vCompressedNodes.empty())
+        return occluded(m_vCompressedNodes, triangle_blocks(), ray, t_min, t_max);
+    return occluded(m_vWideNodes, triangle_blocks(), ray, t_min, t_max);
+}
 
-    int left_child_idx = m_size++;
-    m_vNodes[left_child_idx].m_left = node.m_left;
-    m_vNodes[left_child_idx].m_count = left_count;
+template<class _Node, class _Block>
+bool CBVHTreeNew::hit(const cache_aligned_vector<_Node>& nodes, const _Block* blocks, uint32_t root, const FRay& ray, float t_min, float t_max, FHitResult& hit_result) const
+{
+    struct FStackEntry
+    {
+        uint32_t m_child;
+        uint32_t m_count;
+        float m_distance;
+    };
 
-    int right_chilt_idx = m_size++;
-    m_vNodes[right_chilt_idx].m_left = i;
-    m_vNodes[right_chilt_idx].m_count = node.m_count - left_count;
+    const __m128 origin[3]{ _mm_set1_ps(ray.m_origin.x), _mm_set1_ps(ray.m_origin.y), _mm_set1_ps(ray.m_origin.z) };
+    const __m128 direction[3]{ _mm_set1_ps(ray.m_direction.x), _mm_set1_ps(ray.m_direction.y), _mm_set1_ps(ray.m_direction.z) };
+    const __m128 inv_direction[3]{ _mm_set1_ps(ray.m_inv_direction.x), _mm_set1_ps(ray.m_inv_direction.y), _mm_set1_ps(ray.m_inv_direction.z) };
 
-    node.m_left = left_child_idx;
-    node.m_count = 0u;
+    CTraversalStack<FStackEntry> search_stack{};
+    search_stack.push({ root, 0u, 0.f });
 
-    // Subdivide left
-    grow(left_child_idx, centroid);
-    subdivide(left_child_idx, depth + 1u, centroid);
+    bool has_hit{ false };
+    float closest_hit{ glm::min(t_max, std::numeric_limits<float>::max()) };
 
-    // Subdivide right
-    grow(right_chilt_idx, centroid);
-    subdivide(right_chilt_idx, depth + 1u, centroid);
+    while (!search_stack.empty())
+    {
+        auto entry = search_stack.pop();
+
+        // Entry was pushed before a closer hit was found
+        if (entry.m_distance >= closest_hit)
+            continue;
+
+        if (entry.m_count > 0u)
+        {
+            BVH_STATS(++bvh_stats::current().m_leaves);
+            BVH_STATS(bvh_stats::current().m_triangles += entry.m_count * 4u);
+            auto* leaf = acquire(blocks, entry.m_child, entry.m_count);
+            for (uint32_t i = 0u; i < entry.m_count; i++)
+            {
+                if (leaf[i].intersect(origin, direction, t_min, closest_hit, hit_result))
+                {
+                    has_hit = true;
+                    closest_hit = hit_result.m_distance;
+                }
+            }
+            continue;
+        }
+
+        auto& node = nodes[entry.m_child];
+        BVH_STATS(++bvh_stats::current().m_inner_nodes);
+
+        __m128 entry_distance;
+        int mask = node.intersect(origin, inv_direction, closest_hit, entry_distance);
+        if (mask == 0)
+            continue;
+
+        alignas(16) float distances[bvh_width];
+        _mm_store_ps(distances, entry_distance);
+
+        // Push hit children farthest first so the nearest one is popped next
+        FStackEntry children[bvh_width];
+        uint32_t child_count{ 0u };
+        for (uint32_t slot = 0u; slot < bvh_width; ++slot)
+        {
+            if ((mask & (1 << slot)) == 0)
+                continue;
+
+            FStackEntry child{ node.m_child[slot], node.m_count[slot], distances[slot] };
+            uint32_t pos = child_count++;
+            while (pos > 0u && children[pos - 1u].m_distance < child.m_distance)
+            {
+                children[pos] = children[pos - 1u];
+                --pos;
+            }
+            children[pos] = child;
+        }
+
+        for (uint32_t c = 0u; c < child_count; ++c)
+            search_stack.push(children[c]);
+        BVH_STATS(bvh_stats::current().m_stack_depth = glm::max(bvh_stats::current().m_stack_depth, search_stack.size()));
+    }
+
+    return has_hit;
 }
 
-float CBVHTreeNew::find_best_split(FBVHNode& node, uint32_t& axis, uint32_t& split_pos, FAxixAlignedBoundingBox& centroid)
+template<class _Node, class _Block>
+void CBVHTreeNew::hit(const cache_aligned_vector<_Node>& nodes, const _Block* blocks, FRayPacket& packet, float t_min, float t_max) const
 {
-    float best_cost = std::numeric_limits<float>::max();
-    for (uint32_t a = 0; a < 3u; ++a)
+    // Every entry carries the mask of packet rays that hit its box
+    struct FStackEntry
     {
-        float boundx_min = centroid.m_min[a];
-        float boundx_max = centroid.m_max[a];
-
-        if (math::compare_float(boundx_min, boundx_max))
-            continue;
+        uint32_t m_child;
+        uint32_t m_count;
+        uint64_t m_active;
+        float m_distance;
+    };
 
-        float scale = static_cast<float>(bins) / (boundx_max - boundx_min);
+    struct FPacketRay
+    {
+        __m128 m_origin[3];
+        __m128 m_direction[3];
+        __m128 m_inv_direction[3];
+    };
 
-        std::array<float, bins - 1u> left_area;
-        std::array<float, bins - 1u> right_area;
+    if (packet.m_size == 0u)
+        return;
 
-        uint32_t left_sum{ 0u };
-        uint32_t right_sum{ 0u };
+    float closest[FRayPacket::max_size];
+    for (uint32_t r = 0u; r < packet.m_size; ++r)
+        closest[r] = glm::min(glm::min(packet.m_hits[r].m_distance, t_max), std::numeric_limits<float>::max());
 
-        std::array<FBVHTreeBin, bins> bin;
+    uint64_t all_rays = packet.m_size == 64u ? ~0ull : (1ull << packet.m_size) - 1ull;
 
-        for (uint32_t i = 0u; i < node.m_count; i++)
+    // Without a shared direction per axis no box can be culled for the whole packet
+    if (!packet.m_bCoherent)
+    {
+        for (uint32_t r = 0u; r < packet.m_size; ++r)
         {
-            auto hittable_idx = m_vIndices[node.m_left + i];
-            auto& hittable = m_vHittables[hittable_idx];
-            int binIdx = glm::min(bins - 1u, static_cast<uint32_t>((hittable.centroid()[a] - boundx_min) * scale));
-            bin[binIdx].m_count++;
-            bin[binIdx].m_bounds.grow(hittable.bounds());
+            BVH_STATS(bvh_stats::lane = r);
+            if (hit(nodes, blocks, 0u, packet.m_rays[r], t_min, closest[r], packet.m_hits[r]))
+                closest[r] = packet.m_hits[r].m_distance;
         }
+        BVH_STATS(bvh_stats::lane = 0u);
+        return;
+    }
 
-        FAxixAlignedBoundingBox left, right;
-        for (uint32_t i = 0u; i < bins - 1u; i++)
+    FPacketRay rays[FRayPacket::max_size];
+    for (uint32_t r = 0u; r < packet.m_size; ++r)
+    {
+        auto& ray = packet.m_rays[r];
+        for (uint32_t axis = 0u; axis < 3u; ++axis)
         {
-            left_sum += bin[i].m_count;
-            left.grow(bin[i].m_bounds);
-            left_area[i] = static_cast<float>(left_sum) * left.area();
+            rays[r].m_origin[axis] = _mm_set1_ps(ray.m_origin[axis]);
+            rays[r].m_direction[axis] = _mm_set1_ps(ray.m_direction[axis]);
+            rays[r].m_inv_direction[axis] = _mm_set1_ps(ray.m_inv_direction[axis]);
+        }
+    }
+
+    const __m128 origin_min[3]{ _mm_set1_ps(packet.m_origin_min.x), _mm_set1_ps(packet.m_origin_min.y), _mm_set1_ps(packet.m_origin_min.z) };
+    const __m128 origin_max[3]{ _mm_set1_ps(packet.m_origin_max.x), _mm_set1_ps(packet.m_origin_max.y), _mm_set1_ps(packet.m_origin_max.z) };
+    const __m128 inv_direction_min[3]{ _mm_set1_ps(packet.m_inv_direction_min.x), _mm_set1_ps(packet.m_inv_direction_min.y), _mm_set1_ps(packet.m_inv_direction_min.z) };
+    const __m128 inv_direction_max[3]{ _mm_set1_ps(packet.m_inv_direction_max.x), _mm_set1_ps(packet.m_inv_direction_max.y), _mm_set1_ps(packet.m_inv_direction_max.z) };
 
-            right_sum += bin[bins - 1u - i].m_count;
-            right.grow(bin[bins - 1u - i].m_bounds);
-            right_area[bins - 2u - i] = static_cast<float>(right_sum) * right.area();
+    CTraversalStack<FStackEntry> search_stack{};
+    search_stack.push({ 0u, 0u, all_rays, 0.f });
+    BVH_STATS(uint32_t packet_depth{ 1u });
+
+    while (!search_stack.empty())
+    {
+        auto entry = search_stack.pop();
+
+        if (entry.m_count > 0u)
+        {
+            auto* leaf = acquire(blocks, entry.m_child, entry.m_count);
+            for (uint64_t active = entry.m_active; active != 0ull; active &= active - 1ull)
+            {
+                uint32_t r = static_cast<uint32_t>(std::countr_zero(active));
+                BVH_STATS(++bvh_stats::rays[r].m_leaves);
+                BVH_STATS(bvh_stats::rays[r].m_triangles += entry.m_count * 4u);
+                for (uint32_t i = 0u; i < entry.m_count; i++)
+                {
+                    if (leaf[i].intersect(rays[r].m_origin, rays[r].m_direction, t_min, closest[r], packet.m_hits[r]))
+                        closest[r] = packet.m_hits[r].m_distance;
+                }
+            }
+            continue;
         }
 
-        scale = (boundx_max - boundx_min) / static_cast<float>(bins);
-        for (uint32_t i = 0u; i < bins - 1u; i++)
+        // The rays have diverged, finish the subtree one ray at a time
+        if (std::popcount(entry.m_active) < packet_min_rays)
         {
-            const float plane_cost = left_area[i] + right_area[i];
-            if (plane_cost < best_cost)
+            for (uint64_t active = entry.m_active; active != 0ull; active &= active - 1ull)
             {
-                axis = a;
-                split_pos = i + 1u;
-                best_cost = plane_cost;
+                uint32_t r = static_cast<uint32_t>(std::countr_zero(active));
+                BVH_STATS(bvh_stats::lane = r);
+                if (hit(nodes, blocks, entry.m_child, packet.m_rays[r], t_min, closest[r], packet.m_hits[r]))
+                    closest[r] = packet.m_hits[r].m_distance;
             }
+            BVH_STATS(bvh_stats::lane = 0u);
+            continue;
         }
-    }
 
-    return best_cost;
+        auto& node = nodes[entry.m_child];
+
+        __m128 bmin[3], bmax[3];
+        node.get_bounds(bmin, bmax);
+
+        // Drop children no ray of the packet can reach before testing rays one by one
+        float farthest{ 0.f };
+        for (uint64_t active = entry.m_active; active != 0ull; active &= active - 1ull)
+            farthest = glm::max(farthest, closest[std::countr_zero(active)]);
+
+        __m128 entry_bound;
+        int candidates = node.child_mask() & math::packet_aabb_intersect4(origin_min, origin_max, inv_direction_min, inv_direction_max, bmin, bmax, farthest, entry_bound);
+        if (candidates == 0)
+            continue;
+
+        uint64_t child_active[bvh_width]{};
+        float distances[bvh_width]{};
+        int found{ 0 };
+        for (uint64_t active = entry.m_active; active != 0ull; active &= active - 1ull)
+        {
+            uint32_t r = static_cast<uint32_t>(std::countr_zero(active));
+            BVH_STATS(++bvh_stats::rays[r].m_inner_nodes);
+
+            __m128 entry_distance;
+            int mask = math::ray_aabb_intersect4(rays[r].m_origin, rays[r].m_inv_direction, bmin, bmax, closest[r], entry_distance) & candidates;
+            if (mask == 0)
+                continue;
+
+            alignas(16) float ray_distances[bvh_width];
+            _mm_store_ps(ray_distances, entry_distance);
+            for (uint32_t slot = 0u; slot < bvh_width; ++slot)
+            {
+                if ((mask & (1 << slot)) == 0)
+                    continue;
+
+                // Ordered by the entry distance of the first ray to reach the child
+                if ((found & (1 << slot)) == 0)
+                    distances[slot] = ray_distances[slot];
+                child_active[slot] |= 1ull << r;
+            }
+            found |= mask;
+        }
+
+        // Push farthest first so the nearest child is popped next
+        FStackEntry children[bvh_width];
+        uint32_t child_count{ 0u };
+        for (uint32_t slot = 0u; slot < bvh_width; ++slot)
+        {
+            if ((found & (1 << slot)) == 0)
+                continue;
+
+            FStackEntry child{ node.m_child[slot], node.m_count[slot], child_active[slot], distances[slot] };
+            uint32_t pos = child_count++;
+            while (pos > 0u && children[pos - 1u].m_distance < child.m_distance)
+            {
+                children[pos] = children[pos - 1u];
+                --pos;
+            }
+            children[pos] = child;
+        }
+
+        for (uint32_t c = 0u; c < child_count; ++c)
+            search_stack.push(children[c]);
+        BVH_STATS(packet_depth = glm::max(packet_depth, search_stack.size()));
+    }
+
+    // The packet shares one stack, so every ray is charged its full depth
+    BVH_STATS(for (uint32_t r = 0u; r < packet.m_size; ++r) bvh_stats::rays[r].m_stack_depth = glm::max(bvh_stats::rays[r].m_stack_depth, packet_depth));
+}
+
+template<class _Node, class _Block>
+bool CBVHTreeNew::occluded(const cache_aligned_vector<_Node>& nodes, const _Block* blocks, const FRay& ray, float t_min, float t_max) const
+{
+    const __m128 origin[3]{ _mm_set1_ps(ray.m_origin.x), _mm_set1_ps(ray.m_origin.y), _mm_set1_ps(ray.m_origin.z) };
+    const __m128 direction[3]{ _mm_set1_ps(ray.m_direction.x), _mm_set1_ps(ray.m_direction.y), _mm_set1_ps(ray.m_direction.z) };
+    const __m128 inv_direction[3]{ _mm_set1_ps(ray.m_inv_direction.x), _mm_set1_ps(ray.m_inv_direction.y), _mm_set1_ps(ray.m_inv_direction.z) };
+
+    CTraversalStack<uint32_t> search_stack{};
+    search_stack.push(0u);
+
+    while (!search_stack.empty())
+    {
+        auto& node = nodes[search_stack.pop()];
+
+        __m128 entry_distance;
+        int mask = node.intersect(origin, inv_direction, t_max, entry_distance);
+
+        // Any intersection ends the query, so children are visited without distance sorting
+        for (uint32_t slot = 0u; slot < bvh_width; ++slot)
+        {
+            if ((mask & (1 << slot)) == 0)
+                continue;
+
+            if (node.m_count[slot] == 0u)
+            {
+                search_stack.push(node.m_child[slot]);
+                continue;
+            }
+
+            auto* leaf = acquire(blocks, node.m_child[slot], node.m_count[slot]);
+            for (uint32_t i = 0u; i < node.m_count[slot]; i++)
+            {
+                if (leaf[i].intersect(origin, direction, t_min, t_max))
+                    return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void CBVHTreeNew::build()
+{
+    // Nothing to split; a root without children never reports a hit
+    if (size() == 0ull)
+    {
+        m_vWideNodes.assign(1ull, FBVHWideNode{});
+        m_vCompressedNodes.clear();
+        m_bounds = FAxixAlignedBoundingBox{};
+        return;
+    }
+
+    m_size = 2u;
+
+    // Spawn tasks only while there are idle workers left to take them
+    m_max_task_depth = 0u;
+    for (uint32_t workers = 1u; workers < CThreadPool::getInstance()->worker_count(); workers <<= 1u)
+        ++m_max_task_depth;
+    m_max_task_depth += 2u;
+
+    if (m_config.m_builder == EBVHBuilder::eLBVH)
+        build_lbvh();
+    else if (m_config.m_builder == EBVHBuilder::ePLOC)
+        build_ploc();
+    else if (m_config.m_spatial_splits)
+        build_spatial();
+    else
+    {
+        auto& root = m_vNodes[0ull];
+        root.m_left = 0u;
+        root.m_count = static_cast<uint32_t>(size());
+
+        FAxixAlignedBoundingBox centroid_aabb{};
+        grow(0u, centroid_aabb);
+
+        subdivide(0u, 0u, centroid_aabb);
+    }
+
+    m_bounds = m_vNodes[0ull].m_aabb;
+
+    // The collapse is a serial depth-first walk, so the wide layout does not depend on task scheduling
+    m_vWideNodes.clear();
+    m_vWideNodes.reserve(m_size / 2u + 1u);
+    m_vTriangleBlocks.clear();
+    m_vTriangleBlocks.reserve(m_vTriangles.size() / 2u + 1u);
+    m_vShapeBlocks.clear();
+    m_vShapeBlocks.reserve(m_vShapes.size() / 2u + 1u);
+    collapse(0u);
+
+    // Reserves above are upper bounds
+    m_vWideNodes.shrink_to_fit();
+    m_vTriangleBlocks.shrink_to_fit();
+    m_vShapeBlocks.shrink_to_fit();
+
+    m_vCompressedNodes.clear();
+    if (m_config.m_compressed_nodes && !compress())
+        log_warning("A BVH leaf holds more than {} triangle blocks, keeping uncompressed nodes.", FBVHCompressedNode::max_count);
+
+    m_vNodes.clear();
+    m_vNodes.shrink_to_fit();
+    m_vIndices.clear();
+    m_vIndices.shrink_to_fit();
+    m_vBounds.clear();
+    m_vBounds.shrink_to_fit();
+    m_vCentroids.clear();
+    m_vCentroids.shrink_to_fit();
+}
+
+uint32_t CBVHTreeNew::collapse(uint32_t node_idx)
+{
+    uint32_t wide_idx = static_cast<uint32_t>(m_vWideNodes.size());
+    m_vWideNodes.emplace_back();
+
+    // A leaf root (tiny or empty scene) becomes a single-slot wide node
+    std::array<uint32_t, bvh_width> candidates{};
+    uint32_t candidate_count{ 0u };
+    if (m_vNodes[node_idx].is_leaf())
+    {
+        if (m_vNodes[node_idx].m_count > 0u)
+            candidates[candidate_count++] = node_idx;
+    }
+    else
+    {
+        candidates[candidate_count++] = m_vNodes[node_idx].m_left;
+        candidates[candidate_count++] = m_vNodes[node_idx].m_left + 1u;
+    }
+
+    // Pull grandchildren up, always opening the inner candidate with the largest surface area
+    while (candidate_count < bvh_width)
+    {
+        uint32_t best{ bvh_invalid_child };
+        float best_area{ -1.f };
+        for (uint32_t c = 0u; c < candidate_count; ++c)
+        {
+            auto& candidate = m_vNodes[candidates[c]];
+            if (candidate.is_leaf())
+                continue;
+
+            float area = candidate.m_aabb.area();
+            if (area > best_area)
+            {
+                best = c;
+                best_area = area;
+            }
+        }
+
+        if (best == bvh_invalid_child)
+            break;
+
+        uint32_t left = m_vNodes[candidates[best]].m_left;
+        candidates[best] = left;
+        candidates[candidate_count++] = left + 1u;
+    }
+
+    // Leaf blocks of the node come first, then inner children by decreasing surface area: the
+    // child most rays enter is stored right after its parent, colder subtrees further away
+    std::array<uint32_t, bvh_width> order{};
+    std::iota(order.begin(), order.begin() + candidate_count, 0u);
+    std::stable_sort(order.begin(), order.begin() + candidate_count,
+        [this, &candidates](uint32_t lhs, uint32_t rhs)
+        {
+            auto& left = m_vNodes[candidates[lhs]];
+            auto& right = m_vNodes[candidates[rhs]];
+            if (left.is_leaf() != right.is_leaf())
+                return left.is_leaf();
+            return left.m_aabb.area() > right.m_aabb.area();
+        });
+
+    for (uint32_t i = 0u; i < candidate_count; ++i)
+    {
+        uint32_t slot = order[i];
+        auto& candidate = m_vNodes[candidates[slot]];
+        if (candidate.is_leaf())
+        {
+            uint32_t block_count = (candidate.m_count + 3u) / 4u;
+            m_vWideNodes[wide_idx].set_child(slot, candidate.m_aabb, pack_leaf(candidate.m_left, candidate.m_count), block_count);
+            continue;
+        }
+
+        // Collapse may reallocate m_vWideNodes, so index the parent after recursing
+        uint32_t child_idx = collapse(candidates[slot]);
+        m_vWideNodes[wide_idx].set_child(slot, candidate.m_aabb, child_idx, 0u);
+    }
+
+    return wide_idx;
+}
+
+uint32_t CBVHTreeNew::pack_leaf(uint32_t first, uint32_t count)
+{
+    if (m_bShapes)
+    {
+        uint32_t block_idx = static_cast<uint32_t>(m_vShapeBlocks.size());
+        m_vShapeBlocks.resize(block_idx + (count + 3u) / 4u);
+
+        for (uint32_t i = 0u; i < count; ++i)
+        {
+            uint32_t shape_idx = m_vIndices[first + i];
+            m_vShapeBlocks[block_idx + i / 4u].set(i % 4u, m_vShapes[shape_idx], shape_idx);
+        }
+
+        return block_idx;
+    }
+
+    uint32_t block_idx = static_cast<uint32_t>(m_vTriangleBlocks.size());
+    m_vTriangleBlocks.resize(block_idx + (count + 3u) / 4u);
+
+    for (uint32_t i = 0u; i < count; ++i)
+    {
+        uint32_t hittable_idx = m_vIndices[first + i];
+        m_vTriangleBlocks[block_idx + i / 4u].set(i % 4u, m_vTriangles[hittable_idx], hittable_idx);
+    }
+
+    return block_idx;
+}
+
+bool CBVHTreeNew::compress()
+{
+    for (auto& node : m_vWideNodes)
+    {
+        for (uint32_t slot = 0u; slot < bvh_width; ++slot)
+        {
+            if (node.m_count[slot] > FBVHCompressedNode::max_count)
+                return false;
+        }
+    }
+
+    m_vCompressedNodes.resize(m_vWideNodes.size());
+    CThreadPool::getInstance()->parallel_for(m_vWideNodes.size(),
+        [this](size_t node_idx, uint32_t)
+        {
+            auto& node = m_vWideNodes[node_idx];
+            auto& compressed = m_vCompressedNodes[node_idx];
+            auto child_bounds = [&node](uint32_t slot)
+                {
+                    return FAxixAlignedBoundingBox({ node.m_min[0][slot], node.m_min[1][slot], node.m_min[2][slot] }, { node.m_max[0][slot], node.m_max[1][slot], node.m_max[2][slot] });
+                };
+
+            // Quantize against the union of the children rather than the parent's box for
+            // this node, which is never smaller
+            FAxixAlignedBoundingBox frame{};
+            for (uint32_t slot = 0u; slot < bvh_width; ++slot)
+            {
+                if (node.m_child[slot] != bvh_invalid_child)
+                    frame.grow(child_bounds(slot));
+            }
+
+            if (is_empty(frame))
+                return;
+
+            compressed.set_frame(frame);
+            for (uint32_t slot = 0u; slot < bvh_width; ++slot)
+            {
+                if (node.m_child[slot] != bvh_invalid_child)
+                    compressed.set_child(slot, child_bounds(slot), node.m_child[slot], node.m_count[slot]);
+            }
+        }, parallel_grain);
+
+    m_vWideNodes.clear();
+    m_vWideNodes.shrink_to_fit();
+    return true;
+}
+
+void CBVHTreeNew::grow(uint32_t node_idx, FAxixAlignedBoundingBox& aabb)
+{
+    auto& node = m_vNodes[node_idx];
+
+    node.m_aabb.m_min = aabb.m_min = glm::vec3(std::numeric_limits<float>::max());
+    node.m_aabb.m_max = aabb.m_max = glm::vec3(-std::numeric_limits<float>::max());
+
+    for (uint32_t first = node.m_left, i = 0u; i < node.m_count; ++i)
+    {
+        uint32_t hittable_idx = m_vIndices[first + i];
+        node.m_aabb.grow(m_vBounds[hittable_idx]);
+
+        auto& centroid = m_vCentroids[hittable_idx];
+        aabb.m_min = glm::min(aabb.m_min, centroid);
+        aabb.m_max = glm::max(aabb.m_max, centroid);
+    }
+}
+
+void CBVHTreeNew::subdivide(uint32_t node_idx, uint32_t depth, const FAxixAlignedBoundingBox& centroid)
+{
+    auto& node = m_vNodes[node_idx];
+
+    uint32_t axis{ 0u }, split_pos{ 0u };
+    if (!should_split(node, find_best_split(node, axis, split_pos, centroid)))
+        return;
+
+    uint32_t i = node.m_left;
+    uint32_t j = i + node.m_count - 1u;
+
+    float scale = static_cast<float>(m_config.m_bins) / (centroid.m_max[axis] - centroid.m_min[axis]);
+    while (i <= j)
+    {
+        auto hittable_idx = m_vIndices[i];
+
+        uint32_t bin_idx = glm::min(m_config.m_bins - 1u, static_cast<uint32_t>((m_vCentroids[hittable_idx][axis] - centroid.m_min[axis]) * scale));
+        if (bin_idx < split_pos) 
+            i++; 
+        else 
+            std::swap(m_vIndices[i], m_vIndices[j--]);
+    }
+
+    uint32_t left_count = i - node.m_left;
+    if (left_count == 0u || left_count == node.m_count)
+        return;
+
+    uint32_t count = node.m_count;
+
+    // Siblings stay adjacent; the counter is shared between tasks
+    uint32_t left_child_idx = m_size.fetch_add(2u);
+    m_vNodes[left_child_idx].m_left = node.m_left;
+    m_vNodes[left_child_idx].m_count = left_count;
+
+    uint32_t right_child_idx = left_child_idx + 1u;
+    m_vNodes[right_child_idx].m_left = i;
+    m_vNodes[right_child_idx].m_count = count - left_count;
+
+    node.m_left = left_child_idx;
+    node.m_count = 0u;
+
+    FAxixAlignedBoundingBox left_centroid{}, right_centroid{};
+    grow(left_child_idx, left_centroid);
+    grow(right_child_idx, right_centroid);
+
+    if (count >= parallel_task_threshold && depth < m_max_task_depth)
+    {
+        CThreadPool::getInstance()->parallel_for(2ull,
+            [&](size_t child, uint32_t)
+            {
+                if (child == 0ull)
+                    subdivide(left_child_idx, depth + 1u, left_centroid);
+                else
+                    subdivide(right_child_idx, depth + 1u, right_centroid);
+            });
+        return;
+    }
+
+    // Subdivide left
+    subdivide(left_child_idx, depth + 1u, left_centroid);
+
+    // Subdivide right
+    subdivide(right_child_idx, depth + 1u, right_centroid);
+}
+
+bool CBVHTreeNew::should_split(const FBVHNode& node, float split_area) const
+{
+    // No split exists when all centroids coincide
+    if (split_area >= std::numeric_limits<float>::max())
+        return false;
+
+    if (node.m_count > m_config.m_max_leaf_size)
+        return true;
+
+    float leaf_cost = m_config.m_intersection_cost * node.cost();
+    float split_cost = m_config.m_traversal_cost * node.m_aabb.area() + m_config.m_intersection_cost * split_area;
+    return split_cost < leaf_cost;
+}
+
+float CBVHTreeNew::find_best_split(const FBVHNode& node, uint32_t& axis, uint32_t& split_pos, const FAxixAlignedBoundingBox& centroid) const
+{
+    switch (m_config.m_bins)
+    {
+    case 4u: return find_best_split<4u>(node, axis, split_pos, centroid);
+    case 16u: return find_best_split<16u>(node, axis, split_pos, centroid);
+    case 32u: return find_best_split<32u>(node, axis, split_pos, centroid);
+    default: return find_best_split<8u>(node, axis, split_pos, centroid);
+    }
+}
+
+template<uint32_t _Bins>
+float CBVHTreeNew::find_best_split(const FBVHNode& node, uint32_t& axis, uint32_t& split_pos, const FAxixAlignedBoundingBox& centroid) const
+{
+    using bin_set_t = std::array<std::array<FBVHTreeBin, _Bins>, 3u>;
+
+    glm::vec3 scale{ 0.f };
+    for (uint32_t a = 0u; a < 3u; ++a)
+    {
+        if (!math::compare_float(centroid.m_min[a], centroid.m_max[a]))
+            scale[a] = static_cast<float>(_Bins) / (centroid.m_max[a] - centroid.m_min[a]);
+    }
+
+    // Bins all three axes in one pass over the range
+    auto bin_range = [&](uint32_t first, uint32_t last, bin_set_t& bin)
+        {
+            for (uint32_t i = first; i < last; i++)
+            {
+                auto hittable_idx = m_vIndices[i];
+                auto& bounds = m_vBounds[hittable_idx];
+                auto& primitive_centroid = m_vCentroids[hittable_idx];
+                for (uint32_t a = 0u; a < 3u; ++a)
+                {
+                    uint32_t bin_idx = glm::min(_Bins - 1u, static_cast<uint32_t>((primitive_centroid[a] - centroid.m_min[a]) * scale[a]));
+                    bin[a][bin_idx].m_count++;
+                    bin[a][bin_idx].m_bounds.grow(bounds);
+                }
+            }
+        };
+
+    bin_set_t bin{};
+    if (node.m_count >= parallel_binning_threshold)
+    {
+        uint32_t chunk_count = (node.m_count + binning_chunk_size - 1u) / binning_chunk_size;
+        std::vector<bin_set_t> chunk_bins(chunk_count);
+
+        CThreadPool::getInstance()->parallel_for(chunk_count,
+            [&](size_t chunk, uint32_t)
+            {
+                uint32_t first = node.m_left + static_cast<uint32_t>(chunk) * binning_chunk_size;
+                bin_range(first, glm::min(first + binning_chunk_size, node.m_left + node.m_count), chunk_bins[chunk]);
+            });
+
+        // Counts and min/max bounds merge exactly, so the result matches a serial pass
+        for (auto& chunk_bin : chunk_bins)
+        {
+            for (uint32_t a = 0u; a < 3u; ++a)
+            {
+                for (uint32_t b = 0u; b < _Bins; ++b)
+                {
+                    bin[a][b].m_count += chunk_bin[a][b].m_count;
+                    bin[a][b].m_bounds.grow(chunk_bin[a][b].m_bounds);
+                }
+            }
+        }
+    }
+    else
+        bin_range(node.m_left, node.m_left + node.m_count, bin);
+
+    float best_cost = std::numeric_limits<float>::max();
+    for (uint32_t a = 0; a < 3u; ++a)
+    {
+        if (math::compare_float(centroid.m_min[a], centroid.m_max[a]))
+            continue;
+
+        std::array<float, _Bins - 1u> left_area;
+        std::array<float, _Bins - 1u> right_area;
+
+        uint32_t left_sum{ 0u };
+        uint32_t right_sum{ 0u };
+
+        FAxixAlignedBoundingBox left, right;
+        for (uint32_t i = 0u; i < _Bins - 1u; i++)
+        {
+            left_sum += bin[a][i].m_count;
+            left.grow(bin[a][i].m_bounds);
+            left_area[i] = static_cast<float>(left_sum) * left.area();
+
+            right_sum += bin[a][_Bins - 1u - i].m_count;
+            right.grow(bin[a][_Bins - 1u - i].m_bounds);
+            right_area[_Bins - 2u - i] = static_cast<float>(right_sum) * right.area();
+        }
+
+        for (uint32_t i = 0u; i < _Bins - 1u; i++)
+        {
+            const float plane_cost = left_area[i] + right_area[i];
+            if (plane_cost < best_cost)
+            {
+                axis = a;
+                split_pos = i + 1u;
+                best_cost = plane_cost;
+            }
+        }
+    }
+
+    return best_cost;
+}
+
+void CBVHTreeNew::build_spatial()
+{
+    std::vector<FBVHReference> references(m_vHittables.size());
+    FAxixAlignedBoundingBox root_bounds{};
+    for (uint32_t i = 0u; i < references.size(); ++i)
+    {
+        references[i].m_bounds = m_vBounds[i];
+        references[i].m_index = i;
+        root_bounds.grow(m_vBounds[i]);
+    }
+
+    m_root_area = root_bounds.area();
+    m_duplication_left = m_vNodes.size() / 2ull - 32ull - m_vHittables.size();
+
+    // Leaves append their references, duplicates included
+    m_vIndices.clear();
+    m_vIndices.reserve(m_vNodes.size() / 2ull);
+
+    m_vNodes[0ull].m_aabb = root_bounds;
+    subdivide_spatial(0u, 0u, references);
+}
+
+void CBVHTreeNew::subdivide_spatial(uint32_t node_idx, uint32_t depth, std::vector<FBVHReference>& references)
+{
+    auto& node = m_vNodes[node_idx];
+    node.m_count = static_cast<uint32_t>(references.size());
+
+    FAxixAlignedBoundingBox centroid{};
+    for (auto& reference : references)
+    {
+        auto center = (reference.m_bounds.m_min + reference.m_bounds.m_max) * 0.5f;
+        centroid.grow(FAxixAlignedBoundingBox(center, center));
+    }
+
+    uint32_t object_axis{ 0u }, object_split{ 0u };
+    FAxixAlignedBoundingBox object_left{}, object_right{};
+    float object_cost = find_object_split(references, centroid, object_axis, object_split, object_left, object_right);
+
+    // Spatial splits only pay off where the object split children overlap noticeably
+    uint32_t spatial_axis{ 0u };
+    float spatial_plane{ 0.f };
+    float spatial_cost = std::numeric_limits<float>::max();
+    auto children_overlap = overlap(object_left, object_right);
+    if (m_duplication_left > 0ull && depth < spatial_max_depth && !is_empty(children_overlap) && children_overlap.area() > m_config.m_spatial_split_alpha * m_root_area)
+        spatial_cost = find_spatial_split(node, references, spatial_axis, spatial_plane);
+
+    if (depth >= spatial_max_depth || !should_split(node, glm::min(object_cost, spatial_cost)))
+    {
+        make_leaf(node_idx, references);
+        return;
+    }
+
+    std::vector<FBVHReference> left_references{}, right_references{};
+    if (spatial_cost < object_cost)
+    {
+        for (auto& reference : references)
+        {
+            if (reference.m_bounds.m_max[spatial_axis] <= spatial_plane)
+                left_references.emplace_back(reference);
+            else if (reference.m_bounds.m_min[spatial_axis] >= spatial_plane)
+                right_references.emplace_back(reference);
+            else
+            {
+                // Straddling reference: clip it into both sides, unless the budget ran out
+                auto& triangle = m_vTriangles[reference.m_index];
+                auto left = overlap(clip_triangle(triangle, spatial_axis, -std::numeric_limits<float>::max(), spatial_plane), reference.m_bounds);
+                auto right = overlap(clip_triangle(triangle, spatial_axis, spatial_plane, std::numeric_limits<float>::max()), reference.m_bounds);
+
+                bool keep_left = !is_empty(left);
+                bool keep_right = !is_empty(right);
+                if (!keep_left && !keep_right)
+                {
+                    // Float error on bounds from an earlier clip can empty both halves. The
+                    // reference then goes unsplit to the side holding its centroid.
+                    if ((reference.m_bounds.m_min[spatial_axis] + reference.m_bounds.m_max[spatial_axis]) * 0.5f < spatial_plane)
+                    {
+                        left = reference.m_bounds;
+                        keep_left = true;
+                    }
+                    else
+                    {
+                        right = reference.m_bounds;
+                        keep_right = true;
+                    }
+                }
+                else if (keep_left && keep_right && m_duplication_left == 0ull)
+                {
+                    // Out of budget: the reference goes unsplit to the side holding most of it
+                    if (left.area() >= right.area())
+                    {
+                        left = reference.m_bounds;
+                        keep_right = false;
+                    }
+                    else
+                    {
+                        right = reference.m_bounds;
+                        keep_left = false;
+                    }
+                }
+
+                if (keep_left && keep_right)
+                    --m_duplication_left;
+
+                if (keep_left)
+                    left_references.push_back({ left, reference.m_index });
+                if (keep_right)
+                    right_references.push_back({ right, reference.m_index });
+            }
+        }
+    }
+    else
+    {
+        float scale = static_cast<float>(m_config.m_bins) / (centroid.m_max[object_axis] - centroid.m_min[object_axis]);
+        for (auto& reference : references)
+        {
+            float center = (reference.m_bounds.m_min[object_axis] + reference.m_bounds.m_max[object_axis]) * 0.5f;
+            uint32_t bin_idx = glm::min(m_config.m_bins - 1u, static_cast<uint32_t>((center - centroid.m_min[object_axis]) * scale));
+            (bin_idx < object_split ? left_references : right_references).emplace_back(reference);
+        }
+    }
+
+    if (left_references.empty() || right_references.empty())
+    {
+        make_leaf(node_idx, references);
+        return;
+    }
+
+    references.clear();
+    references.shrink_to_fit();
+
+    uint32_t left_child_idx = m_size.fetch_add(2u);
+    uint32_t right_child_idx = left_child_idx + 1u;
+    node.m_left = left_child_idx;
+    node.m_count = 0u;
+
+    for (auto& reference : left_references)
+        m_vNodes[left_child_idx].m_aabb.grow(reference.m_bounds);
+    for (auto& reference : right_references)
+        m_vNodes[right_child_idx].m_aabb.grow(reference.m_bounds);
+
+    subdivide_spatial(left_child_idx, depth + 1u, left_references);
+    subdivide_spatial(right_child_idx, depth + 1u, right_references);
+}
+
+float CBVHTreeNew::find_object_split(const std::vector<FBVHReference>& references, const FAxixAlignedBoundingBox& centroid, uint32_t& axis, uint32_t& split_pos, FAxixAlignedBoundingBox& left_bounds, FAxixAlignedBoundingBox& right_bounds) const
+{
+    switch (m_config.m_bins)
+    {
+    case 4u: return find_object_split<4u>(references, centroid, axis, split_pos, left_bounds, right_bounds);
+    case 16u: return find_object_split<16u>(references, centroid, axis, split_pos, left_bounds, right_bounds);
+    case 32u: return find_object_split<32u>(references, centroid, axis, split_pos, left_bounds, right_bounds);
+    default: return find_object_split<8u>(references, centroid, axis, split_pos, left_bounds, right_bounds);
+    }
+}
+
+template<uint32_t _Bins>
+float CBVHTreeNew::find_object_split(const std::vector<FBVHReference>& references, const FAxixAlignedBoundingBox& centroid, uint32_t& axis, uint32_t& split_pos, FAxixAlignedBoundingBox& left_bounds, FAxixAlignedBoundingBox& right_bounds) const
+{
+    float best_cost = std::numeric_limits<float>::max();
+    for (uint32_t a = 0; a < 3u; ++a)
+    {
+        if (math::compare_float(centroid.m_min[a], centroid.m_max[a]))
+            continue;
+
+        float scale = static_cast<float>(_Bins) / (centroid.m_max[a] - centroid.m_min[a]);
+
+        std::array<FBVHTreeBin, _Bins> bin{};
+        for (auto& reference : references)
+        {
+            float center = (reference.m_bounds.m_min[a] + reference.m_bounds.m_max[a]) * 0.5f;
+            uint32_t bin_idx = glm::min(_Bins - 1u, static_cast<uint32_t>((center - centroid.m_min[a]) * scale));
+            bin[bin_idx].m_count++;
+            bin[bin_idx].m_bounds.grow(reference.m_bounds);
+        }
+
+        std::array<FAxixAlignedBoundingBox, _Bins - 1u> left_box, right_box;
+        std::array<float, _Bins - 1u> left_area, right_area;
+        uint32_t left_sum{ 0u }, right_sum{ 0u };
+
+        FAxixAlignedBoundingBox left, right;
+        for (uint32_t i = 0u; i < _Bins - 1u; i++)
+        {
+            left_sum += bin[i].m_count;
+            left.grow(bin[i].m_bounds);
+            left_box[i] = left;
+            left_area[i] = static_cast<float>(left_sum) * left.area();
+
+            right_sum += bin[_Bins - 1u - i].m_count;
+            right.grow(bin[_Bins - 1u - i].m_bounds);
+            right_box[_Bins - 2u - i] = right;
+            right_area[_Bins - 2u - i] = static_cast<float>(right_sum) * right.area();
+        }
+
+        for (uint32_t i = 0u; i < _Bins - 1u; i++)
+        {
+            const float plane_cost = left_area[i] + right_area[i];
+            if (plane_cost < best_cost)
+            {
+                axis = a;
+                split_pos = i + 1u;
+                best_cost = plane_cost;
+                left_bounds = left_box[i];
+                right_bounds = right_box[i];
+            }
+        }
+    }
+
+    return best_cost;
+}
+
+float CBVHTreeNew::find_spatial_split(const FBVHNode& node, const std::vector<FBVHReference>& references, uint32_t& axis, float& split_plane) const
+{
+    float best_cost = std::numeric_limits<float>::max();
+    auto extent = node.m_aabb.extent();
+
+    for (uint32_t a = 0; a < 3u; ++a)
+    {
+        if (extent[a] <= 0.f)
+            continue;
+
+        float bin_size = extent[a] / static_cast<float>(spatial_bins);
+        float inv_bin_size = 1.f / bin_size;
+        auto bin_of = [&](float position) { return glm::min(spatial_bins - 1u, static_cast<uint32_t>(glm::max(position - node.m_aabb.m_min[a], 0.f) * inv_bin_size)); };
+
+        std::array<FBVHSpatialBin, spatial_bins> bin{};
+        for (auto& reference : references)
+        {
+            uint32_t first = bin_of(reference.m_bounds.m_min[a]);
+            uint32_t last = bin_of(reference.m_bounds.m_max[a]);
+
+            bin[first].m_enter++;
+            bin[last].m_exit++;
+
+            // Chop the triangle into every bin it spans
+            auto& triangle = m_vTriangles[reference.m_index];
+            for (uint32_t b = first; b <= last; ++b)
+            {
+                float lo = node.m_aabb.m_min[a] + bin_size * static_cast<float>(b);
+                auto chopped = overlap(clip_triangle(triangle, a, lo, lo + bin_size), reference.m_bounds);
+                if (!is_empty(chopped))
+                    bin[b].m_bounds.grow(chopped);
+            }
+        }
+
+        std::array<float, spatial_bins - 1u> left_area, right_area;
+        uint32_t left_sum{ 0u }, right_sum{ 0u };
+
+        FAxixAlignedBoundingBox left, right;
+        for (uint32_t i = 0u; i < spatial_bins - 1u; i++)
+        {
+            left_sum += bin[i].m_enter;
+            left.grow(bin[i].m_bounds);
+            left_area[i] = left_sum > 0u ? static_cast<float>(left_sum) * left.area() : std::numeric_limits<float>::max();
+
+            right_sum += bin[spatial_bins - 1u - i].m_exit;
+            right.grow(bin[spatial_bins - 1u - i].m_bounds);
+            right_area[spatial_bins - 2u - i] = right_sum > 0u ? static_cast<float>(right_sum) * right.area() : std::numeric_limits<float>::max();
+        }
+
+        for (uint32_t i = 0u; i < spatial_bins - 1u; i++)
+        {
+            const float plane_cost = left_area[i] + right_area[i];
+            if (plane_cost < best_cost)
+            {
+                axis = a;
+                split_plane = node.m_aabb.m_min[a] + bin_size * static_cast<float>(i + 1u);
+                best_cost = plane_cost;
+            }
+        }
+    }
+
+    return best_cost;
+}
+
+void CBVHTreeNew::make_leaf(uint32_t node_idx, const std::vector<FBVHReference>& references)
+{
+    auto& node = m_vNodes[node_idx];
+    node.m_left = static_cast<uint32_t>(m_vIndices.size());
+    node.m_count = static_cast<uint32_t>(references.size());
+
+    for (auto& reference : references)
+        m_vIndices.emplace_back(reference.m_index);
+}
+
+std::vector<uint32_t> CBVHTreeNew::sort_morton()
+{
+    FAxixAlignedBoundingBox centroid{};
+    for (auto& center : m_vCentroids)
+        centroid.grow(FAxixAlignedBoundingBox(center, center));
+
+    // 10 bits per axis over the centroid bounds; flat axes all map to 0
+    glm::vec3 scale{ 0.f };
+    for (uint32_t axis = 0u; axis < 3u; ++axis)
+    {
+        if (!math::compare_float(centroid.m_min[axis], centroid.m_max[axis]))
+            scale[axis] = 1023.f / (centroid.m_max[axis] - centroid.m_min[axis]);
+    }
+
+    // Code in the high half, triangle index in the low half, so the sort is deterministic
+    std::vector<uint64_t> keys(m_vIndices.size());
+    CThreadPool::getInstance()->parallel_for(m_vIndices.size(),
+        [this, &keys, &centroid, &scale](size_t index, uint32_t)
+        {
+            auto cell = glm::clamp((m_vCentroids[index] - centroid.m_min) * scale, glm::vec3(0.f), glm::vec3(1023.f));
+            uint32_t code = (expand_bits(static_cast<uint32_t>(cell.x)) << 2u) | (expand_bits(static_cast<uint32_t>(cell.y)) << 1u) | expand_bits(static_cast<uint32_t>(cell.z));
+            keys[index] = static_cast<uint64_t>(code) << 32u | index;
+        }, parallel_grain);
+    parallel_sort(keys);
+
+    std::vector<uint32_t> codes(keys.size());
+    for (size_t i = 0ull; i < keys.size(); ++i)
+    {
+        m_vIndices[i] = static_cast<uint32_t>(keys[i]);
+        codes[i] = static_cast<uint32_t>(keys[i] >> 32u);
+    }
+
+    return codes;
+}
+
+void CBVHTreeNew::build_lbvh()
+{
+    auto codes = sort_morton();
+
+    auto& root = m_vNodes[0ull];
+    root.m_left = 0u;
+    root.m_count = static_cast<uint32_t>(m_vIndices.size());
+
+    subdivide_morton(0u, 0u, codes);
+}
+
+void CBVHTreeNew::subdivide_morton(uint32_t node_idx, uint32_t depth, const std::vector<uint32_t>& codes)
+{
+    auto& node = m_vNodes[node_idx];
+    if (node.m_count <= morton_leaf_size)
+    {
+        FAxixAlignedBoundingBox centroid{};
+        grow(node_idx, centroid);
+        return;
+    }
+
+    uint32_t count = node.m_count;
+    uint32_t split = find_morton_split(codes, node.m_left, node.m_left + count - 1u);
+
+    // Siblings stay adjacent; the counter is shared between tasks
+    uint32_t left_child_idx = m_size.fetch_add(2u);
+    m_vNodes[left_child_idx].m_left = node.m_left;
+    m_vNodes[left_child_idx].m_count = split + 1u - node.m_left;
+
+    uint32_t right_child_idx = left_child_idx + 1u;
+    m_vNodes[right_child_idx].m_left = split + 1u;
+    m_vNodes[right_child_idx].m_count = count - m_vNodes[left_child_idx].m_count;
+
+    node.m_left = left_child_idx;
+    node.m_count = 0u;
+
+    if (count >= parallel_task_threshold && depth < m_max_task_depth)
+    {
+        CThreadPool::getInstance()->parallel_for(2ull,
+            [&](size_t child, uint32_t)
+            {
+                subdivide_morton(child == 0ull ? left_child_idx : right_child_idx, depth + 1u, codes);
+            });
+    }
+    else
+    {
+        subdivide_morton(left_child_idx, depth + 1u, codes);
+        subdivide_morton(right_child_idx, depth + 1u, codes);
+    }
+
+    // Bounds are only known once both subtrees are built
+    node.m_aabb = m_vNodes[left_child_idx].m_aabb;
+    node.m_aabb.grow(m_vNodes[right_child_idx].m_aabb);
+}
+
+void CBVHTreeNew::build_ploc()
+{
+    sort_morton();
+
+    std::vector<FBVHCluster> nodes(m_vIndices.size());
+    nodes.reserve(m_vIndices.size() * 2ull);
+    for (uint32_t i = 0u; i < m_vIndices.size(); ++i)
+    {
+        nodes[i].m_aabb = m_vBounds[m_vIndices[i]];
+        nodes[i].m_left = i;
+    }
+
+    std::vector<uint32_t> clusters(m_vIndices.size());
+    std::iota(clusters.begin(), clusters.end(), 0u);
+    std::vector<uint32_t> neighbours{}, merged{};
+    int64_t radius = static_cast<int64_t>(glm::max(m_config.m_ploc_radius, 1u));
+
+    // Every pass merges all pairs of clusters that are each other's nearest neighbour within
+    // the search window, measured by the surface area of their union. Merged clusters take the
+    // place of the left one, so the list stays in Morton order.
+    while (clusters.size() > 1ull)
+    {
+        neighbours.resize(clusters.size());
+        CThreadPool::getInstance()->parallel_for(clusters.size(),
+            [&clusters, &neighbours, &nodes, radius](size_t index, uint32_t)
+            {
+                auto cluster = clusters[index];
+                auto i = static_cast<int64_t>(index);
+                int64_t last = std::min<int64_t>(i + radius, static_cast<int64_t>(clusters.size()) - 1);
+
+                float best_area{ std::numeric_limits<float>::max() };
+                int64_t best{ i };
+                for (int64_t j = std::max<int64_t>(i - radius, 0); j <= last; ++j)
+                {
+                    if (j == i)
+                        continue;
+
+                    auto merged_aabb = nodes[cluster].m_aabb;
+                    merged_aabb.grow(nodes[clusters[j]].m_aabb);
+                    float area = merged_aabb.area();
+                    if (area < best_area)
+                    {
+                        best_area = area;
+                        best = j;
+                    }
+                }
+
+                neighbours[i] = static_cast<uint32_t>(best);
+            }, parallel_grain);
+
+        merged.clear();
+        for (uint32_t i = 0u; i < clusters.size(); ++i)
+        {
+            uint32_t j = neighbours[i];
+            if (neighbours[j] != i)
+            {
+                merged.emplace_back(clusters[i]);
+                continue;
+            }
+
+            if (i > j)
+                continue;
+
+            auto& cluster = nodes.emplace_back();
+            cluster.m_aabb = nodes[clusters[i]].m_aabb;
+            cluster.m_aabb.grow(nodes[clusters[j]].m_aabb);
+            cluster.m_left = clusters[i];
+            cluster.m_right = clusters[j];
+            cluster.m_count = nodes[clusters[i]].m_count + nodes[clusters[j]].m_count;
+            merged.emplace_back(static_cast<uint32_t>(nodes.size() - 1ull));
+        }
+        clusters.swap(merged);
+    }
+
+    // Emit top-down so siblings are allocated together, small clusters become leaves
+    std::vector<uint32_t> sorted_indices{};
+    sorted_indices.swap(m_vIndices);
+    m_vIndices.reserve(sorted_indices.size());
+
+    std::vector<std::pair<uint32_t, uint32_t>> emit_stack{ { clusters.front(), 0u } };
+    std::vector<uint32_t> gather_stack{};
+    while (!emit_stack.empty())
+    {
+        auto [cluster_idx, node_idx] = emit_stack.back();
+        emit_stack.pop_back();
+
+        auto& cluster = nodes[cluster_idx];
+        auto& node = m_vNodes[node_idx];
+        node.m_aabb = cluster.m_aabb;
+
+        if (cluster.m_count > morton_leaf_size)
+        {
+            uint32_t left_child_idx = m_size.fetch_add(2u);
+            node.m_left = left_child_idx;
+            node.m_count = 0u;
+            emit_stack.emplace_back(cluster.m_right, left_child_idx + 1u);
+            emit_stack.emplace_back(cluster.m_left, left_child_idx);
+            continue;
+        }
+
+        node.m_left = static_cast<uint32_t>(m_vIndices.size());
+        node.m_count = cluster.m_count;
+
+        gather_stack.emplace_back(cluster_idx);
+        while (!gather_stack.empty())
+        {
+            auto& leaf = nodes[gather_stack.back()];
+            gather_stack.pop_back();
+
+            if (leaf.m_right == bvh_invalid_child)
+                m_vIndices.emplace_back(sorted_indices[leaf.m_left]);
+            else
+            {
+                gather_stack.emplace_back(leaf.m_right);
+                gather_stack.emplace_back(leaf.m_left);
+            }
+        }
+    }
 }
\ No newline at end of file
@@ -1,7 +1,13 @@
 #pragma once
 
 #include "hittable.h"
+#include "configuration.h"
+#include "util.h"
+#include "geometry_pager.h"
 #include <stack>
+#include <atomic>
+#include <bit>
+#include <cstring>
 
 struct FBVHNode
 {
@@ -18,12 +24,215 @@ struct FBVHNode
 	}
 };
 
+static_assert(sizeof(FBVHNode) * 2ull == cache_line_size);
+
+constexpr const uint32_t bvh_width{ 4u };
+constexpr const uint32_t bvh_invalid_child{ std::numeric_limits<uint32_t>::max() };
+
+// Four-wide node produced by collapsing the binary build. Child bounds are stored SoA so all
+// children are tested by one SSE slab test. Exactly two cache lines.
+struct alignas(64) FBVHWideNode
+{
+	float m_min[3][bvh_width]{};
+	float m_max[3][bvh_width]{};
+	// Wide node index for inner children, first triangle block for leaves
+	uint32_t m_child[bvh_width]{ bvh_invalid_child, bvh_invalid_child, bvh_invalid_child, bvh_invalid_child };
+	// Triangle block count for leaves, 0 for inner children
+	uint32_t m_count[bvh_width]{};
+
+	void set_child(uint32_t slot, const FAxixAlignedBoundingBox& aabb, uint32_t child, uint32_t count)
+	{
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			m_min[axis][slot] = aabb.m_min[axis];
+			m_max[axis][slot] = aabb.m_max[axis];
+		}
+
+		m_child[slot] = child;
+		m_count[slot] = count;
+	}
+
+	void get_bounds(__m128* bmin, __m128* bmax) const
+	{
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			bmin[axis] = _mm_load_ps(m_min[axis]);
+			bmax[axis] = _mm_load_ps(m_max[axis]);
+		}
+	}
+
+	// Lane mask of the non-empty child slots
+	int child_mask() const
+	{
+		return ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(m_child)), _mm_set1_epi32(-1)))) & 0xF;
+	}
+
+	// Lane mask of non-empty children hit in front of distance
+	int intersect(const __m128* origin, const __m128* inv_direction, float distance, __m128& entry) const
+	{
+		return math::ray_aabb_intersect4(origin, inv_direction, &m_min[0][0], &m_max[0][0], distance, entry) & child_mask();
+	}
+};
+
+// Compressed four-wide node, half the size of FBVHWideNode. Child bounds are quantized to 8 bits
+// on a per-axis power-of-two grid anchored at the node's own bounds. Quantization rounds outwards,
+// so decoded boxes always enclose the exact ones and traversal stays conservative.
+struct alignas(64) FBVHCompressedNode
+{
+	// First so the empty-slot test can use an aligned load
+	uint32_t m_child[bvh_width]{ bvh_invalid_child, bvh_invalid_child, bvh_invalid_child, bvh_invalid_child };
+	float m_origin[3]{};
+	// Grid spacing per axis is 2^m_exponent
+	int8_t m_exponent[3]{};
+	uint8_t m_padding{};
+	uint8_t m_min[3][bvh_width]{};
+	uint8_t m_max[3][bvh_width]{};
+	uint16_t m_count[bvh_width]{};
+
+	// Leaves with more blocks than this keep the tree on FBVHWideNode
+	static constexpr const uint32_t max_count{ std::numeric_limits<uint16_t>::max() };
+
+	static float grid_scale(int8_t exponent)
+	{
+		return std::bit_cast<float>(static_cast<uint32_t>(exponent + 127) << 23u);
+	}
+
+	// Scalar decode, bit-exact with the SSE decode in intersect
+	float decode(uint32_t axis, uint8_t value) const
+	{
+		return m_origin[axis] + static_cast<float>(value) * grid_scale(m_exponent[axis]);
+	}
+
+	// Picks the smallest grid per axis whose 255 steps still cover aabb
+	void set_frame(const FAxixAlignedBoundingBox& aabb)
+	{
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			m_origin[axis] = aabb.m_min[axis];
+
+			int exponent{ -126 };
+			float extent = aabb.m_max[axis] - aabb.m_min[axis];
+			if (extent > 0.f)
+				std::frexp(extent / 255.f, &exponent);
+
+			m_exponent[axis] = static_cast<int8_t>(glm::clamp(exponent, -126, 127));
+			while (m_exponent[axis] < 127 && decode(axis, 255u) < aabb.m_max[axis])
+				++m_exponent[axis];
+		}
+	}
+
+	// aabb must lie inside the frame
+	void set_child(uint32_t slot, const FAxixAlignedBoundingBox& aabb, uint32_t child, uint32_t count)
+	{
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			float scale = grid_scale(m_exponent[axis]);
+			auto lo = static_cast<uint8_t>(glm::clamp(std::floor((aabb.m_min[axis] - m_origin[axis]) / scale), 0.f, 255.f));
+			auto hi = static_cast<uint8_t>(glm::clamp(std::ceil((aabb.m_max[axis] - m_origin[axis]) / scale), 0.f, 255.f));
+
+			// The division may round either way, step until the decoded box encloses aabb
+			while (lo > 0u && decode(axis, lo) > aabb.m_min[axis])
+				--lo;
+			while (hi < 255u && decode(axis, hi) < aabb.m_max[axis])
+				++hi;
+
+			m_min[axis][slot] = lo;
+			m_max[axis][slot] = hi;
+		}
+
+		m_child[slot] = child;
+		m_count[slot] = static_cast<uint16_t>(count);
+	}
+
+	void get_bounds(__m128* bmin, __m128* bmax) const
+	{
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			const __m128 frame = _mm_set1_ps(m_origin[axis]);
+			const __m128 scale = _mm_set1_ps(grid_scale(m_exponent[axis]));
+			bmin[axis] = _mm_add_ps(frame, _mm_mul_ps(dequantize(m_min[axis]), scale));
+			bmax[axis] = _mm_add_ps(frame, _mm_mul_ps(dequantize(m_max[axis]), scale));
+		}
+	}
+
+	int child_mask() const
+	{
+		return ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(m_child)), _mm_set1_epi32(-1)))) & 0xF;
+	}
+
+	int intersect(const __m128* origin, const __m128* inv_direction, float distance, __m128& entry) const
+	{
+		__m128 bmin[3], bmax[3];
+		get_bounds(bmin, bmax);
+		return math::ray_aabb_intersect4(origin, inv_direction, bmin, bmax, distance, entry) & child_mask();
+	}
+
+private:
+	// Four bytes widened to four floats
+	static __m128 dequantize(const uint8_t* values)
+	{
+		int32_t packed{};
+		std::memcpy(&packed, values, sizeof(packed));
+
+		const __m128i zero = _mm_setzero_si128();
+		__m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+		return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+	}
+};
+static_assert(sizeof(FBVHWideNode) == 2ull * cache_line_size);
+static_assert(sizeof(FBVHCompressedNode) == cache_line_size);
+
 struct FBVHTreeBin
 {
 	FAxixAlignedBoundingBox m_bounds{}; 
 	uint32_t m_count{ 0u };
 };
 
+// Spatial split build input: a triangle, or the part of it clipped into a node
+struct FBVHReference
+{
+	FAxixAlignedBoundingBox m_bounds{};
+	uint32_t m_index{};
+};
+
+struct FBVHSpatialBin
+{
+	FAxixAlignedBoundingBox m_bounds{};
+	uint32_t m_enter{ 0u };
+	uint32_t m_exit{ 0u };
+};
+
+// Quality metrics of a built tree, gathered by walking its traversal nodes
+struct FBVHStats
+{
+	// SAH cost under the configured traversal and intersection costs, areas relative to the root
+	float m_sah_cost{ 0.f };
+	size_t m_inner_nodes{ 0ull };
+	size_t m_leaves{ 0ull };
+	size_t m_primitives{ 0ull };
+	// Leaf count by primitive count
+	std::vector<size_t> m_leaf_sizes{};
+	uint32_t m_max_depth{ 0u };
+	// Mean depth of the leaves
+	float m_average_depth{ 0.f };
+	// Mean over inner nodes of the summed pairwise overlap of their children, relative to the node area
+	float m_overlap{ 0.f };
+	size_t m_node_memory{ 0ull };
+	size_t m_leaf_memory{ 0ull };
+
+	void add_inner(const FAxixAlignedBoundingBox& bounds, const FAxixAlignedBoundingBox* children, uint32_t count, uint32_t depth);
+	void add_leaf(const FAxixAlignedBoundingBox& bounds, uint32_t primitives, uint32_t depth);
+	// Turns the sums collected by add_inner and add_leaf into the final metrics
+	void finish(const FAxixAlignedBoundingBox& root, const FBVHConfig& config);
+	// Combines trees that are traced independently: counts and memory add up, cost and ratios
+	// are averaged weighted by primitives, nodes and leaves respectively
+	void merge(const FBVHStats& other);
+private:
+	float m_inner_area{ 0.f };
+	float m_leaf_area{ 0.f };
+	uint64_t m_depth_sum{ 0ull };
+};
+
 class CBVHTreeNew
 {
 	struct FBuildJob
@@ -34,22 +243,139 @@ class CBVHTreeNew
 public:
 	~CBVHTreeNew();
 
-	void create();
+	void create(const FBVHConfig& config);
+	// A tree holds either triangles or analytic shapes, never both
 	void emplace(const CTriangle& triangle);
+	void emplace(const CShape& shape);
+	// Primitives of either kind
 	size_t size() const;
+	bool has_shapes() const;
 	const CTriangle& get_triangle(size_t index) const;
+	FTriangle get_geometry(size_t index) const;
+	// Bounds of the whole tree, valid after create
+	const FAxixAlignedBoundingBox& get_bounds() const;
+	// Bytes held by traversal nodes and by leaf triangle blocks
+	size_t node_memory() const;
+	size_t leaf_memory() const;
+	FBVHStats analyze() const;
+
+	// Out of core: write_clusters appends the leaf blocks and the primitives, in leaf order, to the
+	// pager file. Once the file is mapped, page_out drops the in-memory copies and every later read
+	// goes through the pager. page_in copies them back, which a rebuild needs.
+	void write_clusters(CGeometryPager& pager);
+	void page_out(CGeometryPager* pager);
+	void page_in();
 
+	// Closest-hit query. Only fills the compact hit record; see resolve_hit for shading data.
 	bool hit(const FRay& ray, float t_min, float t_max, FHitResult& hit_result) const;
+	void resolve_hit(const FRay& ray, const FHitResult& hit_result, const glm::mat3& normal, FSurfaceInteraction& surface) const;
+	// Closest-hit query for a prepared packet. Rays are traversed together while they stay
+	// coherent and individually once few of them remain in a subtree.
+	void hit(FRayPacket& packet, float t_min, float t_max) const;
+	// Any-hit query for shadow rays: returns on the first intersection in [t_min, t_max].
+	bool occluded(const FRay& ray, float t_min, float t_max) const;
 private:
-	bool hit(const FRay& ray, float t_min, float t_max, FHitResult& hit_result, uint32_t node_idx) const;
+	// Single-ray traversal starting at the wide node root
+	// _Block is FTriangle4 or FShape4, chosen by the primitive kind of the tree
+	template<class _Node, class _Block>
+	bool hit(const cache_aligned_vector<_Node>& nodes, const _Block* blocks, uint32_t root, const FRay& ray, float t_min, float t_max, FHitResult& hit_result) const;
+	template<class _Node, class _Block>
+	void hit(const cache_aligned_vector<_Node>& nodes, const _Block* blocks, FRayPacket& packet, float t_min, float t_max) const;
+	template<class _Node, class _Block>
+	bool occluded(const cache_aligned_vector<_Node>& nodes, const _Block* blocks, const FRay& ray, float t_min, float t_max) const;
+	template<class _Node, class _Block>
+	FBVHStats analyze(const cache_aligned_vector<_Node>& nodes, const _Block* blocks) const;
+
+	// Leaf block storage, in memory or in the pager
+	const FTriangle4* triangle_blocks() const;
+	const FShape4* shape_blocks() const;
+	// Blocks [first, first + count) of a leaf, paged in first when the tree is out of core
+	template<class _Block>
+	const _Block* acquire(const _Block* blocks, uint32_t first, uint32_t count) const
+	{
+		if (m_pPager)
+			m_pPager->acquire(m_block_offset + first * sizeof(_Block), count * sizeof(_Block));
+		return blocks + first;
+	}
+	// Primitive attributes of a paged tree
+	template<class _Primitive>
+	const _Primitive& acquire_primitive(size_t index) const
+	{
+		return *reinterpret_cast<const _Primitive*>(m_pPager->acquire(m_primitive_offset + m_vSlots.at(index) * sizeof(_Primitive), sizeof(_Primitive)));
+	}
+	template<class _Block, class _Primitive>
+	void write_clusters(CGeometryPager& pager, const cache_aligned_vector<_Block>& blocks, const std::vector<_Primitive>& primitives);
+	template<class _Block, class _Primitive>
+	void page_in(cache_aligned_vector<_Block>& blocks, std::vector<_Primitive>& primitives);
+
 	void build();
+	// Collapses the binary subtree at node_idx into wide nodes, returns the wide node index.
+	// Nodes and leaf blocks are laid out depth first, see the definition for the child order.
+	uint32_t collapse(uint32_t node_idx);
+	// Packs the leaf's triangles into contiguous blocks, returns the first block index
+	uint32_t pack_leaf(uint32_t first, uint32_t count);
+	// Converts the wide nodes to FBVHCompressedNode in place of them. Fails, keeping the wide
+	// nodes, if a leaf holds more blocks than a compressed node can count.
+	bool compress();
 	void grow(uint32_t node_idx, FAxixAlignedBoundingBox& aabb);
-	void subdivide(uint32_t node_idx, uint32_t depth, FAxixAlignedBoundingBox& centroid);
-	float find_best_split(FBVHNode& node, uint32_t& axis, uint32_t& split_pos, FAxixAlignedBoundingBox& centroid);
+	// Children of large nodes are subdivided as parallel tasks
+	void subdivide(uint32_t node_idx, uint32_t depth, const FAxixAlignedBoundingBox& centroid);
+	// SAH leaf test; split_area is the best split's sum of child area times triangle count
+	bool should_split(const FBVHNode& node, float split_area) const;
+	// Dispatch on the configured bin count to a search specialised for it
+	float find_best_split(const FBVHNode& node, uint32_t& axis, uint32_t& split_pos, const FAxixAlignedBoundingBox& centroid) const;
+	template<uint32_t _Bins>
+	float find_best_split(const FBVHNode& node, uint32_t& axis, uint32_t& split_pos, const FAxixAlignedBoundingBox& centroid) const;
+
+	// SBVH build, serial so the duplication budget is spent deterministically
+	void build_spatial();
+	void subdivide_spatial(uint32_t node_idx, uint32_t depth, std::vector<FBVHReference>& references);
+	float find_object_split(const std::vector<FBVHReference>& references, const FAxixAlignedBoundingBox& centroid, uint32_t& axis, uint32_t& split_pos, FAxixAlignedBoundingBox& left, FAxixAlignedBoundingBox& right) const;
+	template<uint32_t _Bins>
+	float find_object_split(const std::vector<FBVHReference>& references, const FAxixAlignedBoundingBox& centroid, uint32_t& axis, uint32_t& split_pos, FAxixAlignedBoundingBox& left, FAxixAlignedBoundingBox& right) const;
+	float find_spatial_split(const FBVHNode& node, const std::vector<FBVHReference>& references, uint32_t& axis, float& split_plane) const;
+	void make_leaf(uint32_t node_idx, const std::vector<FBVHReference>& references);
+
+	// Morton-order builds. sort_morton orders m_vIndices by the Morton code of each centroid and
+	// returns the codes in the same order. Both builds leave m_vIndices in leaf order.
+	std::vector<uint32_t> sort_morton();
+	void build_lbvh();
+	void subdivide_morton(uint32_t node_idx, uint32_t depth, const std::vector<uint32_t>& codes);
+	void build_ploc();
 protected:
+	// Binary build scratch, released once the tree is collapsed
 	std::vector<FBVHNode> m_vNodes{};
+	// Traversal nodes, root at index 0. Only one of the two is populated.
+	cache_aligned_vector<FBVHWideNode> m_vWideNodes{};
+	cache_aligned_vector<FBVHCompressedNode> m_vCompressedNodes{};
+	// Dense intersection records, indexed like m_vHittables
+	std::vector<FTriangle> m_vTriangles{};
+	// Shading attribute store, only read for the final hit
 	std::vector<CTriangle> m_vHittables{};
+	// Leaf triangles in traversal order, four per block
+	cache_aligned_vector<FTriangle4> m_vTriangleBlocks{};
+	// Analytic shapes, intersected in place of triangles when the tree holds them
+	std::vector<CShape> m_vShapes{};
+	cache_aligned_vector<FShape4> m_vShapeBlocks{};
+	bool m_bShapes{ false };
+	// Out-of-core storage, set while the leaves and primitives live in the pager only. Slots map
+	// primitive ids to their position in the leaf ordered primitive array of the file.
+	CGeometryPager* m_pPager{ nullptr };
+	uint64_t m_block_offset{ 0ull };
+	uint64_t m_primitive_offset{ 0ull };
+	size_t m_block_count{ 0ull };
+	std::vector<uint32_t> m_vSlots{};
+	FAxixAlignedBoundingBox m_bounds{};
+	// Build scratch, released once leaves are packed
 	std::vector<uint32_t> m_vIndices{};
+	std::vector<FAxixAlignedBoundingBox> m_vBounds{};
+	std::vector<glm::vec3> m_vCentroids{};
+
+	std::atomic<uint32_t> m_size{ 0u };
+	uint32_t m_max_task_depth{ 0u };
 
-	uint32_t m_size{ 0u };
+	FBVHConfig m_config{};
+	float m_root_area{ 0.f };
+	// References spatial splits may still add
+	size_t m_duplication_left{ 0ull };
 };
\ No newline at end of file
@@ -26,7 +26,9 @@ struct FCameraComponent
 
 	glm::uvec2 m_viewportExtent{ 0u };
 
-	std::vector<glm::vec3> m_vRayDirections{};
+	// World space film: the ray through film position p, in pixels, points along
+	// m_film_origin + p.x * m_film_dx + p.y * m_film_dy
+	glm::vec3 m_film_origin{ 0.f }, m_film_dx{ 0.f }, m_film_dy{ 0.f };
 
 	bool m_bWasMoved{ true };
 };
\ No newline at end of file
@@ -47,7 +47,7 @@ void CCameraSystem::update(CRayEngine* engine)
 
 void CCameraSystem::update_camera(entt::registry& registry, const glm::uvec2& extent, FCameraComponent* camera, FTransformComponent* transform)
 {
-	bool needToRecalculateRays{ false };
+	bool needToRecalculateFilm{ false };
 
 	camera->m_forward = glm::normalize(glm::rotate(transform->m_rotation_g, glm::vec3(0.f, 0.f, -1.f)));
 	camera->m_right = glm::normalize(glm::cross(camera->m_forward, glm::vec3{ 0.f, 1.f, 0.f }));
@@ -59,18 +59,18 @@ void CCameraSystem::update_camera(entt::registry& registry, const glm::uvec2& ex
 		camera->m_viewportExtent.y = extent.y;
 
 		recalculate_projection(camera);
-		needToRecalculateRays = true;
+		needToRecalculateFilm = true;
 	}
 
 	if (camera->m_bWasMoved)
 	{
 		recalculate_view(camera, transform);
 		camera->m_bWasMoved = false;
-		needToRecalculateRays = true;
+		needToRecalculateFilm = true;
 	}
 
-	if (needToRecalculateRays)
-		recalculate_ray_directions(camera);
+	if (needToRecalculateFilm)
+		recalculate_film(camera);
 }
 
 void CCameraSystem::recalculate_projection(FCameraComponent* camera)
@@ -89,21 +89,19 @@ void CCameraSystem::recalculate_view(FCameraComponent* camera, FTransformCompone
 	camera->m_invView = glm::inverse(camera->m_view);
 }
 
-void CCameraSystem::recalculate_ray_directions(FCameraComponent* camera)
+void CCameraSystem::recalculate_film(FCameraComponent* camera)
 {
 	auto& viewport_extent = camera->m_viewportExtent;
-	camera->m_vRayDirections.resize(viewport_extent.x * viewport_extent.y);
 
-	for (uint32_t y = 0; y < viewport_extent.y; y++)
-	{
-		for (uint32_t x = 0; x < viewport_extent.x; x++)
+	// Rays point at the far plane. The inverse projection's w doesn't depend on x and y, so far
+	// plane points are affine in NDC and three of them span the whole film.
+	auto far_point = [camera](float x, float y)
 		{
-			glm::vec2 texcoord = { static_cast<float>(x) / static_cast<float>(viewport_extent.x), static_cast<float>(y) / static_cast<float>(viewport_extent.y) };
-			texcoord = texcoord * 2.f - 1.f;
+			glm::vec4 target = camera->m_invProjection * glm::vec4(x, y, 1.f, 1.f);
+			return glm::vec3(camera->m_invView * glm::vec4(glm::vec3(target) / target.w, 0.f));
+		};
 
-			glm::vec4 target = camera->m_invProjection * glm::vec4(texcoord.x, texcoord.y, 1.f, 1.f);
-			auto dir = glm::vec3(camera->m_invView * glm::vec4(glm::normalize(glm::vec3(target) / target.w), 0.f));
-			camera->m_vRayDirections[x + y * viewport_extent.x] = glm::vec3(dir.x, dir.y, dir.z);
-		}
-	}
+	camera->m_film_origin = far_point(-1.f, -1.f);
+	camera->m_film_dx = (far_point(1.f, -1.f) - camera->m_film_origin) / static_cast<float>(glm::max(viewport_extent.x, 1u));
+	camera->m_film_dy = (far_point(-1.f, 1.f) - camera->m_film_origin) / static_cast<float>(glm::max(viewport_extent.y, 1u));
 }
\ No newline at end of file
@@ -11,19 +11,22 @@
 
 void CRenderSystem::create(CRayEngine* engine)
 {
+	auto& config = CConfiguration::getInstance()->get();
 	auto& scene = engine->get_scene();
-	scene->build_acceleration();
+	scene->build_acceleration(config.m_bvhcfg);
 }
 
 void CRenderSystem::update(CRayEngine* engine)
 {
 	auto& config = CConfiguration::getInstance()->get();
 	auto& renderer = engine->get_renderer();
-	auto& pixel_iter = renderer->get_pixel_iterator();
 
 	auto& scene = engine->get_scene();
 	auto& registry = scene->get_registry();
 
+	// The hierarchy system has already moved the world matrices for this update
+	scene->update_acceleration(config.m_bvhcfg);
+
 	FCameraComponent* current_camera{ nullptr };
 	FTransformComponent* camera_transform{ nullptr };
 
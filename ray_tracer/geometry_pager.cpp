@@ -0,0 +1,241 @@
+#include "geometry_pager.h"
+
+#include <logger/logger.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+struct CGeometryPager::FImpl
+{
+#if defined(_WIN32)
+	HANDLE file{ INVALID_HANDLE_VALUE };
+	HANDLE mapping{ nullptr };
+#else
+	int file{ -1 };
+#endif
+	const std::byte* view{ nullptr };
+};
+
+namespace
+{
+	uint32_t process_id()
+	{
+#if defined(_WIN32)
+		return static_cast<uint32_t>(GetCurrentProcessId());
+#else
+		return static_cast<uint32_t>(getpid());
+#endif
+	}
+
+	// Asks the OS to read the range ahead of the fault that would otherwise read it
+	void prefetch(const std::byte* address, size_t size)
+	{
+#if defined(_WIN32)
+		WIN32_MEMORY_RANGE_ENTRY range{ const_cast<std::byte*>(address), size };
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+		madvise(const_cast<std::byte*>(address), size, MADV_WILLNEED);
+#endif
+	}
+
+	// Drops the range from memory, the mapping stays valid and reads fault it back in from the file
+	void discard(const std::byte* address, size_t size)
+	{
+#if defined(_WIN32)
+		// Unlocking pages that are not locked trims them from the working set
+		VirtualUnlock(const_cast<std::byte*>(address), size);
+#else
+		madvise(const_cast<std::byte*>(address), size, MADV_DONTNEED);
+#endif
+	}
+}
+
+CGeometryPager::CGeometryPager(const std::filesystem::path& directory, size_t memory_budget) :
+	m_memory_budget(memory_budget)
+{
+	static std::atomic<uint32_t> pager_count{ 0u };
+
+	m_impl = new FImpl();
+	m_path = (directory.empty() ? std::filesystem::temp_directory_path() : directory) / std::format("geometry_{}_{}.bin", process_id(), pager_count++);
+	m_file.open(m_path, std::ios::binary | std::ios::trunc);
+	if (!m_file.is_open())
+		log_error("Failed to create the geometry paging file {}.", m_path.string());
+}
+
+CGeometryPager::~CGeometryPager()
+{
+#if defined(_WIN32)
+	if (m_impl->view)
+		UnmapViewOfFile(m_impl->view);
+	if (m_impl->mapping)
+		CloseHandle(m_impl->mapping);
+	if (m_impl->file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_impl->file);
+#else
+	if (m_impl->view)
+		munmap(const_cast<std::byte*>(m_impl->view), m_size);
+	if (m_impl->file >= 0)
+		close(m_impl->file);
+#endif
+	delete m_impl;
+
+	m_file.close();
+	std::error_code error{};
+	std::filesystem::remove(m_path, error);
+}
+
+uint64_t CGeometryPager::append(const void* data, size_t size)
+{
+	constexpr const uint64_t alignment{ 64ull };
+	static const char padding[alignment]{};
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto offset = (m_size + alignment - 1ull) & ~(alignment - 1ull);
+	bool was_good = m_file.good();
+	m_file.write(padding, static_cast<std::streamsize>(offset - m_size));
+	m_file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+	// The stream stays failed, so map refuses the short file instead of mapping past its end
+	if (was_good && !m_file)
+		log_error("Failed to write {} bytes to the geometry paging file {}.", size, m_path.string());
+	m_size = offset + size;
+	return offset;
+}
+
+bool CGeometryPager::map()
+{
+	m_file.close();
+	if (m_file.fail())
+	{
+		log_error("Failed to write the geometry paging file {}.", m_path.string());
+		return false;
+	}
+
+	if (m_size == 0ull)
+		return true;
+
+#if defined(_WIN32)
+	m_impl->file = CreateFileW(m_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (m_impl->file != INVALID_HANDLE_VALUE)
+		m_impl->mapping = CreateFileMappingW(m_impl->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (m_impl->mapping)
+		m_impl->view = static_cast<const std::byte*>(MapViewOfFile(m_impl->mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+	m_impl->file = open(m_path.c_str(), O_RDONLY);
+	if (m_impl->file >= 0)
+	{
+		auto* view = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_impl->file, 0);
+		if (view != MAP_FAILED)
+		{
+			// Clusters are read in whole by acquire, read-ahead past them would break the budget
+			madvise(view, m_size, MADV_RANDOM);
+			m_impl->view = static_cast<const std::byte*>(view);
+		}
+	}
+#endif
+
+	if (!m_impl->view)
+	{
+		log_error("Failed to map the geometry paging file {}.", m_path.string());
+		return false;
+	}
+
+	m_cluster_count = (m_size + cluster_size - 1ull) / cluster_size;
+	m_pClusters = std::make_unique<std::atomic<uint8_t>[]>(m_cluster_count);
+	for (size_t cluster = 0ull; cluster < m_cluster_count; ++cluster)
+		m_pClusters[cluster].store(0u, std::memory_order_relaxed);
+
+	return true;
+}
+
+const std::byte* CGeometryPager::acquire(uint64_t offset, size_t size)
+{
+	auto last = (offset + glm::max(size, size_t{ 1ull }) - 1ull) / cluster_size;
+	for (auto cluster = offset / cluster_size; cluster <= last; ++cluster)
+	{
+		auto& state = m_pClusters[cluster];
+		auto current = state.load(std::memory_order_relaxed);
+		// Only written when it changes, so hot clusters do not bounce between cores. The mark is a
+		// compare-exchange so it can't resurrect a cluster the clock evicted after the load, a failed
+		// exchange leaves the new state in current.
+		if (current == 1u)
+			state.compare_exchange_strong(current, 2u, std::memory_order_relaxed);
+		if (current == 0u)
+			page_in(cluster);
+	}
+
+	return m_impl->view + offset;
+}
+
+const std::byte* CGeometryPager::data(uint64_t offset) const
+{
+	return m_impl->view + offset;
+}
+
+void CGeometryPager::page_in(size_t cluster)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_pClusters[cluster].load(std::memory_order_relaxed) != 0u)
+		return;
+
+	auto bytes = cluster_bytes(cluster);
+
+	// The clock hand clears used marks and evicts the first cluster it finds unused
+	while (m_resident.load(std::memory_order_relaxed) + bytes > m_memory_budget && m_resident.load(std::memory_order_relaxed) > 0ull)
+	{
+		auto& state = m_pClusters[m_clock_hand];
+		auto current = state.load(std::memory_order_relaxed);
+		if (current == 2u)
+			state.store(1u, std::memory_order_relaxed);
+		else if (current == 1u && state.compare_exchange_strong(current, 0u, std::memory_order_relaxed))
+		{
+			// A reader marking it used in between makes the exchange fail, it is then kept
+			auto evicted_bytes = cluster_bytes(m_clock_hand);
+			discard(m_impl->view + m_clock_hand * cluster_size, evicted_bytes);
+			m_resident.fetch_sub(evicted_bytes, std::memory_order_relaxed);
+			m_evictions.fetch_add(1ull, std::memory_order_relaxed);
+		}
+		m_clock_hand = (m_clock_hand + 1ull) % m_cluster_count;
+	}
+
+	prefetch(m_impl->view + cluster * cluster_size, bytes);
+	m_pClusters[cluster].store(2u, std::memory_order_relaxed);
+	m_resident.fetch_add(bytes, std::memory_order_relaxed);
+	m_faults.fetch_add(1ull, std::memory_order_relaxed);
+}
+
+size_t CGeometryPager::cluster_bytes(size_t cluster) const
+{
+	return glm::min(cluster_size, m_size - cluster * cluster_size);
+}
+
+const std::filesystem::path& CGeometryPager::get_path() const
+{
+	return m_path;
+}
+
+size_t CGeometryPager::size() const
+{
+	return m_size;
+}
+
+size_t CGeometryPager::resident_memory() const
+{
+	return m_resident.load(std::memory_order_relaxed);
+}
+
+uint64_t CGeometryPager::fault_count() const
+{
+	return m_faults.load(std::memory_order_relaxed);
+}
+
+uint64_t CGeometryPager::eviction_count() const
+{
+	return m_evictions.load(std::memory_order_relaxed);
+}
\ No newline at end of file
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+// Out-of-core store of BVH leaf clusters: leaf blocks and primitive attributes are appended to
+// one file while the bottom levels are built, then read back through a read-only mapping. The
+// file is split into clusters of cluster_size bytes, of which at most the memory budget is kept
+// resident. Traversal acquires the clusters of every leaf it visits: resident ones are only
+// marked used, others block on the page fault that reads them in and evict the least recently
+// used clusters, approximated by the CLOCK algorithm so that marking takes no lock. Evicted pages
+// stay mapped and fault back in on their next use, so readers never see them go away.
+class CGeometryPager
+{
+public:
+	static constexpr const size_t cluster_size{ 64ull * 1024ull };
+
+	// An empty directory pages to the system temporary directory
+	CGeometryPager(const std::filesystem::path& directory, size_t memory_budget);
+	~CGeometryPager();
+
+	CGeometryPager(const CGeometryPager&) = delete;
+	CGeometryPager& operator=(const CGeometryPager&) = delete;
+
+	// Appends size bytes on a cache line boundary and returns their file offset. Thread safe,
+	// only valid before map.
+	uint64_t append(const void* data, size_t size);
+	// Maps the written file, reads go through acquire from then on
+	bool map();
+
+	// Pages in the clusters of [offset, offset + size) and marks them used
+	const std::byte* acquire(uint64_t offset, size_t size);
+	// Mapped address of offset, without residency accounting
+	const std::byte* data(uint64_t offset) const;
+
+	const std::filesystem::path& get_path() const;
+	size_t size() const;
+	size_t resident_memory() const;
+	uint64_t fault_count() const;
+	uint64_t eviction_count() const;
+
+	// Opaque mapping state, defined in the .cpp so no platform header leaks out
+	struct FImpl;
+private:
+	void page_in(size_t cluster);
+	// Bytes of the cluster inside the file, only the last one can be short
+	size_t cluster_bytes(size_t cluster) const;
+
+	FImpl* m_impl{ nullptr };
+
+	std::filesystem::path m_path{};
+	std::ofstream m_file{};
+	std::mutex m_mutex{};
+	uint64_t m_size{ 0ull };
+	size_t m_memory_budget{ 0ull };
+
+	// Per cluster: 0 evicted, 1 resident, 2 resident and used since the clock hand last passed
+	std::unique_ptr<std::atomic<uint8_t>[]> m_pClusters{};
+	size_t m_cluster_count{ 0ull };
+	size_t m_clock_hand{ 0ull };
+	std::atomic<size_t> m_resident{ 0ull };
+	std::atomic<uint64_t> m_faults{ 0ull };
+	std::atomic<uint64_t> m_evictions{ 0ull };
+};
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "hittable.h"
+#include "resources/vertex_buffer.h"
 #include "ecs/components/transform_component.h"
 
 #include <glm/gtx/quaternion.hpp>
@@ -32,108 +33,81 @@ void pretransform(const glm::mat4& tm, glm::vec4& v0, glm::vec4& v1, glm::vec4&
 	v2 = glm::vec4(normalize ? glm::normalize(glm::vec3(t2) / t2.w) : glm::vec3(t2) / t2.w, v2.w);
 }
 
-CTriangle::CTriangle(entt::registry& registry, entt::entity root, resource_id_t material_id, const FVertex& v0, const FVertex& v1, const FVertex& v2, size_t index) :
-	m_v0(v0), m_v1(v1), m_v2(v2)
+CTriangle::CTriangle(resource_id_t material_id, const CVertexBuffer* vertex_buffer, uint32_t i0, uint32_t i1, uint32_t i2, size_t index) :
+	m_pVertexBuffer(vertex_buffer), m_indices{ i0, i1, i2 }
 {
 	m_material_id = material_id;
 	m_index = index;
-	m_pRegistry = &registry;
-	m_root = root;
 }
 
-void CTriangle::create()
+const FVertex& CTriangle::vertex(uint32_t corner) const
 {
-	auto& transform = m_pRegistry->get<FTransformComponent>(m_root);
-
-	// Pretransform positions
-	auto v0p = transform.m_model * glm::vec4(m_v0.m_position, 1.f);
-	auto v1p = transform.m_model * glm::vec4(m_v1.m_position, 1.f);
-	auto v2p = transform.m_model * glm::vec4(m_v2.m_position, 1.f);
-
-	m_v0.m_position = glm::vec3(v0p) / v0p.w;
-	m_v1.m_position = glm::vec3(v1p) / v1p.w;
-	m_v2.m_position = glm::vec3(v2p) / v2p.w;
-
-	m_e0 = m_v1.m_position - m_v0.m_position;
-	m_e1 = m_v2.m_position - m_v0.m_position;
-
-	m_area = 0.5f * glm::length(glm::cross(m_e0, m_e1));
-
-	m_aabb.m_min = glm::min(m_v0.m_position, glm::min(m_v1.m_position, m_v2.m_position));
-	m_aabb.m_max = glm::max(m_v0.m_position, glm::max(m_v1.m_position, m_v2.m_position));
+	return m_pVertexBuffer->get_vertex(m_indices[corner]);
+}
 
-	m_normal = glm::mat3(transform.m_normal);
+FTriangle CTriangle::create() const
+{
+	auto& v0 = vertex(0u);
 
-	m_centroid = (m_v0.m_position + m_v1.m_position + m_v2.m_position) * 0.3333f;
+	FTriangle geometry{};
+	geometry.m_v0 = v0.m_position;
+	geometry.m_e0 = vertex(1u).m_position - v0.m_position;
+	geometry.m_e1 = vertex(2u).m_position - v0.m_position;
+	return geometry;
 }
 
-bool CTriangle::hit(const FRay& ray, float t_min, float t_max, FHitResult& hit_result) const
+void CTriangle::interpolate(const FRay& ray, const FHitResult& hit_result, const glm::mat3& normal, FSurfaceInteraction& surface) const
 {
-	float dist{ hit_result.m_distance };
-	glm::vec3 barycentric{};
-	if(math::ray_triangle_intersect(ray.m_origin, ray.m_direction, m_e0, m_e1, m_v0.m_position, dist, barycentric))
-	{
-		if (dist >= t_min && dist <= t_max)
-		{
-			hit_result.m_distance = dist;
-			hit_result.m_position = ray.at(dist);
+	glm::vec3 barycentric{ 1.f - hit_result.m_barycentric.x - hit_result.m_barycentric.y, hit_result.m_barycentric.x, hit_result.m_barycentric.y };
+	auto& v0 = vertex(0u);
+	auto& v1 = vertex(1u);
+	auto& v2 = vertex(2u);
 
-			// Calculating color
-			hit_result.m_color = barycentric.x * m_v0.m_color + barycentric.y * m_v1.m_color + barycentric.z * m_v2.m_color;
+	surface.m_distance = hit_result.m_distance;
+	surface.m_position = ray.at(hit_result.m_distance);
 
-			// Calculating normal
-			auto outward_normal = barycentric.x * m_v0.m_normal + barycentric.y * m_v1.m_normal + barycentric.z * m_v2.m_normal;
-			outward_normal = glm::normalize(m_normal * outward_normal);
-			hit_result.set_face_normal(ray, outward_normal);
+	// Calculating color
+	surface.m_color = barycentric.x * v0.m_color + barycentric.y * v1.m_color + barycentric.z * v2.m_color;
 
-			// Calculating texture coordinates
-			hit_result.m_texcoord = barycentric.x * m_v0.m_texcoord + barycentric.y * m_v1.m_texcoord + barycentric.z * m_v2.m_texcoord;
+	// Calculating normal
+	auto outward_normal = barycentric.x * v0.m_normal + barycentric.y * v1.m_normal + barycentric.z * v2.m_normal;
+	outward_normal = glm::normalize(normal * outward_normal);
+	surface.set_face_normal(ray, outward_normal);
 
-			auto tangent = barycentric.x * m_v0.m_tangent + barycentric.y * m_v1.m_tangent + barycentric.z * m_v2.m_tangent;
-			tangent = glm::vec4(glm::normalize(m_normal * glm::vec3(tangent)), tangent.w);
-			hit_result.m_tangent = glm::vec3(tangent);
+	// Calculating texture coordinates
+	surface.m_texcoord = barycentric.x * v0.m_texcoord + barycentric.y * v1.m_texcoord + barycentric.z * v2.m_texcoord;
 
-			hit_result.m_bitangent = glm::normalize(glm::cross(hit_result.m_normal, glm::vec3(tangent)) * tangent.w);
+	auto tangent = barycentric.x * v0.m_tangent + barycentric.y * v1.m_tangent + barycentric.z * v2.m_tangent;
+	tangent = glm::vec4(glm::normalize(normal * glm::vec3(tangent)), tangent.w);
+	surface.m_tangent = glm::vec3(tangent);
 
-			// Set material
-			hit_result.m_material_id = m_material_id;
-			hit_result.m_primitive_id = m_index;
+	surface.m_bitangent = glm::normalize(glm::cross(surface.m_normal, glm::vec3(tangent)) * tangent.w);
 
-			return true;
-		}
-	}
-
-	return false;
+	// Set material
+	surface.m_material_id = m_material_id;
+	surface.m_primitive_id = static_cast<uint32_t>(m_index);
+	surface.m_instance_id = hit_result.m_instance_id;
 }
 
-float CTriangle::pdf(const glm::vec3& p, const glm::vec3& wi) const
+float CTriangle::pdf(const FTriangle& geometry, const glm::mat3& normal, const glm::vec3& p, const glm::vec3& wi) const
 {
 	FRay ray{};
 	ray.m_origin = p;
 	ray.set_direction(wi);
 
 	FHitResult hit_result{};
-	bool hit_something = hit(ray, 0.f, std::numeric_limits<float>::infinity(), hit_result);
-
-	if (!hit_something)
+	if (!geometry.intersect(ray, 0.f, std::numeric_limits<float>::infinity(), hit_result))
 		return 0.f;
 
-	float cosThetaI = glm::dot(-wi, hit_result.m_normal);
+	FSurfaceInteraction surface{};
+	interpolate(ray, hit_result, normal, surface);
+
+	float cosThetaI = glm::dot(-wi, surface.m_normal);
 	if (cosThetaI <= 0.f)
 		return 0.f;
 
-	float square_dist = glm::length2(hit_result.m_position - p);
-	return square_dist / (cosThetaI * m_area);
-}
-
-const FAxixAlignedBoundingBox& CTriangle::bounds() const
-{
-	return m_aabb;
-}
-
-const glm::vec3 CTriangle::centroid() const
-{
-	return m_centroid;
+	float square_dist = glm::length2(surface.m_position - p);
+	return square_dist / (cosThetaI * geometry.area());
 }
 
 resource_id_t CTriangle::get_material_id() const
@@ -141,22 +115,112 @@ resource_id_t CTriangle::get_material_id() const
 	return m_material_id;
 }
 
-glm::vec3 CTriangle::sample(const glm::vec3& p, const glm::vec2& sample, float& pdf) const
+glm::vec3 CTriangle::sample(const FTriangle& geometry, const glm::mat3& normal_matrix, const glm::vec3& p, const glm::vec2& sample, float& pdf, FSurfaceInteraction& light_hit) const
 {
 	glm::vec2 uv = sample_uniform_triangle(sample);
 	float w = (1.f - uv.x - uv.y);
-	glm::vec3 q = uv.x * m_v0.m_position + uv.y * m_v1.m_position + w * m_v2.m_position;
+	glm::vec3 q = uv.x * geometry.m_v0 + uv.y * (geometry.m_v0 + geometry.m_e0) + w * (geometry.m_v0 + geometry.m_e1);
 	glm::vec3 dir = glm::normalize(q - p);
 
-	glm::vec3 normal = uv.x * m_v0.m_normal + uv.y * m_v1.m_normal + w * m_v2.m_normal;
-	normal = glm::normalize(m_normal * normal);
+	auto& v0 = vertex(0u);
+	auto& v1 = vertex(1u);
+	auto& v2 = vertex(2u);
+	glm::vec3 normal = uv.x * v0.m_normal + uv.y * v1.m_normal + w * v2.m_normal;
+	normal = glm::normalize(normal_matrix * normal);
 
 	float cosThetaI = glm::dot(-dir, normal);
 
 	if (cosThetaI <= 0.f)
 		pdf = 0.f;
 	else
-		pdf = glm::length2(q - p) / (cosThetaI * m_area);
+		pdf = glm::length2(q - p) / (cosThetaI * geometry.area());
+
+	light_hit.m_distance = glm::length(q - p);
+	light_hit.m_position = q;
+	light_hit.m_normal = normal;
+	light_hit.m_bFrontFace = cosThetaI > 0.f;
+	light_hit.m_color = uv.x * v0.m_color + uv.y * v1.m_color + w * v2.m_color;
+	light_hit.m_texcoord = uv.x * v0.m_texcoord + uv.y * v1.m_texcoord + w * v2.m_texcoord;
+	light_hit.m_material_id = m_material_id;
+	light_hit.m_primitive_id = static_cast<uint32_t>(m_index);
 
 	return dir;
+}
+
+CShape::CShape(EShapeType type, resource_id_t material_id, const glm::vec3& center, const glm::vec3& normal, float radius, const glm::vec3& color, size_t index) :
+	m_type(type), m_center(center), m_normal(glm::normalize(normal)), m_radius(radius), m_color(color)
+{
+	m_material_id = material_id;
+	m_index = index;
+}
+
+FAxixAlignedBoundingBox CShape::bounds() const
+{
+	if (m_type == EShapeType::eSphere)
+		return FAxixAlignedBoundingBox(m_center - glm::vec3(m_radius), m_center + glm::vec3(m_radius));
+
+	// A disk reaches radius * sin of the angle between its normal and the axis
+	auto extent = m_radius * glm::sqrt(glm::max(glm::vec3(1.f) - m_normal * m_normal, glm::vec3(0.f)));
+	return FAxixAlignedBoundingBox(m_center - extent, m_center + extent);
+}
+
+glm::vec3 CShape::centroid() const
+{
+	return m_center;
+}
+
+void CShape::interpolate(const FRay& ray, const FHitResult& hit_result, const glm::mat3& normal, FSurfaceInteraction& surface) const
+{
+	surface.m_distance = hit_result.m_distance;
+	surface.m_position = ray.at(hit_result.m_distance);
+	surface.m_color = m_color;
+	surface.m_texcoord = hit_result.m_barycentric;
+
+	glm::vec3 outward_normal{}, tangent{};
+	if (m_type == EShapeType::eSphere)
+	{
+		float phi = (hit_result.m_barycentric.x - 0.5f) * 2.f * std::numbers::pi_v<float>;
+		float theta = hit_result.m_barycentric.y * std::numbers::pi_v<float>;
+		outward_normal = glm::vec3(glm::sin(theta) * glm::cos(phi), glm::cos(theta), glm::sin(theta) * glm::sin(phi));
+		tangent = glm::vec3(-glm::sin(phi), 0.f, glm::cos(phi));
+	}
+	else
+	{
+		glm::vec3 bitangent{};
+		disk_frame(m_normal, tangent, bitangent);
+		outward_normal = m_normal;
+	}
+
+	surface.set_face_normal(ray, glm::normalize(normal * outward_normal));
+	surface.m_tangent = glm::normalize(normal * tangent);
+	surface.m_bitangent = glm::normalize(glm::cross(surface.m_normal, surface.m_tangent));
+
+	surface.m_material_id = m_material_id;
+	surface.m_primitive_id = static_cast<uint32_t>(m_index);
+	surface.m_instance_id = hit_result.m_instance_id;
+}
+
+resource_id_t CShape::get_material_id() const
+{
+	return m_material_id;
+}
+
+EShapeType CShape::get_type() const
+{
+	return m_type;
+}
+
+const glm::vec3& CShape::get_center() const
+{
+	return m_center;
+}
+
+const glm::vec3& CShape::get_normal() const
+{
+	return m_normal;
+}
+
+float CShape::get_radius() const
+{
+	return m_radius;
 }
\ No newline at end of file
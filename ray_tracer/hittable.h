@@ -3,33 +3,305 @@
 #include "aabb.h"
 #include "resources/vertex.h"
 
+class CVertexBuffer;
+
+// Intersection record the BVH leaf loop streams through: world-space v0 and the two edges.
+struct FTriangle
+{
+	glm::vec3 m_v0{};
+	glm::vec3 m_e0{};
+	glm::vec3 m_e1{};
+
+	bool intersect(const FRay& ray, float t_min, float t_max, float& distance, glm::vec3& barycentric) const
+	{
+		if (!math::ray_triangle_intersect(ray.m_origin, ray.m_direction, m_e0, m_e1, m_v0, distance, barycentric))
+			return false;
+
+		return distance >= t_min && distance <= t_max;
+	}
+
+	// Records distance and barycentrics only; the caller owns the primitive id.
+	bool intersect(const FRay& ray, float t_min, float t_max, FHitResult& hit_result) const
+	{
+		float distance{};
+		glm::vec3 barycentric{};
+		if (!intersect(ray, t_min, t_max, distance, barycentric))
+			return false;
+
+		hit_result.m_distance = distance;
+		hit_result.m_barycentric = glm::vec2(barycentric.y, barycentric.z);
+		return true;
+	}
+
+	bool intersect(const FRay& ray, float t_min, float t_max) const
+	{
+		float distance{};
+		glm::vec3 barycentric{};
+		return intersect(ray, t_min, t_max, distance, barycentric);
+	}
+
+	float area() const
+	{
+		return 0.5f * glm::length(glm::cross(m_e0, m_e1));
+	}
+
+	// Same triangle under an instance transform
+	FTriangle transform(const glm::mat4& model) const
+	{
+		auto v0 = model * glm::vec4(m_v0, 1.f);
+		auto v1 = model * glm::vec4(m_v0 + m_e0, 1.f);
+		auto v2 = model * glm::vec4(m_v0 + m_e1, 1.f);
+
+		FTriangle result{};
+		result.m_v0 = glm::vec3(v0) / v0.w;
+		result.m_e0 = glm::vec3(v1) / v1.w - result.m_v0;
+		result.m_e1 = glm::vec3(v2) / v2.w - result.m_v0;
+		return result;
+	}
+
+	FAxixAlignedBoundingBox bounds() const
+	{
+		auto v1 = m_v0 + m_e0;
+		auto v2 = m_v0 + m_e1;
+		return FAxixAlignedBoundingBox(glm::min(m_v0, glm::min(v1, v2)), glm::max(m_v0, glm::max(v1, v2)));
+	}
+
+	glm::vec3 centroid() const
+	{
+		return (m_v0 * 3.f + m_e0 + m_e1) * 0.3333f;
+	}
+};
+
+// Four leaf triangles packed SoA as [axis][lane] so one SSE kernel tests the whole block.
+// Unused lanes stay zeroed and carry an invalid primitive id.
+struct alignas(16) FTriangle4
+{
+	float m_v0[3][4]{};
+	float m_e0[3][4]{};
+	float m_e1[3][4]{};
+	uint32_t m_primitive_id[4]{ invalid_primitive, invalid_primitive, invalid_primitive, invalid_primitive };
+
+	static constexpr const uint32_t invalid_primitive{ std::numeric_limits<uint32_t>::max() };
+
+	void set(uint32_t lane, const FTriangle& triangle, uint32_t primitive_id)
+	{
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			m_v0[axis][lane] = triangle.m_v0[axis];
+			m_e0[axis][lane] = triangle.m_e0[axis];
+			m_e1[axis][lane] = triangle.m_e1[axis];
+		}
+
+		m_primitive_id[lane] = primitive_id;
+	}
+
+	// Closest lane hit in [t_min, t_max]; origin and direction are the ray components splatted per axis.
+	bool intersect(const __m128* origin, const __m128* direction, float t_min, float t_max, FHitResult& hit_result) const
+	{
+		__m128 distance, u, v;
+		int mask = math::ray_triangle_intersect4(origin, direction, &m_e0[0][0], &m_e1[0][0], &m_v0[0][0], t_min, t_max, distance, u, v);
+		if (mask == 0)
+			return false;
+
+		alignas(16) float distances[4], us[4], vs[4];
+		_mm_store_ps(distances, distance);
+		_mm_store_ps(us, u);
+		_mm_store_ps(vs, v);
+
+		int best{ -1 };
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			if ((mask & (1 << lane)) && (best < 0 || distances[lane] < distances[best]))
+				best = lane;
+		}
+
+		hit_result.m_distance = distances[best];
+		hit_result.m_barycentric = glm::vec2(us[best], vs[best]);
+		hit_result.m_primitive_id = m_primitive_id[best];
+		return true;
+	}
+
+	bool intersect(const __m128* origin, const __m128* direction, float t_min, float t_max) const
+	{
+		__m128 distance, u, v;
+		return math::ray_triangle_intersect4(origin, direction, &m_e0[0][0], &m_e1[0][0], &m_v0[0][0], t_min, t_max, distance, u, v) != 0;
+	}
+};
+
+// Shading attributes of a triangle. Read once for the final hit and for light sampling,
+// never during traversal. Lives in mesh (object) space and is shared by every instance of the
+// mesh, so world-space geometry and the instance normal matrix are passed in. Vertices are
+// indices into the mesh's vertex buffer, which must outlive the triangle.
 class CTriangle
 {
 public:
-	CTriangle(entt::registry& registry, entt::entity root, resource_id_t material_id, const FVertex& v0, const FVertex& v1, const FVertex& v2, size_t index);
+	CTriangle(resource_id_t material_id, const CVertexBuffer* vertex_buffer, uint32_t i0, uint32_t i1, uint32_t i2, size_t index);
 	~CTriangle() = default;
 
-	void create();
+	// Returns the object-space intersection record.
+	FTriangle create() const;
+
+	// ray is the world-space ray; the hit distance is shared with the object-space ray.
+	void interpolate(const FRay& ray, const FHitResult& hit_result, const glm::mat3& normal, FSurfaceInteraction& surface) const;
+	float pdf(const FTriangle& geometry, const glm::mat3& normal, const glm::vec3& p, const glm::vec3& wi) const;
+	resource_id_t get_material_id() const;
+
+	// Samples a point on the triangle as seen from p. Fills light_hit with the surface data at
+	// the sampled point so emission can be evaluated without tracing a closest-hit ray to it.
+	glm::vec3 sample(const FTriangle& geometry, const glm::mat3& normal, const glm::vec3& p, const glm::vec2& sample, float& pdf, FSurfaceInteraction& light_hit) const;
+
+private:
+	const FVertex& vertex(uint32_t corner) const;
+
+	// Object-space vertices, shared with the neighbouring triangles
+	const CVertexBuffer* m_pVertexBuffer{ nullptr };
+	uint32_t m_indices[3]{};
+
+	resource_id_t m_material_id{ invalid_index };
+	size_t m_index{ invalid_index };
+};
+
+enum class EShapeType : uint32_t
+{
+	eSphere,
+	eDisk
+};
+
+// Tangent frame of a disk, the same for its intersection and shading
+inline void disk_frame(const glm::vec3& normal, glm::vec3& tangent, glm::vec3& bitangent)
+{
+	tangent = glm::normalize(glm::cross(glm::abs(normal.y) < 0.999f ? glm::vec3(0.f, 1.f, 0.f) : glm::vec3(1.f, 0.f, 0.f), normal));
+	bitangent = glm::cross(normal, tangent);
+}
+
+// Surface parameters of a point given by its offset from the shape center, in [0, 1]. Spheres
+// use longitude and colatitude, disks the relative radius and the angle around the normal.
+inline glm::vec2 shape_parameters(EShapeType type, const glm::vec3& offset, const glm::vec3& normal, float radius)
+{
+	constexpr const float inv_two_pi{ 0.5f * std::numbers::inv_pi_v<float> };
+	if (type == EShapeType::eSphere)
+	{
+		auto direction = offset / glm::max(glm::length(offset), std::numeric_limits<float>::min());
+		return glm::vec2(std::atan2(direction.z, direction.x) * inv_two_pi + 0.5f, std::acos(glm::clamp(direction.y, -1.f, 1.f)) * std::numbers::inv_pi_v<float>);
+	}
+
+	glm::vec3 tangent{}, bitangent{};
+	disk_frame(normal, tangent, bitangent);
+	return glm::vec2(glm::length(offset) / radius, std::atan2(glm::dot(offset, bitangent), glm::dot(offset, tangent)) * inv_two_pi + 0.5f);
+}
+
+// Analytic sphere or disk. Small enough to serve both the build and shading, so unlike CTriangle
+// it has no separate intersection record. Lives in mesh (object) space like CTriangle; a mesh
+// holds either triangles or shapes, never both.
+class CShape
+{
+public:
+	// normal is only used by disks
+	CShape(EShapeType type, resource_id_t material_id, const glm::vec3& center, const glm::vec3& normal, float radius, const glm::vec3& color, size_t index);
+	~CShape() = default;
+
+	FAxixAlignedBoundingBox bounds() const;
+	glm::vec3 centroid() const;
 
-	bool hit(const FRay& r, float t_min, float t_max, FHitResult& hit_result) const;
-	float pdf(const glm::vec3& p, const glm::vec3& wi) const;
-	const FAxixAlignedBoundingBox& bounds() const;
-	const glm::vec3 centroid() const;
+	// ray is the world-space ray; the hit carries the object-space surface parameters.
+	void interpolate(const FRay& ray, const FHitResult& hit_result, const glm::mat3& normal, FSurfaceInteraction& surface) const;
 	resource_id_t get_material_id() const;
 
-	glm::vec3 sample(const glm::vec3& p, const glm::vec2& sample, float& pdf) const;
+	EShapeType get_type() const;
+	const glm::vec3& get_center() const;
+	const glm::vec3& get_normal() const;
+	float get_radius() const;
 
 private:
-	FVertex m_v0, m_v1, m_v2;
-	glm::vec3 m_e0, m_e1;
-	glm::vec3 m_centroid{};
-	glm::mat3 m_normal{ 1.f };
-	float m_area{ 0.f };
+	EShapeType m_type{ EShapeType::eSphere };
+	glm::vec3 m_center{};
+	glm::vec3 m_normal{ 0.f, 1.f, 0.f };
+	float m_radius{ 0.f };
+	glm::vec3 m_color{ 1.f };
 
-	FAxixAlignedBoundingBox m_aabb{};
 	resource_id_t m_material_id{ invalid_index };
 	size_t m_index{ invalid_index };
+};
+
+// Four leaf shapes packed SoA like FTriangle4. Spheres and disks share blocks, each kernel runs
+// on the whole block and the lanes of the other type are masked off.
+struct alignas(16) FShape4
+{
+	float m_center[3][4]{};
+	float m_normal[3][4]{};
+	// Unused lanes keep radius 0, which neither kernel accepts
+	float m_radius[4]{};
+	uint32_t m_primitive_id[4]{ invalid_primitive, invalid_primitive, invalid_primitive, invalid_primitive };
+	// Lane mask of disks
+	int m_disk_mask{ 0 };
+
+	static constexpr const uint32_t invalid_primitive{ FTriangle4::invalid_primitive };
+
+	void set(uint32_t lane, const CShape& shape, uint32_t primitive_id)
+	{
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			m_center[axis][lane] = shape.get_center()[axis];
+			m_normal[axis][lane] = shape.get_normal()[axis];
+		}
+
+		m_radius[lane] = shape.get_radius();
+		m_primitive_id[lane] = primitive_id;
+		if (shape.get_type() == EShapeType::eDisk)
+			m_disk_mask |= 1 << lane;
+		else
+			m_disk_mask &= ~(1 << lane);
+	}
+
+	// Lane mask of hits in [t_min, t_max] with their distances
+	int intersect(const __m128* origin, const __m128* direction, float t_min, float t_max, __m128& distance) const
+	{
+		int mask = math::ray_sphere_intersect4(origin, direction, &m_center[0][0], m_radius, t_min, t_max, distance) & ~m_disk_mask;
+		if (m_disk_mask == 0)
+			return mask;
+
+		__m128 disk_distance;
+		int disk_mask = math::ray_disk_intersect4(origin, direction, &m_center[0][0], &m_normal[0][0], m_radius, t_min, t_max, disk_distance) & m_disk_mask;
+
+		alignas(16) static constexpr const int32_t lane_bits[4]{ 1, 2, 4, 8 };
+		__m128 disks = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(m_disk_mask), _mm_load_si128(reinterpret_cast<const __m128i*>(lane_bits))), _mm_load_si128(reinterpret_cast<const __m128i*>(lane_bits))));
+		distance = _mm_or_ps(_mm_and_ps(disks, disk_distance), _mm_andnot_ps(disks, distance));
+		return mask | disk_mask;
+	}
+
+	// Closest lane hit, records the surface parameters in place of barycentrics.
+	bool intersect(const __m128* origin, const __m128* direction, float t_min, float t_max, FHitResult& hit_result) const
+	{
+		__m128 distance;
+		int mask = intersect(origin, direction, t_min, t_max, distance);
+		if (mask == 0)
+			return false;
+
+		alignas(16) float distances[4];
+		_mm_store_ps(distances, distance);
+
+		int best{ -1 };
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			if ((mask & (1 << lane)) && (best < 0 || distances[lane] < distances[best]))
+				best = lane;
+		}
+
+		glm::vec3 ray_origin{ _mm_cvtss_f32(origin[0]), _mm_cvtss_f32(origin[1]), _mm_cvtss_f32(origin[2]) };
+		glm::vec3 ray_direction{ _mm_cvtss_f32(direction[0]), _mm_cvtss_f32(direction[1]), _mm_cvtss_f32(direction[2]) };
+		glm::vec3 center{ m_center[0][best], m_center[1][best], m_center[2][best] };
+		glm::vec3 normal{ m_normal[0][best], m_normal[1][best], m_normal[2][best] };
+		auto type = (m_disk_mask & (1 << best)) ? EShapeType::eDisk : EShapeType::eSphere;
+
+		hit_result.m_distance = distances[best];
+		hit_result.m_barycentric = shape_parameters(type, ray_origin + ray_direction * distances[best] - center, normal, m_radius[best]);
+		hit_result.m_primitive_id = m_primitive_id[best];
+		return true;
+	}
 
-	entt::entity m_root{ entt::null };
-	entt::registry* m_pRegistry{ nullptr };
+	bool intersect(const __m128* origin, const __m128* direction, float t_min, float t_max) const
+	{
+		__m128 distance;
+		return intersect(origin, direction, t_min, t_max, distance) != 0;
+	}
 };
\ No newline at end of file
@@ -0,0 +1,597 @@
+#include "instance_tree.h"
+
+#include "ecs/components/transform_component.h"
+#include "bvh_stats.h"
+#include "thread_pool.h"
+#include "traversal_stack.h"
+
+constexpr uint32_t instance_bins = 8u;
+constexpr uint32_t instance_leaf_size = 2u;
+
+uint32_t CInstanceTree::add_mesh()
+{
+	m_vMeshes.emplace_back(std::make_unique<CBVHTreeNew>());
+	return static_cast<uint32_t>(m_vMeshes.size() - 1ull);
+}
+
+CBVHTreeNew& CInstanceTree::get_mesh(uint32_t mesh)
+{
+	return *m_vMeshes.at(mesh);
+}
+
+uint32_t CInstanceTree::add_instance(entt::entity entity, uint32_t mesh, const glm::mat4& local)
+{
+	auto& instance = m_vInstances.emplace_back();
+	instance.m_entity = entity;
+	instance.m_local = local;
+	instance.m_mesh = mesh;
+	return static_cast<uint32_t>(m_vInstances.size() - 1ull);
+}
+
+void CInstanceTree::create(entt::registry& registry, const FBVHConfig& config)
+{
+	// Meshes paged out by a previous build read their primitives back from the old file
+	auto previous_pager = std::move(m_pPager);
+	if (config.m_out_of_core)
+		m_pPager = std::make_unique<CGeometryPager>(config.m_paging_directory, static_cast<size_t>(config.m_memory_budget) * 1048576ull);
+
+	// Bottom level: every mesh once, however many instances reference it
+	CThreadPool::getInstance()->parallel_for(m_vMeshes.size(),
+		[this, &config](size_t mesh_idx, uint32_t)
+		{
+			auto& mesh = m_vMeshes[mesh_idx];
+			mesh->create(config);
+			if (m_pPager)
+				mesh->write_clusters(*m_pPager);
+		});
+	previous_pager.reset();
+
+	// Memory copies are only dropped once the file is readable, otherwise the meshes stay in memory
+	if (m_pPager && m_pPager->map())
+	{
+		for (auto& mesh : m_vMeshes)
+			mesh->page_out(m_pPager.get());
+	}
+	else
+		m_pPager.reset();
+
+	for (auto& instance : m_vInstances)
+	{
+		auto& transform = registry.get<FTransformComponent>(instance.m_entity);
+		update_instance(instance, transform.m_model * instance.m_local);
+	}
+
+	// Top level
+	build();
+}
+
+ETreeUpdate CInstanceTree::refit(entt::registry& registry, const FBVHConfig& config)
+{
+	bool moved{ false };
+	for (auto& instance : m_vInstances)
+	{
+		auto& transform = registry.get<FTransformComponent>(instance.m_entity);
+		auto model = transform.m_model * instance.m_local;
+		if (model == instance.m_model)
+			continue;
+
+		update_instance(instance, model);
+		moved = true;
+	}
+
+	if (!moved || m_vIndices.empty())
+		return ETreeUpdate::eNone;
+
+	// Children are always allocated after their parent, so a reverse sweep sees them first.
+	// Slot 1 is never used, the root's children start at 2.
+	for (uint32_t node_idx = m_size; node_idx-- > 0u;)
+	{
+		if (node_idx == 1u)
+			continue;
+
+		auto& node = m_vNodes[node_idx];
+		node.m_aabb = FAxixAlignedBoundingBox{};
+		if (node.is_leaf())
+		{
+			for (uint32_t i = 0u; i < node.m_count; ++i)
+				node.m_aabb.grow(m_vInstances[m_vIndices[node.m_left + i]].m_bounds);
+		}
+		else
+		{
+			node.m_aabb.grow(m_vNodes[node.m_left].m_aabb);
+			node.m_aabb.grow(m_vNodes[node.m_left + 1u].m_aabb);
+		}
+	}
+
+	if (cost() <= m_build_cost * config.m_refit_rebuild_threshold)
+		return ETreeUpdate::eRefit;
+
+	build();
+	return ETreeUpdate::eRebuild;
+}
+
+bool CInstanceTree::hit(const FRay& ray, float t_min, float t_max, FHitResult& hit_result) const
+{
+	if (m_vIndices.empty())
+		return false;
+
+	auto* node = &m_vNodes[0u];
+	CTraversalStack<uint32_t> search_stack{};
+
+	bool has_hit{ false };
+	float closest_hit{ glm::min(t_max, std::numeric_limits<float>::max()) };
+
+	while (true)
+	{
+		if (node->is_leaf())
+		{
+			for (uint32_t i = 0u; i < node->m_count; i++)
+			{
+				auto instance_idx = m_vIndices[node->m_left + i];
+				auto& instance = m_vInstances[instance_idx];
+				if (m_vMeshes[instance.m_mesh]->hit(instance.to_object(ray), t_min, closest_hit, hit_result))
+				{
+					hit_result.m_instance_id = instance_idx;
+					has_hit = true;
+					closest_hit = hit_result.m_distance;
+				}
+			}
+
+			if (search_stack.empty())
+				break;
+
+			node = &m_vNodes[search_stack.pop()];
+			continue;
+		}
+
+		uint32_t left_id{ node->m_left };
+		uint32_t right_id{ node->m_left + 1u };
+
+		auto dist1 = m_vNodes[left_id].m_aabb.hit(ray, closest_hit);
+		auto dist2 = m_vNodes[right_id].m_aabb.hit(ray, closest_hit);
+
+		if (dist1 > dist2)
+		{
+			std::swap(dist1, dist2);
+			std::swap(left_id, right_id);
+		}
+
+		if (math::compare_float(dist1, std::numeric_limits<float>::max()))
+		{
+			if (search_stack.empty())
+				break;
+
+			node = &m_vNodes[search_stack.pop()];
+		}
+		else
+		{
+			node = &m_vNodes[left_id];
+			if (!math::compare_float(dist2, std::numeric_limits<float>::max()))
+				search_stack.push(right_id);
+		}
+	}
+
+	return has_hit;
+}
+
+void CInstanceTree::hit(FRayPacket& packet, float t_min, float t_max) const
+{
+	if (m_vIndices.empty() || packet.m_size == 0u)
+		return;
+
+	// Incoherent packets cannot be culled as a whole
+	if (!packet.m_bCoherent)
+	{
+		for (uint32_t r = 0u; r < packet.m_size; ++r)
+		{
+			BVH_STATS(bvh_stats::lane = r);
+			FHitResult hit_result{};
+			if (hit(packet.m_rays[r], t_min, glm::min(packet.m_hits[r].m_distance, t_max), hit_result))
+				packet.m_hits[r] = hit_result;
+		}
+		BVH_STATS(bvh_stats::lane = 0u);
+		return;
+	}
+
+	const __m128 origin_min[3]{ _mm_set1_ps(packet.m_origin_min.x), _mm_set1_ps(packet.m_origin_min.y), _mm_set1_ps(packet.m_origin_min.z) };
+	const __m128 origin_max[3]{ _mm_set1_ps(packet.m_origin_max.x), _mm_set1_ps(packet.m_origin_max.y), _mm_set1_ps(packet.m_origin_max.z) };
+	const __m128 inv_direction_min[3]{ _mm_set1_ps(packet.m_inv_direction_min.x), _mm_set1_ps(packet.m_inv_direction_min.y), _mm_set1_ps(packet.m_inv_direction_min.z) };
+	const __m128 inv_direction_max[3]{ _mm_set1_ps(packet.m_inv_direction_max.x), _mm_set1_ps(packet.m_inv_direction_max.y), _mm_set1_ps(packet.m_inv_direction_max.z) };
+
+	// The top level is small, so it only culls by the packet bounds. Rays are tested one by one
+	// inside the bottom levels, which also fall back to single rays for incoherent object-space packets.
+	CTraversalStack<uint32_t> search_stack{};
+	search_stack.push(0u);
+
+	FRayPacket object_packet{};
+	while (!search_stack.empty())
+	{
+		auto& node = m_vNodes[search_stack.pop()];
+
+		if (node.is_leaf())
+		{
+			for (uint32_t i = 0u; i < node.m_count; i++)
+			{
+				auto instance_idx = m_vIndices[node.m_left + i];
+				auto& instance = m_vInstances[instance_idx];
+
+				// Hit distances carry over, the object-space directions are not renormalized
+				object_packet.m_size = packet.m_size;
+				for (uint32_t r = 0u; r < packet.m_size; ++r)
+				{
+					object_packet.m_rays[r] = instance.to_object(packet.m_rays[r]);
+					object_packet.m_hits[r] = packet.m_hits[r];
+				}
+				object_packet.prepare();
+
+				m_vMeshes[instance.m_mesh]->hit(object_packet, t_min, t_max);
+
+				for (uint32_t r = 0u; r < packet.m_size; ++r)
+				{
+					if (object_packet.m_hits[r].m_distance < packet.m_hits[r].m_distance)
+					{
+						packet.m_hits[r] = object_packet.m_hits[r];
+						packet.m_hits[r].m_instance_id = instance_idx;
+					}
+				}
+			}
+			continue;
+		}
+
+		uint32_t left_id{ node.m_left };
+		uint32_t right_id{ node.m_left + 1u };
+
+		float farthest{ 0.f };
+		for (uint32_t r = 0u; r < packet.m_size; ++r)
+			farthest = glm::max(farthest, glm::min(packet.m_hits[r].m_distance, t_max));
+
+		// Both children in the first two lanes
+		auto& left = m_vNodes[left_id].m_aabb;
+		auto& right = m_vNodes[right_id].m_aabb;
+		__m128 bmin[3], bmax[3];
+		for (uint32_t axis = 0u; axis < 3u; ++axis)
+		{
+			bmin[axis] = _mm_setr_ps(left.m_min[axis], right.m_min[axis], 0.f, 0.f);
+			bmax[axis] = _mm_setr_ps(left.m_max[axis], right.m_max[axis], 0.f, 0.f);
+		}
+
+		__m128 entry;
+		int mask = math::packet_aabb_intersect4(origin_min, origin_max, inv_direction_min, inv_direction_max, bmin, bmax, farthest, entry) & 0x3;
+
+		alignas(16) float distances[4];
+		_mm_store_ps(distances, entry);
+
+		// Nearer child popped first
+		bool swap = distances[1] < distances[0];
+		for (uint32_t c : { swap ? 0u : 1u, swap ? 1u : 0u })
+		{
+			if (mask & (1 << c))
+				search_stack.push(c == 0u ? left_id : right_id);
+		}
+	}
+}
+
+void CInstanceTree::resolve_hit(const FRay& ray, const FHitResult& hit_result, FSurfaceInteraction& surface) const
+{
+	auto& instance = m_vInstances[hit_result.m_instance_id];
+	m_vMeshes[instance.m_mesh]->resolve_hit(ray, hit_result, instance.m_normal, surface);
+}
+
+bool CInstanceTree::occluded(const FRay& ray, float t_min, float t_max) const
+{
+	if (m_vIndices.empty())
+		return false;
+
+	auto* node = &m_vNodes[0u];
+	CTraversalStack<uint32_t> search_stack{};
+
+	while (true)
+	{
+		if (node->is_leaf())
+		{
+			for (uint32_t i = 0u; i < node->m_count; i++)
+			{
+				auto& instance = m_vInstances[m_vIndices[node->m_left + i]];
+				if (m_vMeshes[instance.m_mesh]->occluded(instance.to_object(ray), t_min, t_max))
+					return true;
+			}
+		}
+		else
+		{
+			uint32_t left_id{ node->m_left };
+			uint32_t right_id{ node->m_left + 1u };
+
+			bool hit_left = !math::compare_float(m_vNodes[left_id].m_aabb.hit(ray, t_max), std::numeric_limits<float>::max());
+			bool hit_right = !math::compare_float(m_vNodes[right_id].m_aabb.hit(ray, t_max), std::numeric_limits<float>::max());
+
+			if (hit_left)
+			{
+				node = &m_vNodes[left_id];
+				if (hit_right)
+					search_stack.push(right_id);
+				continue;
+			}
+
+			if (hit_right)
+			{
+				node = &m_vNodes[right_id];
+				continue;
+			}
+		}
+
+		if (search_stack.empty())
+			break;
+
+		node = &m_vNodes[search_stack.pop()];
+	}
+
+	return false;
+}
+
+size_t CInstanceTree::size() const
+{
+	size_t count{ 0ull };
+	for (auto& mesh : m_vMeshes)
+		count += mesh->size();
+	return count;
+}
+
+const CGeometryPager* CInstanceTree::get_pager() const
+{
+	return m_pPager.get();
+}
+
+size_t CInstanceTree::mesh_count() const
+{
+	return m_vMeshes.size();
+}
+
+size_t CInstanceTree::instance_count() const
+{
+	return m_vInstances.size();
+}
+
+const FInstance& CInstanceTree::get_instance(uint32_t instance) const
+{
+	return m_vInstances.at(instance);
+}
+
+FAxixAlignedBoundingBox CInstanceTree::get_bounds() const
+{
+	FAxixAlignedBoundingBox bounds{};
+	for (auto& instance : m_vInstances)
+		bounds.grow(instance.m_bounds);
+	return bounds;
+}
+
+size_t CInstanceTree::node_memory() const
+{
+	size_t bytes = m_vNodes.capacity() * sizeof(FBVHNode) + m_vIndices.capacity() * sizeof(uint32_t);
+	for (auto& mesh : m_vMeshes)
+		bytes += mesh->node_memory();
+	return bytes;
+}
+
+size_t CInstanceTree::leaf_memory() const
+{
+	size_t bytes{ 0ull };
+	for (auto& mesh : m_vMeshes)
+		bytes += mesh->leaf_memory();
+	return bytes;
+}
+
+FBVHStats CInstanceTree::analyze(const FBVHConfig& config) const
+{
+	FBVHStats stats{};
+	if (m_vIndices.empty())
+		return stats;
+
+	std::vector<std::pair<uint32_t, uint32_t>> search_stack{ { 0u, 0u } };
+	while (!search_stack.empty())
+	{
+		auto [node_idx, depth] = search_stack.back();
+		search_stack.pop_back();
+
+		auto& node = m_vNodes[node_idx];
+		if (node.is_leaf())
+		{
+			stats.add_leaf(node.m_aabb, node.m_count, depth);
+			continue;
+		}
+
+		const FAxixAlignedBoundingBox children[2]{ m_vNodes[node.m_left].m_aabb, m_vNodes[node.m_left + 1u].m_aabb };
+		stats.add_inner(node.m_aabb, children, 2u, depth);
+		search_stack.emplace_back(node.m_left, depth + 1u);
+		search_stack.emplace_back(node.m_left + 1u, depth + 1u);
+	}
+
+	stats.finish(m_vNodes[0].m_aabb, config);
+	stats.m_node_memory = m_vNodes.capacity() * sizeof(FBVHNode) + m_vIndices.capacity() * sizeof(uint32_t);
+	return stats;
+}
+
+glm::vec3 CInstanceTree::sample(uint32_t instance, uint32_t primitive, const glm::vec3& p, const glm::vec2& sample, float& pdf, FSurfaceInteraction& light_hit) const
+{
+	auto& placement = m_vInstances[instance];
+	auto& mesh = *m_vMeshes[placement.m_mesh];
+
+	auto direction = mesh.get_triangle(primitive).sample(mesh.get_geometry(primitive).transform(placement.m_model), placement.m_normal, p, sample, pdf, light_hit);
+	light_hit.m_instance_id = instance;
+	return direction;
+}
+
+float CInstanceTree::pdf(uint32_t instance, uint32_t primitive, const glm::vec3& p, const glm::vec3& wi) const
+{
+	auto& placement = m_vInstances[instance];
+	auto& mesh = *m_vMeshes[placement.m_mesh];
+
+	// Shapes are never light sampled
+	if (mesh.has_shapes())
+		return 0.f;
+
+	return mesh.get_triangle(primitive).pdf(mesh.get_geometry(primitive).transform(placement.m_model), placement.m_normal, p, wi);
+}
+
+void CInstanceTree::update_instance(FInstance& instance, const glm::mat4& model)
+{
+	instance.m_model = model;
+	instance.m_inv_model = glm::inverse(instance.m_model);
+	instance.m_normal = glm::transpose(glm::inverse(glm::mat3(instance.m_model)));
+
+	// World bounds from the eight transformed corners of the mesh bounds
+	auto& mesh_bounds = m_vMeshes[instance.m_mesh]->get_bounds();
+	instance.m_bounds = FAxixAlignedBoundingBox{};
+	for (uint32_t corner = 0u; corner < 8u; ++corner)
+	{
+		glm::vec3 point{ corner & 1u ? mesh_bounds.m_max.x : mesh_bounds.m_min.x, corner & 2u ? mesh_bounds.m_max.y : mesh_bounds.m_min.y, corner & 4u ? mesh_bounds.m_max.z : mesh_bounds.m_min.z };
+		auto world = instance.m_model * glm::vec4(point, 1.f);
+		point = glm::vec3(world) / world.w;
+		instance.m_bounds.grow(FAxixAlignedBoundingBox(point, point));
+	}
+}
+
+void CInstanceTree::build()
+{
+	m_vIndices.clear();
+	for (uint32_t i = 0u; i < m_vInstances.size(); ++i)
+	{
+		// Instances of empty meshes can never be hit
+		if (m_vMeshes[m_vInstances[i].m_mesh]->size() > 0ull)
+			m_vIndices.emplace_back(i);
+	}
+
+	m_vNodes.assign(m_vIndices.size() * 2ull + 2ull, FBVHNode{});
+	m_size = 2u;
+
+	auto& root = m_vNodes[0ull];
+	root.m_left = 0u;
+	root.m_count = static_cast<uint32_t>(m_vIndices.size());
+	for (auto index : m_vIndices)
+		root.m_aabb.grow(m_vInstances[index].m_bounds);
+
+	if (!m_vIndices.empty())
+		subdivide(0u);
+
+	m_build_cost = cost();
+}
+
+void CInstanceTree::subdivide(uint32_t node_idx)
+{
+	auto& node = m_vNodes[node_idx];
+	if (node.m_count <= instance_leaf_size)
+		return;
+
+	auto centroid_of = [this](uint32_t index)
+		{
+			auto& bounds = m_vInstances[index].m_bounds;
+			return (bounds.m_min + bounds.m_max) * 0.5f;
+		};
+
+	FAxixAlignedBoundingBox centroid{};
+	for (uint32_t i = 0u; i < node.m_count; ++i)
+	{
+		auto point = centroid_of(m_vIndices[node.m_left + i]);
+		centroid.grow(FAxixAlignedBoundingBox(point, point));
+	}
+
+	// Binned SAH, like the bottom level but over instance bounds
+	uint32_t best_axis{ 0u }, best_split{ 0u };
+	float best_cost = std::numeric_limits<float>::max();
+	for (uint32_t a = 0u; a < 3u; ++a)
+	{
+		if (math::compare_float(centroid.m_min[a], centroid.m_max[a]))
+			continue;
+
+		float scale = static_cast<float>(instance_bins) / (centroid.m_max[a] - centroid.m_min[a]);
+
+		std::array<FBVHTreeBin, instance_bins> bin{};
+		for (uint32_t i = 0u; i < node.m_count; ++i)
+		{
+			auto index = m_vIndices[node.m_left + i];
+			uint32_t bin_idx = glm::min(instance_bins - 1u, static_cast<uint32_t>((centroid_of(index)[a] - centroid.m_min[a]) * scale));
+			bin[bin_idx].m_count++;
+			bin[bin_idx].m_bounds.grow(m_vInstances[index].m_bounds);
+		}
+
+		std::array<float, instance_bins - 1u> left_area, right_area;
+		uint32_t left_sum{ 0u }, right_sum{ 0u };
+
+		FAxixAlignedBoundingBox left, right;
+		for (uint32_t i = 0u; i < instance_bins - 1u; i++)
+		{
+			left_sum += bin[i].m_count;
+			left.grow(bin[i].m_bounds);
+			left_area[i] = left_sum > 0u ? static_cast<float>(left_sum) * left.area() : std::numeric_limits<float>::max();
+
+			right_sum += bin[instance_bins - 1u - i].m_count;
+			right.grow(bin[instance_bins - 1u - i].m_bounds);
+			right_area[instance_bins - 2u - i] = right_sum > 0u ? static_cast<float>(right_sum) * right.area() : std::numeric_limits<float>::max();
+		}
+
+		for (uint32_t i = 0u; i < instance_bins - 1u; i++)
+		{
+			const float plane_cost = left_area[i] + right_area[i];
+			if (plane_cost < best_cost)
+			{
+				best_axis = a;
+				best_split = i + 1u;
+				best_cost = plane_cost;
+			}
+		}
+	}
+
+	// Instances sharing one centroid cannot be separated
+	if (math::compare_float(best_cost, std::numeric_limits<float>::max()))
+		return;
+
+	float scale = static_cast<float>(instance_bins) / (centroid.m_max[best_axis] - centroid.m_min[best_axis]);
+	auto middle = std::partition(m_vIndices.begin() + node.m_left, m_vIndices.begin() + node.m_left + node.m_count,
+		[&](uint32_t index)
+		{
+			return glm::min(instance_bins - 1u, static_cast<uint32_t>((centroid_of(index)[best_axis] - centroid.m_min[best_axis]) * scale)) < best_split;
+		});
+
+	uint32_t left_count = static_cast<uint32_t>(middle - m_vIndices.begin()) - node.m_left;
+	if (left_count == 0u || left_count == node.m_count)
+		return;
+
+	uint32_t left_child_idx = m_size;
+	uint32_t right_child_idx = m_size + 1u;
+	m_size += 2u;
+
+	m_vNodes[left_child_idx].m_left = node.m_left;
+	m_vNodes[left_child_idx].m_count = left_count;
+	m_vNodes[right_child_idx].m_left = node.m_left + left_count;
+	m_vNodes[right_child_idx].m_count = node.m_count - left_count;
+
+	for (auto child_idx : { left_child_idx, right_child_idx })
+	{
+		auto& child = m_vNodes[child_idx];
+		for (uint32_t i = 0u; i < child.m_count; ++i)
+			child.m_aabb.grow(m_vInstances[m_vIndices[child.m_left + i]].m_bounds);
+	}
+
+	node.m_left = left_child_idx;
+	node.m_count = 0u;
+
+	subdivide(left_child_idx);
+	subdivide(right_child_idx);
+}
+
+float CInstanceTree::cost() const
+{
+	// Not normalized by the root: an instance flying away grows the root too, which would hide
+	// that every node on its path now overlaps its siblings
+	float total{ 0.f };
+	for (uint32_t node_idx = 0u; node_idx < m_size; ++node_idx)
+	{
+		if (node_idx == 1u)
+			continue;
+
+		auto& node = m_vNodes[node_idx];
+		auto node_bounds = node.m_aabb;
+		total += node_bounds.area() * static_cast<float>(node.is_leaf() ? node.m_count : 1u);
+	}
+
+	return total;
+}
\ No newline at end of file
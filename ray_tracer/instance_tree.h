@@ -0,0 +1,94 @@
+#pragma once
+
+#include "bvh_tree.h"
+
+// Placement of a mesh in the scene: one per glTF node referencing the mesh, or one per
+// EXT_mesh_gpu_instancing entry of such a node.
+struct FInstance
+{
+	entt::entity m_entity{ entt::null };
+	// Applied before the entity transform, identity unless the node is GPU instanced
+	glm::mat4 m_local{ 1.f };
+	uint32_t m_mesh{ 0u };
+
+	// Resolved from the entity transform when the tree is created
+	glm::mat4 m_model{ 1.f };
+	glm::mat4 m_inv_model{ 1.f };
+	glm::mat3 m_normal{ 1.f };
+	FAxixAlignedBoundingBox m_bounds{};
+
+	// The direction is not renormalized, so hit distances are the same in both spaces
+	FRay to_object(const FRay& ray) const
+	{
+		FRay object_ray{};
+		object_ray.m_origin = glm::vec3(m_inv_model * glm::vec4(ray.m_origin, 1.f));
+		object_ray.set_direction(glm::mat3(m_inv_model) * ray.m_direction);
+		return object_ray;
+	}
+};
+
+enum class ETreeUpdate
+{
+	eNone,
+	eRefit,
+	eRebuild
+};
+
+// Two-level acceleration structure. Every mesh gets one bottom-level CBVHTreeNew in object
+// space, built once no matter how often it is referenced, and a top-level BVH over the
+// instances transforms rays into each instance it visits.
+class CInstanceTree
+{
+public:
+	uint32_t add_mesh();
+	CBVHTreeNew& get_mesh(uint32_t mesh);
+	uint32_t add_instance(entt::entity entity, uint32_t mesh, const glm::mat4& local);
+
+	void create(entt::registry& registry, const FBVHConfig& config);
+	// Transform-only update: re-resolves instances whose entity moved and refits the top-level
+	// bounds bottom-up. The top level is rebuilt only once refitting has degraded its SAH cost
+	// past the configured threshold. Bottom levels are object space and never touched.
+	ETreeUpdate refit(entt::registry& registry, const FBVHConfig& config);
+
+	bool hit(const FRay& ray, float t_min, float t_max, FHitResult& hit_result) const;
+	// Closest hits of a packet, see CBVHTreeNew::hit. The packet must be prepared.
+	void hit(FRayPacket& packet, float t_min, float t_max) const;
+	void resolve_hit(const FRay& ray, const FHitResult& hit_result, FSurfaceInteraction& surface) const;
+	bool occluded(const FRay& ray, float t_min, float t_max) const;
+
+	// Unique triangles and shapes, stored once per mesh
+	size_t size() const;
+	size_t mesh_count() const;
+	size_t instance_count() const;
+	const FInstance& get_instance(uint32_t instance) const;
+	FAxixAlignedBoundingBox get_bounds() const;
+	// Bytes held by nodes of both levels and by leaf triangle blocks
+	size_t node_memory() const;
+	size_t leaf_memory() const;
+	// Paging file of out-of-core bottom levels, nullptr when they are in memory
+	const CGeometryPager* get_pager() const;
+	// Metrics of the top level alone, with instances as its primitives. See CBVHTreeNew::analyze
+	// for the bottom levels.
+	FBVHStats analyze(const FBVHConfig& config) const;
+
+	// World-space light sampling of one triangle of an instance, see CTriangle::sample
+	glm::vec3 sample(uint32_t instance, uint32_t primitive, const glm::vec3& p, const glm::vec2& sample, float& pdf, FSurfaceInteraction& light_hit) const;
+	float pdf(uint32_t instance, uint32_t primitive, const glm::vec3& p, const glm::vec3& wi) const;
+private:
+	void update_instance(FInstance& instance, const glm::mat4& model);
+	void build();
+	void subdivide(uint32_t node_idx);
+	// Unnormalized SAH cost of the top level, compared against the cost it was built with
+	float cost() const;
+protected:
+	std::vector<std::unique_ptr<CBVHTreeNew>> m_vMeshes{};
+	std::unique_ptr<CGeometryPager> m_pPager{};
+	std::vector<FInstance> m_vInstances{};
+
+	// Top-level nodes, leaves index m_vIndices. Siblings start at even indices, so with the
+	// aligned array each pair shares one cache line.
+	cache_aligned_vector<FBVHNode> m_vNodes{};
+	std::vector<uint32_t> m_vIndices{};
+	uint32_t m_size{ 0u };
+	float m_build_cost{ 0.f };
+};
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <future>
 #include <optional>
 #include <thread>
@@ -7,6 +8,10 @@
 #include <queue>
 #include <mutex>
 #include <condition_variable>
+#include <vector>
+#include <memory>
+
+#include "ufunction.hpp"
 
 namespace utl
 {
@@ -56,7 +61,12 @@ namespace utl
     class threadworker
     {
     public:
-        threadworker()
+        threadworker() : threadworker(utl::function<void()>{})
+        {
+        }
+
+        // on_start runs on the worker thread before it takes any work
+        threadworker(utl::function<void()> on_start) : _on_start(std::move(on_start))
         {
             _thread = std::thread(&threadworker::loop, this);
         }
@@ -101,6 +111,9 @@ namespace utl
     private:
         void loop()
         {
+            if (_on_start)
+                _on_start();
+
             while (true)
             {
                 utl::function<void()> work;
@@ -125,6 +138,7 @@ namespace utl
             }
         }
     private:
+        utl::function<void()> _on_start;
         std::atomic<bool> _destroying{ false };
         std::atomic<bool> _waiting{ true };
         std::thread _thread;
@@ -132,4 +146,100 @@ namespace utl
         std::mutex _queue_mutex;
         std::condition_variable _condition;
     };
+
+    // Fixed set of threadworkers. Every worker keeps its own queue, so handing out work only ever
+    // locks the queue it goes to and idle workers never contend on a shared one.
+    class threadpool
+    {
+    public:
+        threadpool() = default;
+
+        threadpool(const threadpool&) = delete;
+        threadpool& operator=(const threadpool&) = delete;
+
+        // Replaces the workers, on_start(worker) runs first on each new worker thread
+        void create(size_t count, std::function<void(size_t)> on_start = {})
+        {
+            _workers.clear();
+            _workers.reserve(count);
+            for (size_t worker = 0ull; worker < count; ++worker)
+            {
+                _workers.emplace_back(std::make_unique<threadworker>([on_start, worker]() mutable
+                    {
+                        if (on_start)
+                            on_start(worker);
+                    }));
+            }
+        }
+
+        size_t size() const noexcept
+        {
+            return _workers.size();
+        }
+
+        // Calls function(index) for every index in [0, count) and returns once all calls did.
+        // Runs of grain indices are claimed from a shared counter by the workers and by the
+        // calling thread itself, so a parallel_for nested in the work of another cannot stall
+        // waiting for workers that are busy with the outer one.
+        template<class _Lambda>
+        void parallel_for(size_t count, _Lambda&& function, size_t grain = 1ull)
+        {
+            if (count == 0ull)
+                return;
+
+            struct job_t
+            {
+                std::atomic<size_t> next{ 0ull };
+                std::atomic<size_t> done{ 0ull };
+                size_t count{ 0ull };
+            };
+
+            grain = (std::max)(grain, size_t{ 1ull });
+            auto job = std::make_shared<job_t>();
+            job->count = count;
+
+            // Helpers that start after every index is claimed return without touching function,
+            // which may be gone by then
+            auto run = [job, &function, grain]()
+            {
+                for (auto first = job->next.fetch_add(grain); first < job->count; first = job->next.fetch_add(grain))
+                {
+                    auto last = (std::min)(first + grain, job->count);
+                    for (auto index = first; index < last; ++index)
+                        function(index);
+                    if (job->done.fetch_add(last - first) + (last - first) == job->count)
+                        job->done.notify_all();
+                }
+            };
+
+            // Idle workers are asked first, going round from a rotating start so small nested jobs
+            // spread over the pool. Busy ones only queue a helper when too few are idle.
+            size_t helpers = (count - 1ull) / grain;
+            if (helpers > _workers.size())
+                helpers = _workers.size();
+            auto start = _next_worker.fetch_add(1ull);
+            std::vector<bool> asked(_workers.size(), false);
+            for (size_t pass = 0ull; pass < 2ull && helpers > 0ull; ++pass)
+            {
+                for (size_t offset = 0ull; offset < _workers.size() && helpers > 0ull; ++offset)
+                {
+                    auto worker = (start + offset) % _workers.size();
+                    if (asked[worker] || (pass == 0ull && !_workers[worker]->is_free()))
+                        continue;
+
+                    _workers[worker]->push(utl::function<void()>(run));
+                    asked[worker] = true;
+                    --helpers;
+                }
+            }
+
+            run();
+            for (auto done = job->done.load(); done < count; done = job->done.load())
+                job->done.wait(done);
+        }
+
+    private:
+        std::vector<std::unique_ptr<threadworker>> _workers;
+        std::atomic<size_t> _next_worker{ 0ull };
+    };
 }
\ No newline at end of file
@@ -18,22 +18,22 @@ void CDirectionalLightSource::create(entt::entity root, const entt::registry& re
 	m_light = m_pRegistry->try_get<FDirectionalLightComponent>(m_root);
 }
 
-glm::vec3 CDirectionalLightSource::get_direction(const FHitResult& hit_result) const
+glm::vec3 CDirectionalLightSource::get_direction(const FSurfaceInteraction& surface) const
 {
 	return glm::normalize(-(m_transform->m_rotation_g * glm::vec3(0.f, 0.f, -1.f)));
 }
 
-float CDirectionalLightSource::get_distance(const FHitResult& hit_result) const
+float CDirectionalLightSource::get_distance(const FSurfaceInteraction& surface) const
 {
 	return std::numeric_limits<float>::infinity();
 }
 
-float CDirectionalLightSource::get_pdf(const FHitResult& hit_result) const
+float CDirectionalLightSource::get_pdf(const FSurfaceInteraction& surface) const
 {
 	return 1.f;
 }
 
-glm::vec3 CDirectionalLightSource::get_color(const FHitResult& hit_result) const
+glm::vec3 CDirectionalLightSource::get_color(const FSurfaceInteraction& surface) const
 {
 	return m_light->m_color * m_light->m_intencity;
 }
@@ -45,26 +45,26 @@ void CPointLightSource::create(entt::entity root, const entt::registry& registry
 	m_light = m_pRegistry->try_get<FPointLightComponent>(m_root);
 }
 
-glm::vec3 CPointLightSource::get_direction(const FHitResult& hit_result) const
+glm::vec3 CPointLightSource::get_direction(const FSurfaceInteraction& surface) const
 {
-	return glm::normalize(m_transform->m_position_g - hit_result.m_position);
+	return glm::normalize(m_transform->m_position_g - surface.m_position);
 }
 
-float CPointLightSource::get_distance(const FHitResult& hit_result) const
+float CPointLightSource::get_distance(const FSurfaceInteraction& surface) const
 {
-	return glm::distance(hit_result.m_position, m_transform->m_position_g);
+	return glm::distance(surface.m_position, m_transform->m_position_g);
 }
 
-float CPointLightSource::get_pdf(const FHitResult& hit_result) const
+float CPointLightSource::get_pdf(const FSurfaceInteraction& surface) const
 {
 	return 1.f;
 }
 
-glm::vec3 CPointLightSource::get_color(const FHitResult& hit_result) const
+glm::vec3 CPointLightSource::get_color(const FSurfaceInteraction& surface) const
 {
 	glm::vec3 radiance = m_light->m_color * m_light->m_intencity;
 
-	auto distance = get_distance(hit_result);
+	auto distance = get_distance(surface);
 
 	// Physical inverse-square falloff (clamped near zero to avoid the singularity at d = 0).
 	float attenuation = 1.f / glm::max(distance * distance, 1e-4f);
@@ -88,23 +88,23 @@ void CSpotLightSource::create(entt::entity root, const entt::registry& registry)
 	m_light = m_pRegistry->try_get<FSpotLightComponent>(m_root);
 }
 
-glm::vec3 CSpotLightSource::get_direction(const FHitResult& hit_result) const
+glm::vec3 CSpotLightSource::get_direction(const FSurfaceInteraction& surface) const
 {
 	// Direction from the shaded point toward the light (used as the shadow-ray / wi direction).
-	return glm::normalize(m_transform->m_position_g - hit_result.m_position);
+	return glm::normalize(m_transform->m_position_g - surface.m_position);
 }
 
-float CSpotLightSource::get_distance(const FHitResult& hit_result) const
+float CSpotLightSource::get_distance(const FSurfaceInteraction& surface) const
 {
-	return glm::distance(hit_result.m_position, m_transform->m_position_g);
+	return glm::distance(surface.m_position, m_transform->m_position_g);
 }
 
-float CSpotLightSource::get_pdf(const FHitResult& hit_result) const
+float CSpotLightSource::get_pdf(const FSurfaceInteraction& surface) const
 {
 	return 1.f;
 }
 
-glm::vec3 CSpotLightSource::get_color(const FHitResult& hit_result) const
+glm::vec3 CSpotLightSource::get_color(const FSurfaceInteraction& surface) const
 {
 	glm::vec3 radiance = m_light->m_color * m_light->m_intencity;
 
@@ -114,7 +114,7 @@ glm::vec3 CSpotLightSource::get_color(const FHitResult& hit_result) const
 		: glm::normalize(m_transform->m_rotation_g * glm::vec3(0.f, 0.f, -1.f));
 
 	// Direction from the light toward the shaded point.
-	glm::vec3 to_surface = glm::normalize(hit_result.m_position - m_transform->m_position_g);
+	glm::vec3 to_surface = glm::normalize(surface.m_position - m_transform->m_position_g);
 
 	// Angular (cone) attenuation, smoothly ramping from the inner to the outer cone
 	// (glTF KHR_lights_punctual formulation).
@@ -129,7 +129,7 @@ glm::vec3 CSpotLightSource::get_color(const FHitResult& hit_result) const
 		return glm::vec3(0.f);
 
 	// Physical inverse-square distance falloff.
-	float distance = get_distance(hit_result);
+	float distance = get_distance(surface);
 	float attenuation = 1.f / glm::max(distance * distance, 1e-4f);
 
 	return radiance * angular * attenuation;
@@ -10,11 +10,11 @@ public:
 
 	virtual void create(entt::entity root, const entt::registry& registry);
 
-	virtual glm::vec3 get_direction(const FHitResult& hit_result) const = 0;
-	virtual float get_distance(const FHitResult& hit_result) const = 0;
-	virtual float get_pdf(const FHitResult& hit_result) const = 0;
+	virtual glm::vec3 get_direction(const FSurfaceInteraction& surface) const = 0;
+	virtual float get_distance(const FSurfaceInteraction& surface) const = 0;
+	virtual float get_pdf(const FSurfaceInteraction& surface) const = 0;
 
-	virtual glm::vec3 get_color(const FHitResult& hit_result) const = 0;
+	virtual glm::vec3 get_color(const FSurfaceInteraction& surface) const = 0;
 protected:
 	entt::entity m_root{ entt::null };
 	const entt::registry* m_pRegistry{ nullptr };
@@ -28,11 +28,11 @@ public:
 
 	void create(entt::entity root, const entt::registry& registry) override;
 
-	glm::vec3 get_direction(const FHitResult& hit_result) const override;
-	float get_distance(const FHitResult& hit_result) const override;
-	float get_pdf(const FHitResult& hit_result) const override;
+	glm::vec3 get_direction(const FSurfaceInteraction& surface) const override;
+	float get_distance(const FSurfaceInteraction& surface) const override;
+	float get_pdf(const FSurfaceInteraction& surface) const override;
 
-	glm::vec3 get_color(const FHitResult& hit_result) const override;
+	glm::vec3 get_color(const FSurfaceInteraction& surface) const override;
 private:
 	const FDirectionalLightComponent* m_light{ nullptr };
 };
@@ -44,11 +44,11 @@ public:
 
 	void create(entt::entity root, const entt::registry& registry) override;
 
-	glm::vec3 get_direction(const FHitResult& hit_result) const override;
-	float get_distance(const FHitResult& hit_result) const override;
-	float get_pdf(const FHitResult& hit_result) const override;
+	glm::vec3 get_direction(const FSurfaceInteraction& surface) const override;
+	float get_distance(const FSurfaceInteraction& surface) const override;
+	float get_pdf(const FSurfaceInteraction& surface) const override;
 
-	glm::vec3 get_color(const FHitResult& hit_result) const override;
+	glm::vec3 get_color(const FSurfaceInteraction& surface) const override;
 private:
 	const FPointLightComponent* m_light{ nullptr };
 };
@@ -60,11 +60,11 @@ public:
 
 	void create(entt::entity root, const entt::registry& registry) override;
 
-	glm::vec3 get_direction(const FHitResult& hit_result) const override;
-	float get_distance(const FHitResult& hit_result) const override;
-	float get_pdf(const FHitResult& hit_result) const override;
+	glm::vec3 get_direction(const FSurfaceInteraction& surface) const override;
+	float get_distance(const FSurfaceInteraction& surface) const override;
+	float get_pdf(const FSurfaceInteraction& surface) const override;
 
-	glm::vec3 get_color(const FHitResult& hit_result) const override;
+	glm::vec3 get_color(const FSurfaceInteraction& surface) const override;
 private:
 	const FSpotLightComponent* m_light{ nullptr };
 };
\ No newline at end of file
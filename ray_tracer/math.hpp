@@ -187,6 +187,76 @@ namespace math
 		return std::numeric_limits<float>::max();
 	}
 
+	// Slab test of one ray against four boxes held as one register per axis. Returns the lane mask
+	// of boxes hit in front of distance; entry receives the per-lane entry distances.
+	inline int ray_aabb_intersect4(const __m128* r0, const __m128* ird, const __m128* bmin, const __m128* bmax, float distance, __m128& entry) noexcept
+	{
+		__m128 tmin = _mm_setzero_ps();
+		__m128 tmax = _mm_setzero_ps();
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			__m128 vt1 = _mm_mul_ps(_mm_sub_ps(bmin[axis], r0[axis]), ird[axis]);
+			__m128 vt2 = _mm_mul_ps(_mm_sub_ps(bmax[axis], r0[axis]), ird[axis]);
+
+			__m128 slab_min = _mm_min_ps(vt1, vt2);
+			__m128 slab_max = _mm_max_ps(vt1, vt2);
+			tmin = axis == 0 ? slab_min : _mm_max_ps(tmin, slab_min);
+			tmax = axis == 0 ? slab_max : _mm_min_ps(tmax, slab_max);
+		}
+
+		__m128 mask = _mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmplt_ps(tmin, _mm_set1_ps(distance)));
+		mask = _mm_and_ps(mask, _mm_cmpgt_ps(tmax, _mm_setzero_ps()));
+
+		entry = tmin;
+		return _mm_movemask_ps(mask);
+	}
+
+	// Same test with the boxes stored SoA in memory as [axis][lane]
+	inline int ray_aabb_intersect4(const __m128* r0, const __m128* ird, const float* bmin, const float* bmax, float distance, __m128& entry) noexcept
+	{
+		const __m128 vmin[3]{ _mm_load_ps(bmin), _mm_load_ps(bmin + 4), _mm_load_ps(bmin + 8) };
+		const __m128 vmax[3]{ _mm_load_ps(bmax), _mm_load_ps(bmax + 4), _mm_load_ps(bmax + 8) };
+		return ray_aabb_intersect4(r0, ird, vmin, vmax, distance, entry);
+	}
+
+	// Conservative test of a whole ray packet against four boxes by interval arithmetic: origins
+	// lie in [omin, omax] and inverse directions in [idmin, idmax], which must be finite. Returns
+	// the mask of boxes that some ray may hit in front of distance, entry receives lower bounds of
+	// the entry distances.
+	inline int packet_aabb_intersect4(const __m128* omin, const __m128* omax, const __m128* idmin, const __m128* idmax, const __m128* bmin, const __m128* bmax, float distance, __m128& entry) noexcept
+	{
+		// Bounds of (plane - o) * id over the packet are taken at the corners of the intervals
+		auto slab = [](__m128 plane, __m128 o_lo, __m128 o_hi, __m128 id_lo, __m128 id_hi, __m128& lo, __m128& hi)
+			{
+				__m128 a_lo = _mm_sub_ps(plane, o_hi);
+				__m128 a_hi = _mm_sub_ps(plane, o_lo);
+				__m128 p0 = _mm_mul_ps(a_lo, id_lo), p1 = _mm_mul_ps(a_lo, id_hi);
+				__m128 p2 = _mm_mul_ps(a_hi, id_lo), p3 = _mm_mul_ps(a_hi, id_hi);
+				lo = _mm_min_ps(_mm_min_ps(p0, p1), _mm_min_ps(p2, p3));
+				hi = _mm_max_ps(_mm_max_ps(p0, p1), _mm_max_ps(p2, p3));
+			};
+
+		__m128 tmin = _mm_setzero_ps();
+		__m128 tmax = _mm_setzero_ps();
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			__m128 t1_lo, t1_hi, t2_lo, t2_hi;
+			slab(bmin[axis], omin[axis], omax[axis], idmin[axis], idmax[axis], t1_lo, t1_hi);
+			slab(bmax[axis], omin[axis], omax[axis], idmin[axis], idmax[axis], t2_lo, t2_hi);
+
+			__m128 slab_min = _mm_min_ps(t1_lo, t2_lo);
+			__m128 slab_max = _mm_max_ps(t1_hi, t2_hi);
+			tmin = axis == 0 ? slab_min : _mm_max_ps(tmin, slab_min);
+			tmax = axis == 0 ? slab_max : _mm_min_ps(tmax, slab_max);
+		}
+
+		__m128 mask = _mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmplt_ps(tmin, _mm_set1_ps(distance)));
+		mask = _mm_and_ps(mask, _mm_cmpgt_ps(tmax, _mm_setzero_ps()));
+
+		entry = tmin;
+		return _mm_movemask_ps(mask);
+	}
+
 	// Triangle intersect
 	inline bool ray_triangle_intersect(const glm::vec3& r0, const glm::vec3& rd, const glm::vec3& e0, const glm::vec3& e1, const glm::vec3& v0, float& distance, glm::vec3& barycentric)
 	{
@@ -216,4 +286,102 @@ namespace math
 
 		return true;
 	}
+
+	// Möller–Trumbore against four triangles stored SoA as [axis][lane]. Returns the lane mask of
+	// hits inside [t_min, t_max]. Zeroed (padding) lanes produce NaN barycentrics and never pass.
+	inline int ray_triangle_intersect4(const __m128* r0, const __m128* rd, const float* e0, const float* e1, const float* v0, float t_min, float t_max, __m128& distance, __m128& u, __m128& v) noexcept
+	{
+		__m128 e0x = _mm_load_ps(e0), e0y = _mm_load_ps(e0 + 4), e0z = _mm_load_ps(e0 + 8);
+		__m128 e1x = _mm_load_ps(e1), e1y = _mm_load_ps(e1 + 4), e1z = _mm_load_ps(e1 + 8);
+
+		__m128 px = _mm_sub_ps(_mm_mul_ps(rd[1], e1z), _mm_mul_ps(rd[2], e1y));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(rd[2], e1x), _mm_mul_ps(rd[0], e1z));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(rd[0], e1y), _mm_mul_ps(rd[1], e1x));
+
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e0x, px), _mm_mul_ps(e0y, py)), _mm_mul_ps(e0z, pz));
+		__m128 inv_det = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+		__m128 tx = _mm_sub_ps(r0[0], _mm_load_ps(v0));
+		__m128 ty = _mm_sub_ps(r0[1], _mm_load_ps(v0 + 4));
+		__m128 tz = _mm_sub_ps(r0[2], _mm_load_ps(v0 + 8));
+
+		u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e0z), _mm_mul_ps(tz, e0y));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e0x), _mm_mul_ps(tx, e0z));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e0y), _mm_mul_ps(ty, e0x));
+
+		v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rd[0], qx), _mm_mul_ps(rd[1], qy)), _mm_mul_ps(rd[2], qz)), inv_det);
+		distance = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, qx), _mm_mul_ps(e1y, qy)), _mm_mul_ps(e1z, qz)), inv_det);
+
+		__m128 zero = _mm_setzero_ps();
+		__m128 one = _mm_set1_ps(1.f);
+		__m128 mask = _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero));
+		mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+		mask = _mm_and_ps(mask, _mm_cmpge_ps(distance, _mm_set1_ps(t_min)));
+		mask = _mm_and_ps(mask, _mm_cmple_ps(distance, _mm_set1_ps(t_max)));
+
+		return _mm_movemask_ps(mask);
+	}
+
+	// Four spheres stored SoA as [axis][lane]. Takes the near root unless it lies before t_min, so
+	// rays starting inside a sphere hit its far side. Lanes with a non-positive radius never pass.
+	inline int ray_sphere_intersect4(const __m128* r0, const __m128* rd, const float* center, const float* radius, float t_min, float t_max, __m128& distance) noexcept
+	{
+		__m128 ox = _mm_sub_ps(r0[0], _mm_load_ps(center));
+		__m128 oy = _mm_sub_ps(r0[1], _mm_load_ps(center + 4));
+		__m128 oz = _mm_sub_ps(r0[2], _mm_load_ps(center + 8));
+		__m128 r = _mm_load_ps(radius);
+
+		// Half-b form of the quadratic, the direction is not necessarily normalized
+		__m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rd[0], rd[0]), _mm_mul_ps(rd[1], rd[1])), _mm_mul_ps(rd[2], rd[2]));
+		__m128 h = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rd[0], ox), _mm_mul_ps(rd[1], oy)), _mm_mul_ps(rd[2], oz));
+		__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, ox), _mm_mul_ps(oy, oy)), _mm_mul_ps(oz, oz)), _mm_mul_ps(r, r));
+		__m128 discriminant = _mm_sub_ps(_mm_mul_ps(h, h), _mm_mul_ps(a, c));
+
+		__m128 zero = _mm_setzero_ps();
+		__m128 root = _mm_sqrt_ps(_mm_max_ps(discriminant, zero));
+		__m128 inv_a = _mm_div_ps(_mm_set1_ps(1.f), a);
+		__m128 t_near = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(zero, h), root), inv_a);
+		__m128 t_far = _mm_mul_ps(_mm_add_ps(_mm_sub_ps(zero, h), root), inv_a);
+
+		__m128 min_distance = _mm_set1_ps(t_min);
+		__m128 use_near = _mm_cmpge_ps(t_near, min_distance);
+		distance = _mm_or_ps(_mm_and_ps(use_near, t_near), _mm_andnot_ps(use_near, t_far));
+
+		__m128 mask = _mm_and_ps(_mm_cmpge_ps(discriminant, zero), _mm_cmpgt_ps(r, zero));
+		mask = _mm_and_ps(mask, _mm_cmpge_ps(distance, min_distance));
+		mask = _mm_and_ps(mask, _mm_cmple_ps(distance, _mm_set1_ps(t_max)));
+
+		return _mm_movemask_ps(mask);
+	}
+
+	// Four disks stored SoA as [axis][lane]. Rays parallel to a disk miss it. Lanes with a
+	// non-positive radius never pass.
+	inline int ray_disk_intersect4(const __m128* r0, const __m128* rd, const float* center, const float* normal, const float* radius, float t_min, float t_max, __m128& distance) noexcept
+	{
+		__m128 cx = _mm_load_ps(center), cy = _mm_load_ps(center + 4), cz = _mm_load_ps(center + 8);
+		__m128 nx = _mm_load_ps(normal), ny = _mm_load_ps(normal + 4), nz = _mm_load_ps(normal + 8);
+		__m128 r = _mm_load_ps(radius);
+
+		__m128 ox = _mm_sub_ps(cx, r0[0]);
+		__m128 oy = _mm_sub_ps(cy, r0[1]);
+		__m128 oz = _mm_sub_ps(cz, r0[2]);
+
+		__m128 denominator = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, rd[0]), _mm_mul_ps(ny, rd[1])), _mm_mul_ps(nz, rd[2]));
+		__m128 numerator = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, ox), _mm_mul_ps(ny, oy)), _mm_mul_ps(nz, oz));
+		distance = _mm_div_ps(numerator, denominator);
+
+		// Offset of the plane hit from the center
+		__m128 px = _mm_sub_ps(_mm_mul_ps(rd[0], distance), ox);
+		__m128 py = _mm_sub_ps(_mm_mul_ps(rd[1], distance), oy);
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(rd[2], distance), oz);
+		__m128 offset = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)), _mm_mul_ps(pz, pz));
+
+		__m128 mask = _mm_and_ps(_mm_cmple_ps(offset, _mm_mul_ps(r, r)), _mm_cmpgt_ps(r, _mm_setzero_ps()));
+		mask = _mm_and_ps(mask, _mm_cmpge_ps(distance, _mm_set1_ps(t_min)));
+		mask = _mm_and_ps(mask, _mm_cmple_ps(distance, _mm_set1_ps(t_max)));
+
+		return _mm_movemask_ps(mask);
+	}
 }
\ No newline at end of file
@@ -0,0 +1,54 @@
+#include "benchmark.h"
+
+#include "engine.h"
+#include "integrator.h"
+#include "framebuffer.h"
+#include "bvh_stats.h"
+
+#include <logger/logger.h>
+#include <utime.hpp>
+
+void run_benchmark(CRayEngine* engine, uint32_t repeats)
+{
+	auto& renderer = engine->get_renderer();
+	auto& framebuffer = renderer->get_framebuffer();
+	auto extent = framebuffer->get_extent();
+	auto configured_mode = renderer->get_mode();
+	repeats = glm::max(repeats, 1u);
+
+	for (auto mode : { EIntegratorMode::ePath, EIntegratorMode::eStream, EIntegratorMode::eWavefront })
+	{
+		renderer->set_mode(mode);
+
+		float best_time{ std::numeric_limits<float>::max() };
+		uint64_t samples{ 0ull };
+		for (uint32_t repeat = 0u; repeat < repeats; ++repeat)
+		{
+			// clear() does a direct per-attachment lookup, so clear each attachment on its own
+			framebuffer->clear(glm::vec3(0.f), FRAMEBUFFER_COLOR_ATTACHMENT_FLAG_BIT);
+			framebuffer->clear(glm::vec3(0.f), FRAMEBUFFER_ALBEDO_ATTACHMENT_FLAG_BIT);
+			framebuffer->clear(glm::vec3(0.f), FRAMEBUFFER_NORMAL_ATTACHMENT_FLAG_BIT);
+			// The heatmap attachment only exists in traversal stats builds
+			BVH_STATS(framebuffer->clear(glm::vec3(0.f), FRAMEBUFFER_HEATMAP_ATTACHMENT_FLAG_BIT));
+
+			utl::stopwatch sw{};
+			engine->update();
+			best_time = glm::min(best_time, sw.stop<float>());
+			samples = renderer->get_traced_samples();
+		}
+
+		glm::dvec3 mean_color{ 0.0 };
+		for (uint32_t y = 0u; y < extent.y; ++y)
+		{
+			for (uint32_t x = 0u; x < extent.x; ++x)
+				mean_color += glm::dvec3(framebuffer->get_pixel(x, y, FRAMEBUFFER_COLOR_ATTACHMENT_FLAG_BIT));
+		}
+		mean_color /= glm::max(static_cast<double>(extent.x) * extent.y, 1.0);
+
+		log_info("Benchmark {}: best of {} {}s, {} samples, {:.3f} Msamples/s, mean color ({:.4f}, {:.4f}, {:.4f}).",
+			to_string(mode), repeats, best_time, samples, static_cast<double>(samples) / glm::max(best_time, std::numeric_limits<float>::min()) * 1e-6,
+			mean_color.x, mean_color.y, mean_color.z);
+	}
+
+	renderer->set_mode(configured_mode);
+}
\ No newline at end of file
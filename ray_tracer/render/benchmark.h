@@ -0,0 +1,8 @@
+#pragma once
+
+class CRayEngine;
+
+// Renders the loaded scene repeats times with every integrator mode and logs the best time,
+// traced samples per second and the mean image color of each. Modes share the estimator, so
+// the mean colors only differ by noise.
+void run_benchmark(CRayEngine* engine, uint32_t repeats);
\ No newline at end of file
@@ -21,6 +21,15 @@ inline glm::vec3 linear_to_srgb(const glm::vec3& linearRGB)
 	return glm::mix(higher, lower, cutoff);
 }
 
+// Blue through cyan, green and yellow to red over [0, 1]
+inline glm::vec3 heat_color(float t)
+{
+	const glm::vec3 stops[]{ glm::vec3(0.f, 0.f, 1.f), glm::vec3(0.f, 1.f, 1.f), glm::vec3(0.f, 1.f, 0.f), glm::vec3(1.f, 1.f, 0.f), glm::vec3(1.f, 0.f, 0.f) };
+	float position = glm::clamp(t, 0.f, 1.f) * 4.f;
+	uint32_t stop = glm::min(static_cast<uint32_t>(position), 3u);
+	return glm::mix(stops[stop], stops[stop + 1u], position - static_cast<float>(stop));
+}
+
 CFramebuffer::CFramebuffer(CResourceManager* resource_manager)
 {
 	m_pResourceManager = resource_manager;
@@ -41,6 +50,8 @@ void CFramebuffer::create(uint32_t width, uint32_t heigth, uint32_t attachment_m
 		m_colorBuffers[FRAMEBUFFER_ALBEDO_ATTACHMENT_FLAG_BIT] = std::make_unique<glm::vec3[]>(width * heigth);
 	if (attachment_mask & FRAMEBUFFER_NORMAL_ATTACHMENT_FLAG_BIT)
 		m_colorBuffers[FRAMEBUFFER_NORMAL_ATTACHMENT_FLAG_BIT] = std::make_unique<glm::vec3[]>(width * heigth);
+	if (attachment_mask & FRAMEBUFFER_HEATMAP_ATTACHMENT_FLAG_BIT)
+		m_colorBuffers[FRAMEBUFFER_HEATMAP_ATTACHMENT_FLAG_BIT] = std::make_unique<glm::vec3[]>(width * heigth);
 
 	m_gamma = config.m_tmcfg.m_gamma;
 	m_exposure = config.m_tmcfg.m_exposure;
@@ -138,6 +149,34 @@ void CFramebuffer::present()
 	}
 }
 
+resource_id_t CFramebuffer::present_heatmap()
+{
+	if (m_heatmapId == invalid_index)
+		m_heatmapId = m_pResourceManager->add_image("framebuffer_heatmap", std::make_unique<CImage>(m_dimensions.x, m_dimensions.y));
+
+	auto& image = m_pResourceManager->get_image(m_heatmapId);
+	auto& heatmap_buffer = m_colorBuffers[FRAMEBUFFER_HEATMAP_ATTACHMENT_FLAG_BIT];
+	if (!heatmap_buffer)
+		return m_heatmapId;
+
+	// A few very expensive pixels would otherwise squash everything else into blue
+	auto size = m_dimensions.x * m_dimensions.y;
+	std::vector<float> costs(size);
+	for (uint32_t idx = 0u; idx < size; ++idx)
+		costs[idx] = heatmap_buffer[idx].x;
+	auto percentile = costs.begin() + static_cast<ptrdiff_t>(size - 1u) * 99 / 100;
+	std::nth_element(costs.begin(), percentile, costs.end());
+	float scale = *percentile > 0.f ? 1.f / *percentile : 0.f;
+
+	for (uint32_t y = 0u; y < m_dimensions.y; ++y)
+	{
+		for (uint32_t x = 0u; x < m_dimensions.x; ++x)
+			image->set_pixel(x, m_dimensions.y - y - 1u, glm::vec4(heat_color(heatmap_buffer[y * m_dimensions.x + x].x * scale), 1.f));
+	}
+
+	return m_heatmapId;
+}
+
 resource_id_t CFramebuffer::get_image() const
 {
 	return m_imageId;
@@ -5,6 +5,8 @@ enum EFBAttachmentFlags
 	FRAMEBUFFER_COLOR_ATTACHMENT_FLAG_BIT = 1 << 0,
 	FRAMEBUFFER_ALBEDO_ATTACHMENT_FLAG_BIT = 1 << 1,
 	FRAMEBUFFER_NORMAL_ATTACHMENT_FLAG_BIT = 1 << 2,
+	// Traversal cost per sample in x, only filled with BVH_TRAVERSAL_STATS
+	FRAMEBUFFER_HEATMAP_ATTACHMENT_FLAG_BIT = 1 << 3,
 	FRAMEBUFFER_ALL_ATTACHMENTS_FLAG_BIT = FRAMEBUFFER_COLOR_ATTACHMENT_FLAG_BIT | FRAMEBUFFER_ALBEDO_ATTACHMENT_FLAG_BIT | FRAMEBUFFER_NORMAL_ATTACHMENT_FLAG_BIT
 };
 
@@ -24,6 +26,8 @@ public:
 
 	void clear(const glm::vec3& clear_color, uint32_t attachment_mask);
 	void present();
+	// False-colour image of the heatmap attachment, scaled so the 99th percentile pixel is red
+	resource_id_t present_heatmap();
 
 	const glm::uvec2& get_extent() const;
 	resource_id_t get_image() const;
@@ -33,6 +37,7 @@ private:
 	std::unordered_map<uint32_t, std::unique_ptr<glm::vec3[]>> m_colorBuffers;
 
 	resource_id_t m_imageId{ invalid_index };
+	resource_id_t m_heatmapId{ invalid_index };
 
 private:
 	CResourceManager* m_pResourceManager{ nullptr };
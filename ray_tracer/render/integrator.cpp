@@ -8,12 +8,37 @@
 #include "ecs/components/transform_component.h"
 
 #include "util.h"
+#include "bvh_stats.h"
+#include "thread_pool.h"
 
 #include "resources/bxdf.hpp"
 
 #include <configuration.h>
 
 constexpr const float ray_delta = 0.001f;
+// Primary rays of a tile are traced as packets of packet_size x packet_size pixels
+constexpr const uint32_t packet_size = 8u;
+static_assert(packet_size * packet_size <= FRayPacket::max_size);
+// Scattered rays are binned by direction octant and by one of stream_origin_cells^3 cells of the scene bounds
+constexpr const uint32_t stream_origin_cells = 4u;
+// Relative shortening of shadow rays aimed at a sampled light point, so the light itself isn't an occluder.
+constexpr const float shadow_epsilon = 0.001f;
+
+// Direction of the camera ray through film position film, in pixels
+glm::vec3 film_direction(const FCameraComponent* camera, const glm::vec2& film)
+{
+	return glm::normalize(camera->m_film_origin + film.x * camera->m_film_dx + film.y * camera->m_film_dy);
+}
+
+// Groups rays by direction octant and by one of stream_origin_cells^3 cells of the scene bounds.
+// The bin goes in the high half and index in the low half, so sorting keeps each bin in order.
+uint64_t ray_bin_key(const FRay& ray, const FAxixAlignedBoundingBox& bounds, const glm::vec3& cell_scale, uint32_t index)
+{
+	uint32_t octant = (ray.m_direction.x < 0.f ? 1u : 0u) | (ray.m_direction.y < 0.f ? 2u : 0u) | (ray.m_direction.z < 0.f ? 4u : 0u);
+	glm::uvec3 cell = glm::uvec3(glm::clamp(glm::ivec3((ray.m_origin - bounds.m_min) * cell_scale), glm::ivec3(0), glm::ivec3(stream_origin_cells - 1u)));
+	uint32_t bin = ((octant * stream_origin_cells + cell.z) * stream_origin_cells + cell.y) * stream_origin_cells + cell.x;
+	return static_cast<uint64_t>(bin) << 32u | index;
+}
 
 float balance_heuristic(float pdfF, float pdfG)
 {
@@ -43,7 +68,9 @@ void CIntegrator::create(uint32_t width, uint32_t heigth, uint32_t samples)
 
 	// Creating a framebuffer
 	m_pFramebuffer = std::make_unique<CFramebuffer>(m_pResourceManager);
-	m_pFramebuffer->create(width, heigth, FRAMEBUFFER_ALL_ATTACHMENTS_FLAG_BIT);
+	uint32_t attachments{ FRAMEBUFFER_ALL_ATTACHMENTS_FLAG_BIT };
+	BVH_STATS(attachments |= FRAMEBUFFER_HEATMAP_ATTACHMENT_FLAG_BIT);
+	m_pFramebuffer->create(width, heigth, attachments);
 
 	m_sky_begin = config.m_scfg.m_skybox.m_gradient.m_begin;
 	m_sky_end = config.m_scfg.m_skybox.m_gradient.m_end;
@@ -51,126 +78,615 @@ void CIntegrator::create(uint32_t width, uint32_t heigth, uint32_t samples)
 	m_sampleCount = config.m_icfg.m_sample_count;
 	m_bounceCount = config.m_icfg.m_bounce_count;
 	m_rrThreshold = config.m_icfg.m_rr_threshold;
+	m_mode = config.m_icfg.m_mode;
+	m_primary_hit_cache = config.m_icfg.m_primary_hit_cache;
+
+	m_antialiasing = config.m_fbcfg.m_antialiasing;
+	m_filter.create(config.m_fbcfg.m_filter, config.m_fbcfg.m_filter_radius);
 
 	m_use_estimator = config.m_icfg.m_use_estimator;
 	m_estimator_tolerance = config.m_icfg.m_estimator_tolerance;
 
-	m_pixelIterator.resize(width * heigth);
-	std::iota(m_pixelIterator.begin(), m_pixelIterator.end(), 0u);
+	m_tile_size = config.m_icfg.m_tile_size;
+	m_tile_order = config.m_icfg.m_tile_order;
+
+	m_vScratch.resize(CThreadPool::getInstance()->worker_count());
+	for (auto& scratch : m_vScratch)
+	{
+		scratch.m_pSampler = std::make_unique<CCMJSampler>(m_sampleCount);
+		scratch.m_pPreviewSampler = std::make_unique<CPCGSampler>(1u);
+	}
 }
 
 void CIntegrator::trace_ray(CScene* scene, FCameraComponent* camera, const glm::vec3& origin)
 {
-	//std::execution::par, 
-	std::for_each(std::execution::par, m_pixelIterator.begin(), m_pixelIterator.end(),
-		[this, scene, camera, &origin](uint32_t index)
+	BVH_STATS(bvh_stats::reset());
+	m_traced_samples.store(0ull, std::memory_order_relaxed);
+
+	m_scheduler.create(camera->m_viewportExtent, m_tile_size, m_tile_order);
+
+	if (m_mode == EIntegratorMode::eStream)
+	{
+		m_scheduler.run(
+			[this, scene, camera, &origin](const FTile& tile, uint32_t)
+			{
+				trace_stream(scene, camera, origin, tile);
+			});
+		BVH_STATS(bvh_stats::report());
+		return;
+	}
+
+	if (m_mode == EIntegratorMode::eWavefront)
+	{
+		m_scheduler.run(
+			[this, scene, camera, &origin](const FTile& tile, uint32_t worker)
+			{
+				trace_wavefront(scene, camera, origin, tile, m_vScratch[worker].m_wavefront);
+			});
+		BVH_STATS(bvh_stats::report());
+		return;
+	}
+
+	m_scheduler.run(
+		[this, scene, camera, &origin](const FTile& tile, uint32_t worker)
 		{
-			trace_ray(scene, camera, origin, index);
+			auto& sampler = m_vScratch[worker].m_pSampler;
+
+			// Without the cache every sample traces its own camera ray
+			if (!use_primary_cache())
+			{
+				for (uint32_t y = tile.m_min.y; y < tile.m_max.y; ++y)
+				{
+					for (uint32_t x = tile.m_min.x; x < tile.m_max.x; ++x)
+					{
+						BVH_STATS(bvh_stats::pixel_cost = 0u);
+						trace_ray(scene, camera, origin, y * camera->m_viewportExtent.x + x, nullptr, sampler);
+					}
+				}
+				return;
+			}
+
+			FRayPacket packet{};
+			uint32_t pixels[FRayPacket::max_size];
+			for (uint32_t y = tile.m_min.y; y < tile.m_max.y; y += packet_size)
+			{
+				for (uint32_t x = tile.m_min.x; x < tile.m_max.x; x += packet_size)
+				{
+					trace_primary(scene, camera, origin, glm::uvec2(x, y), glm::min(glm::uvec2(x, y) + packet_size, tile.m_max), packet, pixels);
+
+					// Each pixel is charged its primary ray once, the slots are reused by later rays
+					BVH_STATS(uint32_t primary_costs[FRayPacket::max_size]);
+					BVH_STATS(for (uint32_t i = 0u; i < packet.m_size; ++i) primary_costs[i] = bvh_stats::rays[i].cost());
+
+					FPrimaryHit primary{};
+					for (uint32_t i = 0u; i < packet.m_size; ++i)
+					{
+						BVH_STATS(bvh_stats::pixel_cost = primary_costs[i]);
+						resolve_primary(scene, packet.m_rays[i], packet.m_hits[i], primary);
+						trace_ray(scene, camera, origin, pixels[i], &primary, sampler);
+					}
+				}
+			}
 		});
+
+	BVH_STATS(bvh_stats::report());
 }
 
-void CIntegrator::trace_ray(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, uint32_t ray_index)
+uint32_t CIntegrator::trace_primary(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, const glm::uvec2& min, const glm::uvec2& max, FRayPacket& packet, uint32_t* pixels) const
 {
 	auto& viewport_extent = camera->m_viewportExtent;
 
-	auto x = ray_index % viewport_extent.x;
-	auto y = ray_index / viewport_extent.x;
+	packet.m_size = 0u;
+	for (uint32_t y = min.y; y < max.y; ++y)
+	{
+		for (uint32_t x = min.x; x < max.x; ++x)
+		{
+			auto index = y * viewport_extent.x + x;
+			pixels[packet.m_size] = index;
+			packet.m_rays[packet.m_size] = FRay(origin, film_direction(camera, glm::vec2(x, y) + 0.5f));
+			packet.m_hits[packet.m_size] = FHitResult{};
+			++packet.m_size;
+		}
+	}
 
-	auto& ray_direction = camera->m_vRayDirections[ray_index];
+	scene->trace_packet(packet, ray_delta, std::numeric_limits<float>::infinity());
+	return packet.m_size;
+}
 
-	static thread_local std::unique_ptr<CSamplerBase> sampler;
+void CIntegrator::prepare_tile(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, const FTile& tile, std::vector<uint32_t>& pixels, std::vector<FPrimaryHit>& primaries, std::vector<FPixelAccumulator>& accumulators) const
+{
+	auto& viewport_extent = camera->m_viewportExtent;
 
-	if(!sampler)
-		sampler = std::make_unique<CCMJSampler>(m_sampleCount);
+	pixels.clear();
+	primaries.clear();
+	if (!use_primary_cache())
+	{
+		for (uint32_t y = tile.m_min.y; y < tile.m_max.y; ++y)
+		{
+			for (uint32_t x = tile.m_min.x; x < tile.m_max.x; ++x)
+				pixels.emplace_back(y * viewport_extent.x + x);
+		}
+		accumulators.assign(pixels.size(), FPixelAccumulator{});
+		return;
+	}
 
-	sampler->begin(ray_index);
+	BVH_STATS(std::vector<uint32_t> primary_costs{});
+
+	FRayPacket packet{};
+	uint32_t packet_pixels[FRayPacket::max_size];
+	for (uint32_t y = tile.m_min.y; y < tile.m_max.y; y += packet_size)
+	{
+		for (uint32_t x = tile.m_min.x; x < tile.m_max.x; x += packet_size)
+		{
+			trace_primary(scene, camera, origin, glm::uvec2(x, y), glm::min(glm::uvec2(x, y) + packet_size, tile.m_max), packet, packet_pixels);
+			BVH_STATS(for (uint32_t i = 0u; i < packet.m_size; ++i) primary_costs.emplace_back(bvh_stats::rays[i].cost()));
+			for (uint32_t i = 0u; i < packet.m_size; ++i)
+			{
+				pixels.emplace_back(packet_pixels[i]);
+				resolve_primary(scene, packet.m_rays[i], packet.m_hits[i], primaries.emplace_back());
+			}
+		}
+	}
+
+	accumulators.assign(pixels.size(), FPixelAccumulator{});
+	BVH_STATS(for (size_t i = 0u; i < pixels.size(); ++i) accumulators[i].m_traversal_cost = primary_costs[i]);
+}
+
+void CIntegrator::resolve_primary(CScene* scene, const FRay& ray, const FHitResult& hit, FPrimaryHit& primary) const
+{
+	primary = FPrimaryHit{};
+	primary.m_ray = ray;
+	primary.m_hit = hit;
+	if (!hit.is_hit())
+		return;
+
+	scene->resolve_hit(ray, hit, primary.m_surface);
+
+	// The same fetches scatter does at depth 0, which then only reads them back
+	auto& material = m_pResourceManager->get_material(primary.m_surface.m_material_id);
+	if (!material->can_scatter_light())
+		return;
+
+	primary.m_diffuse = material->sample_diffuse_color(primary.m_surface);
+	primary.m_metallic_roughness = material->sample_surface_metallic_roughness(primary.m_surface);
+	primary.m_normal = material->sample_surface_normal(primary.m_surface);
+	primary.m_sampled = true;
+}
+
+void CIntegrator::begin_path(CScene* scene, FPathState& path, const FRay& ray, const FPrimaryHit* primary) const
+{
+	path = FPathState{};
+	if (primary)
+	{
+		path.m_ray = primary->m_ray;
+		path.m_hit = primary->m_hit;
+		path.m_surface = primary->m_surface;
+		path.m_primary = primary;
+		return;
+	}
+
+	path.m_ray = ray;
+	if (scene->trace_ray(path.m_ray, ray_delta, std::numeric_limits<float>::infinity(), path.m_hit))
+		scene->resolve_hit(path.m_ray, path.m_hit, path.m_surface);
+}
+
+FRay CIntegrator::generate_ray(FCameraComponent* camera, const glm::vec3& origin, uint32_t pixel, CSamplerBase& sampler) const
+{
+	auto& viewport_extent = camera->m_viewportExtent;
+	glm::vec2 film = glm::vec2(pixel % viewport_extent.x, pixel / viewport_extent.x) + 0.5f;
+
+	// The jitter takes the first dimension of the sample, which the sampler stratifies per pixel
+	if (m_antialiasing)
+		film += m_filter.sample(sampler.sample_vec2());
+
+	return FRay(origin, film_direction(camera, film));
+}
+
+bool CIntegrator::use_primary_cache() const
+{
+	// Jittered camera rays differ per sample
+	return m_primary_hit_cache && !m_antialiasing;
+}
 
-	uint32_t actual_sample_count{ 0u };
-	float s1{ 0.f }, s2{ 0.f };
+void CIntegrator::trace_ray(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, uint32_t ray_index, const FPrimaryHit* primary, const std::unique_ptr<CSamplerBase>& sampler)
+{
+	auto& viewport_extent = camera->m_viewportExtent;
 
-	glm::vec3 final_color{ 0.f };
-	glm::vec3 final_albedo{ 0.f };
-	glm::vec3 final_normal{ 0.f };
+	auto x = ray_index % viewport_extent.x;
+	auto y = ray_index / viewport_extent.x;
+
+	sampler->begin(ray_index);
+
+	FPixelAccumulator pixel{};
 	while (true)
 	{
-		FRay ray{};
-		ray.m_origin = origin;
-		const float aa_radius{ 0.0005f };
-		ray.set_direction(ray_direction); // +glm::vec3(sampler.sample(-aa_radius, aa_radius), sampler.sample(-aa_radius, aa_radius), sampler.sample(-aa_radius, aa_radius))
+		FRay ray = primary ? primary->m_ray : generate_ray(camera, origin, ray_index, *sampler);
 
 		glm::vec3 sampled_albedo{ 0.f }, sampled_normal{ 0.f };
-		glm::vec3 sampled_color = integrate(scene, ray, m_bounceCount, sampler, sampled_albedo, sampled_normal);
+		glm::vec3 sampled_color = integrate(scene, ray, m_bounceCount, sampler, sampled_albedo, sampled_normal, primary);
 		sampler->next();
 		//glm::vec3 sampled_color_nee = integrate_nee(scene, ray, m_bounceCount, sampler, sampled_albedo, sampled_normal);
 		//sampler.next();
 
 		//auto result_color = (sampled_color + sampled_color_nee) / 2.f;
-		auto result_color = sampled_color;
 		//auto result_color = sampled_color_nee;
 
-		final_color += result_color;
-		final_albedo += sampled_albedo;// / 2.f;
-		final_normal += sampled_normal;// / 2.f;
+		if (accumulate(pixel, sampled_color, sampled_albedo, sampled_normal))
+			break;
+	}
+
+	BVH_STATS(pixel.m_traversal_cost = bvh_stats::pixel_cost);
+	write_pixel(x, y, pixel);
+}
+
+void CIntegrator::trace_stream(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, const FTile& tile)
+{
+	auto& viewport_extent = camera->m_viewportExtent;
+
+	std::vector<uint32_t> pixels{};
+	std::vector<FPrimaryHit> primaries{};
+	std::vector<FPixelAccumulator> accumulators{};
+	prepare_tile(scene, camera, origin, tile, pixels, primaries, accumulators);
+
+	// Every pixel owns its sampler, so each sees the same sequence as in the per-path loop
+	std::vector<CCMJSampler> samplers(pixels.size(), CCMJSampler(m_sampleCount));
+	for (size_t i = 0u; i < pixels.size(); ++i)
+		samplers[i].begin(pixels[i]);
 
-		++actual_sample_count;
+	std::vector<FPathState> paths(pixels.size());
+	std::vector<uint32_t> pending(pixels.size());
+	std::iota(pending.begin(), pending.end(), 0u);
+	std::vector<uint32_t> active{}, scattered{};
+
+	// One sample per unfinished pixel per round, all paths of a round advance bounce by bounce
+	while (!pending.empty())
+	{
+		for (auto i : pending)
+		{
+			BVH_STATS(bvh_stats::pixel_cost = 0u);
+			if (primaries.empty())
+				begin_path(scene, paths[i], generate_ray(camera, origin, pixels[i], samplers[i]), nullptr);
+			else
+				begin_path(scene, paths[i], primaries[i].m_ray, &primaries[i]);
+			BVH_STATS(paths[i].m_traversal_cost += static_cast<uint32_t>(bvh_stats::pixel_cost));
+		}
 
-		// based on https://cs184.eecs.berkeley.edu/sp21/docs/proj3-1-part-5
-		if (m_use_estimator)
+		active = pending;
+		while (!active.empty())
 		{
-			float luma = glm::dot(glm::vec3(0.299f, 0.587f, 0.114f), result_color);
-			s1 += luma;
-			s2 += luma * luma;
+			scattered.clear();
+			for (auto i : active)
+			{
+				auto step = EPathStep::eContinued;
+				BVH_STATS(bvh_stats::pixel_cost = 0u);
+				while (step == EPathStep::eContinued)
+					step = scatter(scene, paths[i], samplers[i], m_bounceCount);
+				BVH_STATS(paths[i].m_traversal_cost += static_cast<uint32_t>(bvh_stats::pixel_cost));
+
+				if (step == EPathStep::eScattered)
+					scattered.emplace_back(i);
+			}
+
+			trace_scattered(scene, paths, scattered);
 
-			if (!(actual_sample_count % 10u))
+			active.clear();
+			for (auto i : scattered)
 			{
-				float n = static_cast<float>(actual_sample_count);
+				if (advance(scene, paths[i], samplers[i]))
+					active.emplace_back(i);
+			}
+		}
+
+		std::erase_if(pending,
+			[this, &paths, &samplers, &accumulators](uint32_t i)
+			{
+				BVH_STATS(accumulators[i].m_traversal_cost += paths[i].m_traversal_cost);
+				samplers[i].next();
+				return accumulate(accumulators[i], paths[i].m_color, paths[i].m_albedo, paths[i].m_normal);
+			});
+	}
+
+	for (size_t i = 0u; i < pixels.size(); ++i)
+		write_pixel(pixels[i] % viewport_extent.x, pixels[i] / viewport_extent.x, accumulators[i]);
+}
+
+void CIntegrator::trace_scattered(CScene* scene, std::vector<FPathState>& paths, const std::vector<uint32_t>& active) const
+{
+	auto bounds = scene->get_bounds();
+	glm::vec3 cell_scale = static_cast<float>(stream_origin_cells) / glm::max(bounds.extent(), glm::vec3(std::numeric_limits<float>::min()));
+
+	std::vector<uint64_t> keys{};
+	keys.reserve(active.size());
+	for (auto i : active)
+		keys.emplace_back(ray_bin_key(paths[i].m_next_ray, bounds, cell_scale, i));
+	std::sort(keys.begin(), keys.end());
 
-				float u = s1 / n;
-				float deviation = glm::sqrt(1.f / (n - 1.f) * (s2 - s1 * s1 / n));
+	FRayPacket packet{};
+	for (size_t begin = 0u; begin < keys.size();)
+	{
+		uint64_t bin = keys[begin] >> 32u;
+		size_t end = begin;
+		packet.m_size = 0u;
+		while (end < keys.size() && (keys[end] >> 32u) == bin && packet.m_size < FRayPacket::max_size)
+		{
+			packet.m_rays[packet.m_size] = paths[static_cast<uint32_t>(keys[end])].m_next_ray;
+			packet.m_hits[packet.m_size] = FHitResult{};
+			++packet.m_size;
+			++end;
+		}
 
-				float I = 1.96f * deviation / glm::sqrt(n);
+		scene->trace_packet(packet, 0.f, std::numeric_limits<float>::infinity());
+
+		for (size_t k = begin; k < end; ++k)
+		{
+			paths[static_cast<uint32_t>(keys[k])].m_next_hit = packet.m_hits[k - begin];
+			BVH_STATS(paths[static_cast<uint32_t>(keys[k])].m_traversal_cost += bvh_stats::rays[k - begin].cost());
+		}
+		begin = end;
+	}
+}
 
-				if (I <= m_estimator_tolerance * u)
-					break;
+void CIntegrator::trace_wavefront(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, const FTile& tile, FWavefrontQueues& queues)
+{
+	auto& viewport_extent = camera->m_viewportExtent;
+	auto& pixels = queues.m_pixels;
+	auto& primaries = queues.m_primaries;
+	auto& paths = queues.m_paths;
+	auto& samplers = queues.m_samplers;
+	auto& accumulators = queues.m_accumulators;
+	auto& pending = queues.m_pending;
+
+	prepare_tile(scene, camera, origin, tile, pixels, primaries, accumulators);
+
+	// Every pixel owns its sampler, seeded as in the other modes
+	paths.resize(pixels.size());
+	samplers.clear();
+	samplers.resize(pixels.size(), CCMJSampler(m_sampleCount));
+	for (size_t i = 0u; i < pixels.size(); ++i)
+		samplers[i].begin(pixels[i]);
+
+	// Misses sort last, they only add the sky
+	auto shade_key = [&paths](uint32_t i)
+		{
+			auto& path = paths[i];
+			auto material = path.m_hit.is_hit() ? glm::min(path.m_surface.m_material_id, resource_id_t{ std::numeric_limits<uint32_t>::max() - 1u }) : std::numeric_limits<uint32_t>::max();
+			return static_cast<uint64_t>(material) << 32u | i;
+		};
+
+	pending.resize(pixels.size());
+	std::iota(pending.begin(), pending.end(), 0u);
+
+	// One sample per unfinished pixel per round
+	while (!pending.empty())
+	{
+		// Generate: cached primary hits go straight to shading, camera rays are queued for extension
+		queues.m_extend.clear();
+		queues.m_shade.clear();
+		for (auto i : pending)
+		{
+			if (primaries.empty())
+			{
+				paths[i] = FPathState{};
+				paths[i].m_ray = generate_ray(camera, origin, pixels[i], samplers[i]);
+				queues.m_extend.push(i, paths[i].m_ray);
+			}
+			else
+			{
+				begin_path(scene, paths[i], primaries[i].m_ray, &primaries[i]);
+				queues.m_shade.emplace_back(shade_key(i));
 			}
 		}
-		else
+
+		bool primary{ true };
+		while (queues.m_extend.size() > 0u || !queues.m_shade.empty())
 		{
-			if (actual_sample_count >= m_sampleCount)
-				break;
+			if (queues.m_extend.size() > 0u)
+			{
+				// Extend: closest hits of all queued rays
+				trace_extend(scene, queues, primary ? ray_delta : 0.f);
+
+				// Camera rays start their path, scattered rays finish the bounce that chose them
+				for (size_t k = 0u; k < queues.m_extend.size(); ++k)
+				{
+					auto i = queues.m_extend.m_paths[k];
+					auto& path = paths[i];
+					if (primary)
+					{
+						path.m_hit = queues.m_extend.m_hits[k];
+						if (path.m_hit.is_hit())
+							scene->resolve_hit(path.m_ray, path.m_hit, path.m_surface);
+					}
+					else
+					{
+						path.m_next_hit = queues.m_extend.m_hits[k];
+						if (!advance(scene, path, samplers[i]))
+							continue;
+					}
+					queues.m_shade.emplace_back(shade_key(i));
+				}
+			}
+			primary = false;
+
+			// Shade: paths on the same material run back to back, so its textures stay in cache
+			std::sort(queues.m_shade.begin(), queues.m_shade.end());
+			queues.m_extend.clear();
+			queues.m_shadow.clear();
+			for (auto key : queues.m_shade)
+			{
+				auto i = static_cast<uint32_t>(key);
+				auto step = EPathStep::eContinued;
+				BVH_STATS(bvh_stats::pixel_cost = 0u);
+				while (step == EPathStep::eContinued)
+					step = scatter(scene, paths[i], samplers[i], m_bounceCount, &queues.m_shadow, i);
+				BVH_STATS(paths[i].m_traversal_cost += static_cast<uint32_t>(bvh_stats::pixel_cost));
+
+				if (step == EPathStep::eScattered)
+					queues.m_extend.push(i, paths[i].m_next_ray);
+			}
+			queues.m_shade.clear();
+
+			// Shadow: visibility of every light sample taken while shading
+			trace_shadows(scene, queues);
 		}
+
+		std::erase_if(pending,
+			[this, &paths, &samplers, &accumulators](uint32_t i)
+			{
+				BVH_STATS(accumulators[i].m_traversal_cost += paths[i].m_traversal_cost);
+				samplers[i].next();
+				return accumulate(accumulators[i], paths[i].m_color, paths[i].m_albedo, paths[i].m_normal);
+			});
 	}
 
-	m_pFramebuffer->add_pixel(x, y, final_color / static_cast<float>(actual_sample_count), FRAMEBUFFER_COLOR_ATTACHMENT_FLAG_BIT);
-	m_pFramebuffer->add_pixel(x, y, final_albedo / static_cast<float>(actual_sample_count), FRAMEBUFFER_ALBEDO_ATTACHMENT_FLAG_BIT);
-	m_pFramebuffer->add_pixel(x, y, final_normal / static_cast<float>(actual_sample_count), FRAMEBUFFER_NORMAL_ATTACHMENT_FLAG_BIT);
+	for (size_t i = 0u; i < pixels.size(); ++i)
+		write_pixel(pixels[i] % viewport_extent.x, pixels[i] / viewport_extent.x, accumulators[i]);
+}
+
+void CIntegrator::trace_extend(CScene* scene, FWavefrontQueues& queues, float t_min) const
+{
+	auto& extend = queues.m_extend;
+	auto& keys = queues.m_keys;
+
+	auto bounds = scene->get_bounds();
+	glm::vec3 cell_scale = static_cast<float>(stream_origin_cells) / glm::max(bounds.extent(), glm::vec3(std::numeric_limits<float>::min()));
+
+	keys.clear();
+	for (size_t k = 0u; k < extend.size(); ++k)
+		keys.emplace_back(ray_bin_key(extend.m_rays[k], bounds, cell_scale, static_cast<uint32_t>(k)));
+	std::sort(keys.begin(), keys.end());
+
+	extend.m_hits.resize(extend.size());
+
+	FRayPacket packet{};
+	for (size_t begin = 0u; begin < keys.size();)
+	{
+		uint64_t bin = keys[begin] >> 32u;
+		size_t end = begin;
+		packet.m_size = 0u;
+		while (end < keys.size() && (keys[end] >> 32u) == bin && packet.m_size < FRayPacket::max_size)
+		{
+			packet.m_rays[packet.m_size] = extend.m_rays[static_cast<uint32_t>(keys[end])];
+			packet.m_hits[packet.m_size] = FHitResult{};
+			++packet.m_size;
+			++end;
+		}
+
+		scene->trace_packet(packet, t_min, std::numeric_limits<float>::infinity());
+
+		for (size_t k = begin; k < end; ++k)
+		{
+			extend.m_hits[static_cast<uint32_t>(keys[k])] = packet.m_hits[k - begin];
+			BVH_STATS(queues.m_paths[extend.m_paths[static_cast<uint32_t>(keys[k])]].m_traversal_cost += bvh_stats::rays[k - begin].cost());
+		}
+		begin = end;
+	}
+}
+
+void CIntegrator::trace_shadows(CScene* scene, FWavefrontQueues& queues)
+{
+	auto& shadow = queues.m_shadow;
+	auto& keys = queues.m_keys;
+
+	// Shadow rays are traced one by one, sorting still makes neighbouring queries coherent
+	auto bounds = scene->get_bounds();
+	glm::vec3 cell_scale = static_cast<float>(stream_origin_cells) / glm::max(bounds.extent(), glm::vec3(std::numeric_limits<float>::min()));
+
+	keys.clear();
+	for (size_t k = 0u; k < shadow.size(); ++k)
+		keys.emplace_back(ray_bin_key(shadow.m_rays[k], bounds, cell_scale, static_cast<uint32_t>(k)));
+	std::sort(keys.begin(), keys.end());
+
+	for (auto key : keys)
+	{
+		auto k = static_cast<uint32_t>(key);
+		auto& path = queues.m_paths[shadow.m_paths[k]];
+		BVH_STATS(bvh_stats::pixel_cost = 0u);
+		if (!occluded(scene, shadow.m_rays[k], shadow.m_distances[k], shadow.m_alpha_tests[k] != 0u, queues.m_samplers[shadow.m_paths[k]]))
+			path.m_color += shadow.m_contributions[k];
+		BVH_STATS(path.m_traversal_cost += static_cast<uint32_t>(bvh_stats::pixel_cost));
+	}
+}
+
+bool CIntegrator::accumulate(FPixelAccumulator& pixel, const glm::vec3& color, const glm::vec3& albedo, const glm::vec3& normal) const
+{
+	pixel.m_color += color;
+	pixel.m_albedo += albedo;
+	pixel.m_normal += normal;
+	++pixel.m_count;
+
+	// based on https://cs184.eecs.berkeley.edu/sp21/docs/proj3-1-part-5
+	if (m_use_estimator)
+	{
+		float luma = glm::dot(glm::vec3(0.299f, 0.587f, 0.114f), color);
+		pixel.m_s1 += luma;
+		pixel.m_s2 += luma * luma;
+
+		if (!(pixel.m_count % 10u))
+		{
+			float n = static_cast<float>(pixel.m_count);
+
+			float u = pixel.m_s1 / n;
+			float deviation = glm::sqrt(1.f / (n - 1.f) * (pixel.m_s2 - pixel.m_s1 * pixel.m_s1 / n));
+
+			float I = 1.96f * deviation / glm::sqrt(n);
+
+			return I <= m_estimator_tolerance * u;
+		}
+
+		return false;
+	}
+
+	return pixel.m_count >= m_sampleCount;
+}
+
+void CIntegrator::write_pixel(uint32_t x, uint32_t y, const FPixelAccumulator& pixel)
+{
+	m_traced_samples.fetch_add(pixel.m_count, std::memory_order_relaxed);
+
+	float count = static_cast<float>(pixel.m_count);
+	m_pFramebuffer->add_pixel(x, y, pixel.m_color / count, FRAMEBUFFER_COLOR_ATTACHMENT_FLAG_BIT);
+	m_pFramebuffer->add_pixel(x, y, pixel.m_albedo / count, FRAMEBUFFER_ALBEDO_ATTACHMENT_FLAG_BIT);
+	m_pFramebuffer->add_pixel(x, y, pixel.m_normal / count, FRAMEBUFFER_NORMAL_ATTACHMENT_FLAG_BIT);
+	BVH_STATS(m_pFramebuffer->add_pixel(x, y, glm::vec3(static_cast<float>(pixel.m_traversal_cost) / count), FRAMEBUFFER_HEATMAP_ATTACHMENT_FLAG_BIT));
 }
 
 void CIntegrator::render_preview(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, uint32_t frame_index, uint32_t bounces)
 {
 	auto& viewport_extent = camera->m_viewportExtent;
+	m_scheduler.create(viewport_extent, m_tile_size, m_tile_order);
 
-	std::for_each(std::execution::par, m_pixelIterator.begin(), m_pixelIterator.end(),
-		[this, scene, camera, &origin, frame_index, bounces, &viewport_extent](uint32_t index)
+	m_scheduler.run(
+		[this, scene, camera, &origin, frame_index, bounces, &viewport_extent](const FTile& tile, uint32_t worker)
 		{
-			auto x = index % viewport_extent.x;
-			auto y = index / viewport_extent.x;
+			auto& sampler = m_vScratch[worker].m_pPreviewSampler;
+
+			FRayPacket packet{};
+			uint32_t pixels[FRayPacket::max_size];
+			for (uint32_t py = tile.m_min.y; py < tile.m_max.y; py += packet_size)
+			{
+				for (uint32_t px = tile.m_min.x; px < tile.m_max.x; px += packet_size)
+				{
+					trace_primary(scene, camera, origin, glm::uvec2(px, py), glm::min(glm::uvec2(px, py) + packet_size, tile.m_max), packet, pixels);
 
-			static thread_local std::unique_ptr<CSamplerBase> sampler;
-			if (!sampler)
-				sampler = std::make_unique<CPCGSampler>(1u);
+					for (uint32_t i = 0u; i < packet.m_size; ++i)
+					{
+						auto index = pixels[i];
+						auto x = index % viewport_extent.x;
+						auto y = index / viewport_extent.x;
 
-			// Decorrelate by pixel and accumulated frame so the preview refines over time.
-			static_cast<CPCGSampler*>(sampler.get())->reseed(index + 1u, frame_index + 1u);
+						// Decorrelate by pixel and accumulated frame so the preview refines over time.
+						static_cast<CPCGSampler*>(sampler.get())->reseed(index + 1u, frame_index + 1u);
 
-			FRay ray{};
-			ray.m_origin = origin;
-			ray.set_direction(camera->m_vRayDirections[index]);
+						FPrimaryHit primary{};
+						resolve_primary(scene, packet.m_rays[i], packet.m_hits[i], primary);
 
-			glm::vec3 albedo{ 0.f }, normal{ 0.f };
-			glm::vec3 color = integrate(scene, ray, bounces, sampler, albedo, normal);
+						glm::vec3 albedo{ 0.f }, normal{ 0.f };
+						glm::vec3 color = integrate(scene, packet.m_rays[i], bounces, sampler, albedo, normal, &primary);
 
-			m_pFramebuffer->add_pixel(x, y, color, FRAMEBUFFER_COLOR_ATTACHMENT_FLAG_BIT);
+						m_pFramebuffer->add_pixel(x, y, color, FRAMEBUFFER_COLOR_ATTACHMENT_FLAG_BIT);
+					}
+				}
+			}
 		});
 }
 
@@ -179,8 +695,12 @@ glm::vec3 CIntegrator::integrate_nee(CScene* scene, FRay ray, int32_t bounces, c
 	glm::vec3 throughput{ 1.f };
 	glm::vec3 out_color{ 0.f };
 
+	// Traversal only produces the compact hit record; shading data is resolved once per hit.
 	FHitResult hit_result{};
+	FSurfaceInteraction surface{};
 	auto hit_something = scene->trace_ray(ray, ray_delta, std::numeric_limits<float>::infinity(), hit_result);
+	if (hit_something)
+		scene->resolve_hit(ray, hit_result, surface);
 
 	for (uint32_t depth = 0u; depth <= bounces; ++depth)
 	{
@@ -190,19 +710,19 @@ glm::vec3 CIntegrator::integrate_nee(CScene* scene, FRay ray, int32_t bounces, c
 			break;
 		}
 
-		auto& material = m_pResourceManager->get_material(hit_result.m_material_id);
+		auto& material = m_pResourceManager->get_material(surface.m_material_id);
 
 		if (material->can_emit_light() && depth == 0u)
 		{
-			out_color += throughput * material->emit(hit_result);
+			out_color += throughput * material->emit(surface);
 
 			if(!material->can_scatter_light())
 				break;
 		}
 
-		glm::vec4 diffuse = material->sample_diffuse_color(hit_result);
-		glm::vec2 mr = material->sample_surface_metallic_roughness(hit_result);
-		glm::vec3 normal = material->sample_surface_normal(hit_result);
+		glm::vec4 diffuse = material->sample_diffuse_color(surface);
+		glm::vec2 mr = material->sample_surface_metallic_roughness(surface);
+		glm::vec3 normal = material->sample_surface_normal(surface);
 		COrthonormalBasis basis(normal);
 
 		auto material_sample = sampler->sample_vec2();
@@ -218,24 +738,23 @@ glm::vec3 CIntegrator::integrate_nee(CScene* scene, FRay ray, int32_t bounces, c
 		glm::vec3 wo = basis.to_local(glm::normalize(-ray.m_direction));
 
 		size_t light_index{ invalid_index };
-		const CTriangle* light{ nullptr };
 
 		// Calculate direct illumination if we have lights
 		float light_probability = scene->get_area_light_probability();
 		if (!std::isinf(light_probability))
 		{
 			light_index = scene->get_area_light_index(sampler->sample());
-			light = &scene->get_area_light(light_index);
 		
 			float light_pdf{};
-			glm::vec3 light_dir = light->sample(hit_result.m_position, sampler->sample_vec2(), light_pdf);
+			FSurfaceInteraction light_sample{};
+			glm::vec3 light_dir = scene->sample_area_light(light_index, surface.m_position, sampler->sample_vec2(), light_pdf, light_sample);
 			glm::vec3 wi = basis.to_local(light_dir);
 		
 			float cos_theta_i = glm::abs(cos_theta(wi));
 			if (cos_theta_i > 0.f && light_pdf > 0.f)
 			{
 				FRay direct_ray;
-				direct_ray.m_origin = hit_result.m_position + math::sign(cos_theta(wi)) * normal * ray_delta;
+				direct_ray.m_origin = surface.m_position + math::sign(cos_theta(wi)) * normal * ray_delta;
 				direct_ray.set_direction(is_transparent ? ray.m_direction : light_dir);
 		
 				FHitResult direct_hit{};
@@ -247,16 +766,18 @@ glm::vec3 CIntegrator::integrate_nee(CScene* scene, FRay ray, int32_t bounces, c
 					ray = direct_ray;
 					hit_result = direct_hit;
 					hit_something = direct_hit_something;
+					if (hit_something)
+						scene->resolve_hit(ray, hit_result, surface);
 					continue;
 				}
 
-				if (direct_hit_something && light_index == direct_hit.m_primitive_id && direct_hit.m_primitive_id != hit_result.m_primitive_id)
+				if (direct_hit_something && light_sample.is_same_primitive(direct_hit) && !direct_hit.is_same_primitive(hit_result))
 				{
 					float bsdf_pdf = material->pdf(wi, wo, normal, diffuse, mr);
 					if (bsdf_pdf > 0.f)
 					{
-						auto& light_material = m_pResourceManager->get_material(light->get_material_id());
-						auto emittance = light_material->emit(direct_hit);
+						auto& light_material = m_pResourceManager->get_material(light_sample.m_material_id);
+						auto emittance = light_material->emit(light_sample);
 						auto bsdf = material->eval(wi, wo, normal, diffuse, mr);
 						// Light-sampling pdf (solid angle) must include the 1/N probability of
 						// having selected this light, so both MIS strategies share one measure.
@@ -280,37 +801,40 @@ glm::vec3 CIntegrator::integrate_nee(CScene* scene, FRay ray, int32_t bounces, c
 
 		if (is_transparent)
 		{
-			FHitResult indirect_hit{};
-			ray.m_origin = hit_result.m_position;
-			hit_something = scene->trace_ray(ray, ray_delta, std::numeric_limits<float>::infinity(), indirect_hit);
-			hit_result = indirect_hit;
+			ray.m_origin = surface.m_position;
+			hit_result = FHitResult{};
+			hit_something = scene->trace_ray(ray, ray_delta, std::numeric_limits<float>::infinity(), hit_result);
+			if (hit_something)
+				scene->resolve_hit(ray, hit_result, surface);
 			continue;
 		}
 
 		glm::vec3 bsdf = material->eval(wi, wo, normal, diffuse, mr);
 
 		FRay indirect_ray{};
-		indirect_ray.m_origin = hit_result.m_position + math::sign(cos_theta(wi)) * normal * ray_delta;
+		indirect_ray.m_origin = surface.m_position + math::sign(cos_theta(wi)) * normal * ray_delta;
 		indirect_ray.set_direction(basis.to_world(wi));
 
 		FHitResult indirect_hit{};
+		FSurfaceInteraction indirect_surface{};
 		bool indirect_hit_something = scene->trace_ray(indirect_ray, 0.f, std::numeric_limits<float>::infinity(), indirect_hit);
+		if (indirect_hit_something)
+			scene->resolve_hit(indirect_ray, indirect_hit, indirect_surface);
 		// BSDF-sampling strategy: if the scattered ray lands on *any* emitter, add its
 		// contribution weighted by MIS. This must cover every emitter, not just the one
 		// chosen for light sampling above, or multi-emitter scenes lose energy (and since
 		// emission is only added directly at depth 0, that energy is never recovered).
-		if (indirect_hit_something && indirect_hit.m_primitive_id != hit_result.m_primitive_id)
+		if (indirect_hit_something && !indirect_hit.is_same_primitive(hit_result))
 		{
-			auto& hit_material = m_pResourceManager->get_material(indirect_hit.m_material_id);
+			auto& hit_material = m_pResourceManager->get_material(indirect_surface.m_material_id);
 			if (hit_material->can_emit_light())
 			{
-				const CTriangle& hit_light = scene->get_area_light(indirect_hit.m_primitive_id);
-				float light_pdf = hit_light.pdf(hit_result.m_position, indirect_ray.m_direction);
+				float light_pdf = scene->get_area_light_pdf(indirect_hit, surface.m_position, indirect_ray.m_direction);
 				if (light_pdf > 0.f)
 				{
 					// Light-sampling pdf for this emitter = solid-angle pdf * 1/N selection prob.
 					float light_sampling_pdf = light_pdf * light_probability;
-					auto emittance = hit_material->emit(indirect_hit);
+					auto emittance = hit_material->emit(indirect_surface);
 					float weight = balance_heuristic(bsdf_pdf, light_sampling_pdf);
 					out_color += throughput * emittance * bsdf * cos_theta_i * weight / bsdf_pdf;
 				}
@@ -330,231 +854,289 @@ glm::vec3 CIntegrator::integrate_nee(CScene* scene, FRay ray, int32_t bounces, c
 
 		ray = indirect_ray;
 		hit_result = indirect_hit;
+		surface = indirect_surface;
 		hit_something = indirect_hit_something;
 	}
 
 	return out_color;
 }
 
-glm::vec3 CIntegrator::integrate(CScene* scene, FRay ray, int32_t bounces, const std::unique_ptr<CSamplerBase>& sampler, glm::vec3& surface_albedo, glm::vec3& surface_normal)
+glm::vec3 CIntegrator::integrate(CScene* scene, FRay ray, int32_t bounces, const std::unique_ptr<CSamplerBase>& sampler, glm::vec3& surface_albedo, glm::vec3& surface_normal, const FPrimaryHit* primary)
 {
-	glm::vec3 throughput{ 1.f };
-	glm::vec3 out_color{ 0.f };
-
-	// State for Beer-Lambert volumetric absorption: whether the current path segment is inside
-	// a transmissive medium and, if so, that medium's per-unit absorption coefficient.
-	bool inside_medium = false;
-	glm::vec3 medium_absorption{ 0.f };
-
-	FHitResult hit_result{};
-	auto hit_something = scene->trace_ray(ray, ray_delta, std::numeric_limits<float>::infinity(), hit_result);
+	// Traversal only produces the compact hit record; shading data is resolved once per hit.
+	// The primary hit may already be resolved from packet traversal.
+	FPathState path{};
+	begin_path(scene, path, ray, primary);
 
-	for (uint32_t depth = 0u; depth <= bounces; ++depth)
+	while (true)
 	{
-		if (!hit_something)
-		{
-			out_color += throughput * ray_color(ray, m_sky_begin, m_sky_end);
+		auto step = scatter(scene, path, *sampler, bounces);
+		if (step == EPathStep::eTerminated)
 			break;
-		}
-
-		auto& material = m_pResourceManager->get_material(hit_result.m_material_id);
-
-		// Emission is added directly only for the primary ray. Emitters reached by scattering
-		// are accounted for by the BSDF-sampling MIS term (below) at the previous bounce and by
-		// the area-light NEE term; re-adding them here at depth > 0 would double count.
-		if (material->can_emit_light() && depth == 0u)
-			out_color += throughput * material->emit(hit_result);
+		if (step == EPathStep::eContinued)
+			continue;
 
-		// Nothing left to scatter (pure emitter / fully absorbing): terminate the path.
-		if (!material->can_scatter_light())
+		path.m_next_hit = FHitResult{};
+		scene->trace_ray(path.m_next_ray, 0.f, std::numeric_limits<float>::infinity(), path.m_next_hit);
+		if (!advance(scene, path, *sampler))
 			break;
+	}
 
-		auto material_sample = sampler->sample_vec2();
+	surface_albedo += path.m_albedo;
+	surface_normal += path.m_normal;
+	return path.m_color;
+}
 
-		glm::vec4 diffuse = material->sample_diffuse_color(hit_result);
-		glm::vec2 mr = material->sample_surface_metallic_roughness(hit_result);
-		glm::vec3 normal = material->sample_surface_normal(hit_result);
+EPathStep CIntegrator::scatter(CScene* scene, FPathState& path, CSamplerBase& sampler, int32_t bounces, FShadowQueue* shadows, uint32_t path_index)
+{
+	if (path.m_depth > static_cast<uint32_t>(bounces))
+		return EPathStep::eTerminated;
 
-		// Orient the shading frame to the geometric *outward* normal rather than the
-		// ray-facing normal produced by set_face_normal(). The BSDF is two-sided (it keys the
-		// refraction index off the sign of cos_theta(wo)), so it needs a consistently oriented
-		// frame to distinguish a ray entering a medium (front face) from one leaving it (back
-		// face). Without this, glass->air refraction always used the wrong eta.
-		if (!hit_result.m_bFrontFace)
-			normal = -normal;
+	auto& ray = path.m_ray;
+	auto& surface = path.m_surface;
+	auto& throughput = path.m_throughput;
+	auto& out_color = path.m_color;
 
-		COrthonormalBasis basis(normal);
+	if (!path.m_hit.is_hit())
+	{
+		out_color += throughput * ray_color(ray, m_sky_begin, m_sky_end);
+		return EPathStep::eTerminated;
+	}
 
-		bool is_transparent = material->check_transparency(diffuse, material_sample.x);
+	auto& material = m_pResourceManager->get_material(surface.m_material_id);
 
-		if (depth == 0u)
-		{
-			surface_albedo += glm::vec3(diffuse);
-			surface_normal += normal;
-		}
+	// Emission is added directly only for the primary ray. Emitters reached by scattering
+	// are accounted for by the BSDF-sampling MIS term (in advance) at the previous bounce and by
+	// the area-light NEE term; re-adding them here at depth > 0 would double count.
+	if (material->can_emit_light() && path.m_depth == 0u)
+		out_color += throughput * material->emit(surface);
 
-		glm::vec3 wo = basis.to_local(glm::normalize(-ray.m_direction));
+	// Nothing left to scatter (pure emitter / fully absorbing): terminate the path.
+	if (!material->can_scatter_light())
+		return EPathStep::eTerminated;
 
-		// Alpha cut-out sample: the surface is see-through here, so it is neither shaded nor
-		// scattered — the ray continues straight through in the same direction.
-		if (is_transparent)
-		{
-			FHitResult next_hit{};
-			ray.m_origin = hit_result.m_position;
-			hit_something = scene->trace_ray(ray, ray_delta, std::numeric_limits<float>::infinity(), next_hit);
-			hit_result = next_hit;
-			continue;
-		}
+	auto material_sample = sampler.sample_vec2();
 
-		// ---- Next event estimation -----------------------------------------------------
+	glm::vec4 diffuse{ 0.f };
+	glm::vec2 mr{ 0.f };
+	glm::vec3 normal{ 0.f };
+	if (path.m_depth == 0u && path.m_primary && path.m_primary->m_sampled)
+	{
+		diffuse = path.m_primary->m_diffuse;
+		mr = path.m_primary->m_metallic_roughness;
+		normal = path.m_primary->m_normal;
+	}
+	else
+	{
+		diffuse = material->sample_diffuse_color(surface);
+		mr = material->sample_surface_metallic_roughness(surface);
+		normal = material->sample_surface_normal(surface);
+	}
 
-		// (1) Analytic lights (point / spot / directional). These are delta distributions:
-		//     BSDF sampling can never hit them, so their MIS weight is exactly 1.
-		float analytic_probability = scene->get_light_probability();
-		if (!std::isinf(analytic_probability))
-		{
-			auto* light = scene->get_light(scene->get_light_index(sampler->sample())).get();
+	// Orient the shading frame to the geometric *outward* normal rather than the
+	// ray-facing normal produced by set_face_normal(). The BSDF is two-sided (it keys the
+	// refraction index off the sign of cos_theta(wo)), so it needs a consistently oriented
+	// frame to distinguish a ray entering a medium (front face) from one leaving it (back
+	// face). Without this, glass->air refraction always used the wrong eta.
+	if (!surface.m_bFrontFace)
+		normal = -normal;
 
-			float light_pdf = light->get_pdf(hit_result);
-			glm::vec3 light_direction = light->get_direction(hit_result);
-			glm::vec3 wi = basis.to_local(light_direction);
+	COrthonormalBasis basis(normal);
 
-			float cos_theta_i = glm::abs(cos_theta(wi));
-			if (cos_theta_i > 0.f && light_pdf > 0.f)
-			{
-				FRay shadow_ray(hit_result.m_position + math::sign(cos_theta(wi)) * normal * ray_delta, light_direction);
-				FHitResult shadow_hit{};
+	bool is_transparent = material->check_transparency(diffuse, material_sample.x);
 
-				float distance = light->get_distance(hit_result);
-				bool occluded = scene->trace_ray(shadow_ray, 0.f, distance, shadow_hit);
+	if (path.m_depth == 0u)
+	{
+		path.m_albedo += glm::vec3(diffuse);
+		path.m_normal += normal;
+	}
 
-				// Alpha cut-out occluders don't cast a shadow for this sample.
-				if (occluded)
-				{
-					auto& s_material = m_pResourceManager->get_material(shadow_hit.m_material_id);
-					glm::vec4 s_diffuse = s_material->sample_diffuse_color(shadow_hit);
-					if (s_material->check_transparency(s_diffuse, sampler->sample()))
-						occluded = false;
-				}
+	glm::vec3 wo = basis.to_local(glm::normalize(-ray.m_direction));
 
-				if (!occluded)
-				{
-					float bsdf_pdf = material->pdf(wi, wo, normal, diffuse, mr);
-					if (bsdf_pdf > 0.f)
-					{
-						glm::vec3 bsdf = material->eval(wi, wo, normal, diffuse, mr);
-						glm::vec3 light_color = light->get_color(hit_result);
-						out_color += throughput * light_color * bsdf * cos_theta_i / (light_pdf * analytic_probability);
-					}
-				}
-			}
-		}
+	// Alpha cut-out sample: the surface is see-through here, so it is neither shaded nor
+	// scattered — the ray continues straight through in the same direction.
+	if (is_transparent)
+	{
+		ray.m_origin = surface.m_position;
+		path.m_hit = FHitResult{};
+		if (scene->trace_ray(ray, ray_delta, std::numeric_limits<float>::infinity(), path.m_hit))
+			scene->resolve_hit(ray, path.m_hit, surface);
+		++path.m_depth;
+		return EPathStep::eContinued;
+	}
 
-		// (2) Area lights (emissive geometry), sampled by solid angle and combined with BSDF
-		//     sampling via the balance heuristic.
-		float area_probability = scene->get_area_light_probability();
-		if (!std::isinf(area_probability))
+	// ---- Next event estimation -----------------------------------------------------
+
+	auto add_light_sample = [&](const FRay& shadow_ray, float distance, const glm::vec3& contribution, bool alpha_test)
 		{
-			size_t area_index = scene->get_area_light_index(sampler->sample());
-			const CTriangle& area_light = scene->get_area_light(area_index);
+			if (shadows)
+				shadows->push(path_index, shadow_ray, distance, contribution, alpha_test);
+			else if (!occluded(scene, shadow_ray, distance, alpha_test, sampler))
+				out_color += contribution;
+		};
+
+	// (1) Analytic lights (point / spot / directional). These are delta distributions:
+	//     BSDF sampling can never hit them, so their MIS weight is exactly 1.
+	float analytic_probability = scene->get_light_probability();
+	if (!std::isinf(analytic_probability))
+	{
+		auto* light = scene->get_light(scene->get_light_index(sampler.sample())).get();
 
-			float light_pdf{};
-			glm::vec3 light_dir = area_light.sample(hit_result.m_position, sampler->sample_vec2(), light_pdf);
-			glm::vec3 wi = basis.to_local(light_dir);
+		float light_pdf = light->get_pdf(surface);
+		glm::vec3 light_direction = light->get_direction(surface);
+		glm::vec3 wi = basis.to_local(light_direction);
 
-			float cos_theta_i = glm::abs(cos_theta(wi));
-			if (cos_theta_i > 0.f && light_pdf > 0.f)
+		float cos_theta_i = glm::abs(cos_theta(wi));
+		if (cos_theta_i > 0.f && light_pdf > 0.f)
+		{
+			float bsdf_pdf = material->pdf(wi, wo, normal, diffuse, mr);
+			if (bsdf_pdf > 0.f)
 			{
-				FRay shadow_ray(hit_result.m_position + math::sign(cos_theta(wi)) * normal * ray_delta, light_dir);
-				FHitResult light_hit{};
-				bool hit = scene->trace_ray(shadow_ray, 0.f, std::numeric_limits<float>::infinity(), light_hit);
-
-				if (hit && area_index == light_hit.m_primitive_id && light_hit.m_primitive_id != hit_result.m_primitive_id)
-				{
-					float bsdf_pdf = material->pdf(wi, wo, normal, diffuse, mr);
-					if (bsdf_pdf > 0.f)
-					{
-						auto& light_material = m_pResourceManager->get_material(area_light.get_material_id());
-						glm::vec3 emittance = light_material->emit(light_hit);
-						glm::vec3 bsdf = material->eval(wi, wo, normal, diffuse, mr);
-
-						// Combined light-sampling pdf includes the 1/N light-selection prob.
-						float light_sampling_pdf = light_pdf * area_probability;
-						float weight = balance_heuristic(light_sampling_pdf, bsdf_pdf);
-						out_color += throughput * emittance * bsdf * cos_theta_i * weight / light_sampling_pdf;
-					}
-				}
+				FRay shadow_ray(surface.m_position + math::sign(cos_theta(wi)) * normal * ray_delta, light_direction);
+				glm::vec3 bsdf = material->eval(wi, wo, normal, diffuse, mr);
+				glm::vec3 light_color = light->get_color(surface);
+				add_light_sample(shadow_ray, light->get_distance(surface), throughput * light_color * bsdf * cos_theta_i / (light_pdf * analytic_probability), true);
 			}
 		}
+	}
+
+	// (2) Area lights (emissive geometry), sampled by solid angle and combined with BSDF
+	//     sampling via the balance heuristic.
+	float area_probability = scene->get_area_light_probability();
+	if (!std::isinf(area_probability))
+	{
+		size_t area_index = scene->get_area_light_index(sampler.sample());
 
-		// ---- BSDF sampling (indirect bounce + BSDF-strategy MIS for area lights) --------
+		float light_pdf{};
+		FSurfaceInteraction light_hit{};
+		glm::vec3 light_dir = scene->sample_area_light(area_index, surface.m_position, sampler.sample_vec2(), light_pdf, light_hit);
+		glm::vec3 wi = basis.to_local(light_dir);
 
-		float bsdf_pdf{};
-		glm::vec3 wi = material->sample(wo, normal, material_sample, diffuse, mr, bsdf_pdf);
 		float cos_theta_i = glm::abs(cos_theta(wi));
-		if (cos_theta_i <= 0.f || bsdf_pdf <= 0.f)
-			break;
+		if (cos_theta_i > 0.f && light_pdf > 0.f && !light_hit.is_same_primitive(path.m_hit))
+		{
+			float bsdf_pdf = material->pdf(wi, wo, normal, diffuse, mr);
+			if (bsdf_pdf > 0.f)
+			{
+				FRay shadow_ray(surface.m_position + math::sign(cos_theta(wi)) * normal * ray_delta, light_dir);
 
-		glm::vec3 bsdf = material->eval(wi, wo, normal, diffuse, mr);
+				// The light point is known, so only visibility up to just short of it is needed.
+				float light_distance = glm::distance(shadow_ray.m_origin, light_hit.m_position) * (1.f - shadow_epsilon);
 
-		// A refraction event (wi on the opposite side of wo) crosses the surface, flipping
-		// whether the next segment is inside the medium; reflection keeps the same side. When
-		// entering a medium, adopt this material's absorption coefficient.
-		bool transmitted = !on_same_hemisphere(wi, wo);
-		glm::vec3 segment_absorption = medium_absorption;
-		if (transmitted && !inside_medium)
-			segment_absorption = material->get_absorption();
-		bool segment_inside = transmitted ? !inside_medium : inside_medium;
+				auto& light_material = m_pResourceManager->get_material(light_hit.m_material_id);
+				glm::vec3 emittance = light_material->emit(light_hit);
+				glm::vec3 bsdf = material->eval(wi, wo, normal, diffuse, mr);
 
-		FRay indirect_ray(hit_result.m_position + math::sign(cos_theta(wi)) * normal * ray_delta, basis.to_world(wi));
-		FHitResult indirect_hit{};
-		bool indirect_hit_something = scene->trace_ray(indirect_ray, 0.f, std::numeric_limits<float>::infinity(), indirect_hit);
-
-		// Beer-Lambert transmittance across the segment we are about to traverse, if it runs
-		// through an absorbing medium (thick / coloured glass darkens with depth).
-		glm::vec3 transmittance{ 1.f };
-		if (segment_inside && indirect_hit_something && glm::dot(segment_absorption, segment_absorption) > 0.f)
-			transmittance = glm::exp(-segment_absorption * indirect_hit.m_distance);
-
-		// If the scattered ray lands on an emitter, add its contribution with the MIS weight
-		// (the BSDF-sampling counterpart to the area-light NEE above).
-		if (indirect_hit_something && !std::isinf(area_probability) && indirect_hit.m_primitive_id != hit_result.m_primitive_id)
-		{
-			auto& hit_material = m_pResourceManager->get_material(indirect_hit.m_material_id);
-			if (hit_material->can_emit_light())
-			{
-				const CTriangle& hit_light = scene->get_area_light(indirect_hit.m_primitive_id);
-				float light_pdf = hit_light.pdf(hit_result.m_position, indirect_ray.m_direction);
-				if (light_pdf > 0.f)
-				{
-					float light_sampling_pdf = light_pdf * area_probability;
-					glm::vec3 emittance = hit_material->emit(indirect_hit);
-					float weight = balance_heuristic(bsdf_pdf, light_sampling_pdf);
-					out_color += throughput * transmittance * emittance * bsdf * cos_theta_i * weight / bsdf_pdf;
-				}
+				// Combined light-sampling pdf includes the 1/N light-selection prob.
+				float light_sampling_pdf = light_pdf * area_probability;
+				float weight = balance_heuristic(light_sampling_pdf, bsdf_pdf);
+				add_light_sample(shadow_ray, light_distance, throughput * emittance * bsdf * cos_theta_i * weight / light_sampling_pdf, false);
 			}
 		}
+	}
 
-		throughput *= bsdf * cos_theta_i / bsdf_pdf * transmittance;
+	// ---- BSDF sampling (indirect bounce + BSDF-strategy MIS for area lights) --------
+
+	float bsdf_pdf{};
+	glm::vec3 wi = material->sample(wo, normal, material_sample, diffuse, mr, bsdf_pdf);
+	float cos_theta_i = glm::abs(cos_theta(wi));
+	if (cos_theta_i <= 0.f || bsdf_pdf <= 0.f)
+		return EPathStep::eTerminated;
+
+	// A refraction event (wi on the opposite side of wo) crosses the surface, flipping
+	// whether the next segment is inside the medium; reflection keeps the same side. When
+	// entering a medium, adopt this material's absorption coefficient.
+	bool transmitted = !on_same_hemisphere(wi, wo);
+	path.m_segment_absorption = path.m_medium_absorption;
+	if (transmitted && !path.m_inside_medium)
+		path.m_segment_absorption = material->get_absorption();
+	path.m_segment_inside = transmitted ? !path.m_inside_medium : path.m_inside_medium;
+
+	path.m_bsdf = material->eval(wi, wo, normal, diffuse, mr);
+	path.m_bsdf_pdf = bsdf_pdf;
+	path.m_cos_theta = cos_theta_i;
+	path.m_next_ray = FRay(surface.m_position + math::sign(cos_theta(wi)) * normal * ray_delta, basis.to_world(wi));
+	return EPathStep::eScattered;
+}
 
-		inside_medium = segment_inside;
-		medium_absorption = segment_absorption;
+bool CIntegrator::occluded(CScene* scene, const FRay& ray, float distance, bool alpha_test, CSamplerBase& sampler)
+{
+	if (!scene->occluded(ray, 0.f, distance))
+		return false;
 
-		float rr_prob = glm::min(0.95f, math::max_component(throughput));
-		if (depth >= m_rrThreshold)
+	// Alpha cut-out occluders don't cast a shadow for this sample. The any-hit query can't see
+	// materials, so only then resolve the closest occluder and inspect it.
+	if (alpha_test && scene->has_alpha_cutouts())
+	{
+		FHitResult shadow_hit{};
+		FSurfaceInteraction shadow_surface{};
+		scene->trace_ray(ray, 0.f, distance, shadow_hit);
+		scene->resolve_hit(ray, shadow_hit, shadow_surface);
+
+		auto& material = m_pResourceManager->get_material(shadow_surface.m_material_id);
+		glm::vec4 diffuse = material->sample_diffuse_color(shadow_surface);
+		if (material->check_transparency(diffuse, sampler.sample()))
+			return false;
+	}
+
+	return true;
+}
+
+bool CIntegrator::advance(CScene* scene, FPathState& path, CSamplerBase& sampler)
+{
+	auto& indirect_ray = path.m_next_ray;
+	auto& indirect_hit = path.m_next_hit;
+	auto& throughput = path.m_throughput;
+
+	FSurfaceInteraction indirect_surface{};
+	bool indirect_hit_something = indirect_hit.is_hit();
+	if (indirect_hit_something)
+		scene->resolve_hit(indirect_ray, indirect_hit, indirect_surface);
+
+	// Beer-Lambert transmittance across the segment we are about to traverse, if it runs
+	// through an absorbing medium (thick / coloured glass darkens with depth).
+	glm::vec3 transmittance{ 1.f };
+	if (path.m_segment_inside && indirect_hit_something && glm::dot(path.m_segment_absorption, path.m_segment_absorption) > 0.f)
+		transmittance = glm::exp(-path.m_segment_absorption * indirect_hit.m_distance);
+
+	// If the scattered ray lands on an emitter, add its contribution with the MIS weight
+	// (the BSDF-sampling counterpart to the area-light NEE in scatter). Emitters light sampling
+	// can't reach, like analytic shapes, have a light pdf of 0 and so get the full weight.
+	float area_probability = scene->get_area_light_probability();
+	if (indirect_hit_something && !indirect_hit.is_same_primitive(path.m_hit))
+	{
+		auto& hit_material = m_pResourceManager->get_material(indirect_surface.m_material_id);
+		if (hit_material->can_emit_light())
 		{
-			if (sampler->sample() > rr_prob)
-				break;
+			float light_sampling_pdf{ 0.f };
+			if (!std::isinf(area_probability))
+				light_sampling_pdf = scene->get_area_light_pdf(indirect_hit, path.m_surface.m_position, indirect_ray.m_direction) * area_probability;
 
-			throughput /= rr_prob;
+			glm::vec3 emittance = hit_material->emit(indirect_surface);
+			float weight = balance_heuristic(path.m_bsdf_pdf, light_sampling_pdf);
+			path.m_color += throughput * transmittance * emittance * path.m_bsdf * path.m_cos_theta * weight / path.m_bsdf_pdf;
 		}
+	}
 
-		ray = indirect_ray;
-		hit_result = indirect_hit;
-		hit_something = indirect_hit_something;
+	throughput *= path.m_bsdf * path.m_cos_theta / path.m_bsdf_pdf * transmittance;
+
+	path.m_inside_medium = path.m_segment_inside;
+	path.m_medium_absorption = path.m_segment_absorption;
+
+	float rr_prob = glm::min(0.95f, math::max_component(throughput));
+	if (path.m_depth >= m_rrThreshold)
+	{
+		if (sampler.sample() > rr_prob)
+			return false;
+
+		throughput /= rr_prob;
 	}
 
-	return out_color;
+	path.m_ray = indirect_ray;
+	path.m_hit = indirect_hit;
+	path.m_surface = indirect_surface;
+	++path.m_depth;
+	return true;
 }
 
 const std::unique_ptr<CFramebuffer>& CIntegrator::get_framebuffer() const
@@ -562,7 +1144,17 @@ const std::unique_ptr<CFramebuffer>& CIntegrator::get_framebuffer() const
 	return m_pFramebuffer;
 }
 
-const std::vector<uint32_t>& CIntegrator::get_pixel_iterator() const
+EIntegratorMode CIntegrator::get_mode() const
+{
+	return m_mode;
+}
+
+void CIntegrator::set_mode(EIntegratorMode mode)
+{
+	m_mode = mode;
+}
+
+uint64_t CIntegrator::get_traced_samples() const
 {
-	return m_pixelIterator;
+	return m_traced_samples.load(std::memory_order_relaxed);
 }
\ No newline at end of file
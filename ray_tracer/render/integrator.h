@@ -4,9 +4,165 @@
 #include "framebuffer.h"
 #include "shared.h"
 #include "rsampler.h"
+#include "tile_scheduler.h"
+#include "pixel_filter.h"
 
 class CResourceManager;
 
+// Shading inputs of a pixel's primary hit. Without subpixel jitter every sample of a pixel starts
+// with the same camera ray, so its hit is resolved and its material textures sampled only once.
+struct FPrimaryHit
+{
+	FRay m_ray{};
+	FHitResult m_hit{};
+	FSurfaceInteraction m_surface{};
+
+	// Material samples at the hit, only set when the material scatters light
+	glm::vec4 m_diffuse{ 0.f };
+	glm::vec2 m_metallic_roughness{ 0.f };
+	glm::vec3 m_normal{ 0.f };
+	bool m_sampled{ false };
+};
+
+// Per-path state carried between bounces, so paths can be advanced one bounce at a time and
+// their scattered rays traced in batches.
+struct FPathState
+{
+	FRay m_ray{};
+	FHitResult m_hit{};
+	FSurfaceInteraction m_surface{};
+
+	glm::vec3 m_throughput{ 1.f };
+	glm::vec3 m_color{ 0.f };
+	glm::vec3 m_albedo{ 0.f };
+	glm::vec3 m_normal{ 0.f };
+	uint32_t m_depth{ 0u };
+
+	// Beer-Lambert volumetric absorption: whether the current segment is inside a
+	// transmissive medium and, if so, that medium's per-unit absorption coefficient.
+	bool m_inside_medium{ false };
+	glm::vec3 m_medium_absorption{ 0.f };
+
+	// Cached shading inputs used at depth 0 instead of sampling the material again
+	const FPrimaryHit* m_primary{ nullptr };
+
+	// Scattered ray chosen by scatter and its closest hit, consumed by advance
+	FRay m_next_ray{};
+	FHitResult m_next_hit{};
+	glm::vec3 m_bsdf{ 0.f };
+	float m_bsdf_pdf{ 0.f };
+	float m_cos_theta{ 0.f };
+	glm::vec3 m_segment_absorption{ 0.f };
+	bool m_segment_inside{ false };
+
+	// Traversal work of the sample, only counted with BVH_TRAVERSAL_STATS
+	uint32_t m_traversal_cost{ 0u };
+};
+
+enum class EPathStep
+{
+	eTerminated,
+	// Passed through an alpha cut-out, m_hit already holds the continuation
+	eContinued,
+	// m_next_ray needs to be traced before advance
+	eScattered
+};
+
+// Running sums of one pixel over its samples
+struct FPixelAccumulator
+{
+	glm::vec3 m_color{ 0.f };
+	glm::vec3 m_albedo{ 0.f };
+	glm::vec3 m_normal{ 0.f };
+	uint32_t m_count{ 0u };
+	float m_s1{ 0.f };
+	float m_s2{ 0.f };
+	uint64_t m_traversal_cost{ 0u };
+};
+
+// Closest-hit rays of the wavefront extend stage and the paths they continue
+struct FExtendQueue
+{
+	std::vector<uint32_t> m_paths{};
+	std::vector<FRay> m_rays{};
+	std::vector<FHitResult> m_hits{};
+
+	void push(uint32_t path, const FRay& ray)
+	{
+		m_paths.emplace_back(path);
+		m_rays.emplace_back(ray);
+	}
+
+	void clear()
+	{
+		m_paths.clear();
+		m_rays.clear();
+	}
+
+	size_t size() const { return m_paths.size(); }
+};
+
+// Shadow rays of light samples. A sample's contribution is added to its path once its ray turns
+// out unoccluded.
+struct FShadowQueue
+{
+	std::vector<uint32_t> m_paths{};
+	std::vector<FRay> m_rays{};
+	std::vector<float> m_distances{};
+	std::vector<glm::vec3> m_contributions{};
+	// Analytic light samples see through alpha cut-out occluders
+	std::vector<uint8_t> m_alpha_tests{};
+
+	void push(uint32_t path, const FRay& ray, float distance, const glm::vec3& contribution, bool alpha_test)
+	{
+		m_paths.emplace_back(path);
+		m_rays.emplace_back(ray);
+		m_distances.emplace_back(distance);
+		m_contributions.emplace_back(contribution);
+		m_alpha_tests.emplace_back(alpha_test ? 1u : 0u);
+	}
+
+	void clear()
+	{
+		m_paths.clear();
+		m_rays.clear();
+		m_distances.clear();
+		m_contributions.clear();
+		m_alpha_tests.clear();
+	}
+
+	size_t size() const { return m_paths.size(); }
+};
+
+// Wavefront mode state of one tile. The queues between the stages are structures of arrays, so
+// each stage streams through only the fields it reads.
+struct FWavefrontQueues
+{
+	// Per pixel of the tile
+	std::vector<uint32_t> m_pixels{};
+	std::vector<FPrimaryHit> m_primaries{};
+	std::vector<FPathState> m_paths{};
+	std::vector<CCMJSampler> m_samplers{};
+	std::vector<FPixelAccumulator> m_accumulators{};
+	std::vector<uint32_t> m_pending{};
+
+	FExtendQueue m_extend{};
+	// Material id in the high half, path in the low half, sorted so each material is shaded in one run
+	std::vector<uint64_t> m_shade{};
+	FShadowQueue m_shadow{};
+	// Ray bin keys of the traversal stages
+	std::vector<uint64_t> m_keys{};
+};
+
+// State owned by one render thread, indexed by its CThreadPool worker index. The wavefront
+// queues keep their memory from tile to tile.
+struct FRenderScratch
+{
+	std::unique_ptr<CSamplerBase> m_pSampler{};
+	std::unique_ptr<CSamplerBase> m_pPreviewSampler{};
+	FWavefrontQueues m_wavefront{};
+};
+
 class CIntegrator
 {
 public:
@@ -23,11 +179,52 @@ public:
 	void render_preview(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, uint32_t frame_index, uint32_t bounces);
 
 	const std::unique_ptr<CFramebuffer>& get_framebuffer() const;
-	const std::vector<uint32_t>& get_pixel_iterator() const;
+
+	EIntegratorMode get_mode() const;
+	void set_mode(EIntegratorMode mode);
+	// Samples accumulated by the last trace_ray
+	uint64_t get_traced_samples() const;
 private:
-	void trace_ray(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, uint32_t ray_index);
+	// primary, if given, is the resolved hit of the pixel's camera ray and is shared by all samples
+	void trace_ray(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, uint32_t ray_index, const FPrimaryHit* primary, const std::unique_ptr<CSamplerBase>& sampler);
+	// Traces the primary rays of the pixels [min, max) as a packet. Returns the number of rays, pixels receives their pixel indices.
+	uint32_t trace_primary(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, const glm::uvec2& min, const glm::uvec2& max, FRayPacket& packet, uint32_t* pixels) const;
+	// Lists the pixels of a tile and starts their accumulators. With the primary hit cache their
+	// camera rays are traced as packets and resolved into primaries, each pixel charged its ray once.
+	void prepare_tile(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, const FTile& tile, std::vector<uint32_t>& pixels, std::vector<FPrimaryHit>& primaries, std::vector<FPixelAccumulator>& accumulators) const;
+	void resolve_primary(CScene* scene, const FRay& ray, const FHitResult& hit, FPrimaryHit& primary) const;
+	// Starts a path at a cached primary hit, or traces the camera ray when primary is null
+	void begin_path(CScene* scene, FPathState& path, const FRay& ray, const FPrimaryHit* primary) const;
+	// Camera ray of the current sample of pixel, jittered over the filter with antialiasing
+	FRay generate_ray(FCameraComponent* camera, const glm::vec3& origin, uint32_t pixel, CSamplerBase& sampler) const;
+	bool use_primary_cache() const;
 	glm::vec3 integrate_nee(CScene* scene, FRay ray, int32_t bounces, const std::unique_ptr<CSamplerBase>& sampler, glm::vec3& surface_albedo, glm::vec3& surface_normal);
-	glm::vec3 integrate(CScene* scene, FRay ray, int32_t bounces, const std::unique_ptr<CSamplerBase>& sampler, glm::vec3& surface_albedo, glm::vec3& surface_normal);
+	// primary, if given, holds the resolved closest hit of ray and is used instead of tracing it again
+	glm::vec3 integrate(CScene* scene, FRay ray, int32_t bounces, const std::unique_ptr<CSamplerBase>& sampler, glm::vec3& surface_albedo, glm::vec3& surface_normal, const FPrimaryHit* primary = nullptr);
+
+	// One bounce of integrate, split around tracing the scattered ray. scatter shades the current
+	// hit and picks m_next_ray; advance consumes m_next_hit and returns false once the path ends.
+	// With shadows, light samples are queued there for path_index instead of being traced.
+	EPathStep scatter(CScene* scene, FPathState& path, CSamplerBase& sampler, int32_t bounces, FShadowQueue* shadows = nullptr, uint32_t path_index = 0u);
+	bool advance(CScene* scene, FPathState& path, CSamplerBase& sampler);
+	// Visibility of a light sample up to distance. With alpha_test, cut-out occluders the sampler
+	// finds transparent don't cast a shadow.
+	bool occluded(CScene* scene, const FRay& ray, float distance, bool alpha_test, CSamplerBase& sampler);
+
+	// Stream mode: all samples of a tile are advanced bounce by bounce, and each bounce's
+	// scattered rays are sorted by direction octant and origin cell and traced as packets.
+	void trace_stream(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, const FTile& tile);
+	void trace_scattered(CScene* scene, std::vector<FPathState>& paths, const std::vector<uint32_t>& active) const;
+
+	// Wavefront mode: the paths of a tile run through generate, extend, shade and shadow stages,
+	// each over all paths at once. Shading is grouped by material.
+	void trace_wavefront(CScene* scene, FCameraComponent* camera, const glm::vec3& origin, const FTile& tile, FWavefrontQueues& queues);
+	void trace_extend(CScene* scene, FWavefrontQueues& queues, float t_min) const;
+	void trace_shadows(CScene* scene, FWavefrontQueues& queues);
+
+	// Adds a sample, returns true once the pixel has enough samples
+	bool accumulate(FPixelAccumulator& pixel, const glm::vec3& color, const glm::vec3& albedo, const glm::vec3& normal) const;
+	void write_pixel(uint32_t x, uint32_t y, const FPixelAccumulator& pixel);
 private:
 	CResourceManager* m_pResourceManager{ nullptr };
 	std::unique_ptr<CFramebuffer> m_pFramebuffer{};
@@ -38,10 +235,21 @@ private:
 	uint32_t m_sampleCount{ 1u };
 	uint32_t m_bounceCount{ 1u };
 	uint32_t m_rrThreshold{ 3u };
+	EIntegratorMode m_mode{ EIntegratorMode::ePath };
+	bool m_primary_hit_cache{ true };
+
+	// Film
+	bool m_antialiasing{ false };
+	CPixelFilter m_filter{};
 
 	// Estimator
 	bool m_use_estimator{ false };
 	float m_estimator_tolerance{ 0.05f };
 
-	std::vector<uint32_t> m_pixelIterator{};
+	CTileScheduler m_scheduler{};
+	std::vector<FRenderScratch> m_vScratch{};
+	uint32_t m_tile_size{ 32u };
+	ETileOrder m_tile_order{ ETileOrder::eHilbert };
+
+	std::atomic<uint64_t> m_traced_samples{ 0ull };
 };
\ No newline at end of file
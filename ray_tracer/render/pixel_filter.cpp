@@ -0,0 +1,91 @@
+#include "pixel_filter.h"
+
+namespace
+{
+	constexpr const uint32_t filter_table_size{ 64u };
+
+	float default_radius(EPixelFilter filter)
+	{
+		switch (filter)
+		{
+		case EPixelFilter::eTent: return 1.f;
+		case EPixelFilter::eGaussian: return 1.5f;
+		case EPixelFilter::eBlackmanHarris: return 2.f;
+		default: return 0.5f;
+		}
+	}
+}
+
+void CPixelFilter::create(EPixelFilter filter, float radius)
+{
+	m_filter = filter;
+	m_radius = radius > 0.f ? radius : default_radius(filter);
+
+	// Midpoint rule per bin, the pdf is constant within a bin
+	m_vCdf.resize(filter_table_size + 1u);
+	m_vCdf[0] = 0.f;
+	for (uint32_t bin = 0u; bin < filter_table_size; ++bin)
+	{
+		float x = m_radius * (2.f * (bin + 0.5f) / filter_table_size - 1.f);
+		m_vCdf[bin + 1u] = m_vCdf[bin] + glm::max(evaluate(x), 0.f);
+	}
+
+	auto total = m_vCdf.back();
+	for (auto& value : m_vCdf)
+		value = total > 0.f ? value / total : 0.f;
+	m_vCdf.back() = 1.f;
+}
+
+glm::vec2 CPixelFilter::sample(const glm::vec2& u) const
+{
+	return glm::vec2(sample_1d(u.x), sample_1d(u.y));
+}
+
+EPixelFilter CPixelFilter::get_filter() const
+{
+	return m_filter;
+}
+
+float CPixelFilter::get_radius() const
+{
+	return m_radius;
+}
+
+float CPixelFilter::evaluate(float x) const
+{
+	x = glm::abs(x);
+	if (x > m_radius)
+		return 0.f;
+
+	switch (m_filter)
+	{
+	case EPixelFilter::eTent:
+		return m_radius - x;
+	case EPixelFilter::eGaussian:
+	{
+		// Three standard deviations fit the radius, shifted to reach zero at its edge
+		float sigma = m_radius / 3.f;
+		auto gaussian = [sigma](float v) { return glm::exp(-v * v / (2.f * sigma * sigma)); };
+		return gaussian(x) - gaussian(m_radius);
+	}
+	case EPixelFilter::eBlackmanHarris:
+	{
+		// Four-term window over [-radius, radius]
+		float t = 2.f * std::numbers::pi_v<float> * (x + m_radius) / (2.f * m_radius);
+		return 0.35875f - 0.48829f * glm::cos(t) + 0.14128f * glm::cos(2.f * t) - 0.01168f * glm::cos(3.f * t);
+	}
+	default:
+		return 1.f;
+	}
+}
+
+float CPixelFilter::sample_1d(float u) const
+{
+	// Bin whose CDF range holds u, then linear within it
+	auto it = std::upper_bound(m_vCdf.begin(), m_vCdf.end(), u);
+	auto bin = static_cast<uint32_t>(glm::clamp<ptrdiff_t>(std::distance(m_vCdf.begin(), it) - 1, 0, filter_table_size - 1u));
+
+	float width = m_vCdf[bin + 1u] - m_vCdf[bin];
+	float offset = width > 0.f ? (u - m_vCdf[bin]) / width : 0.5f;
+	return m_radius * (2.f * (bin + offset) / filter_table_size - 1.f);
+}
\ No newline at end of file
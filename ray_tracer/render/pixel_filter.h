@@ -0,0 +1,27 @@
+#pragma once
+
+#include <configuration.h>
+
+// Reconstruction filter of the film. Camera ray offsets are importance sampled from the filter,
+// so every sample carries the same weight and pixels keep averaging their samples. Filters are
+// the product of two 1D ones, each sampled by inverting its tabulated CDF.
+class CPixelFilter
+{
+public:
+	// radius 0 uses the filter's default
+	void create(EPixelFilter filter, float radius);
+
+	// Offset from the pixel center in pixels for a uniform sample in [0, 1)^2
+	glm::vec2 sample(const glm::vec2& u) const;
+
+	EPixelFilter get_filter() const;
+	float get_radius() const;
+private:
+	float evaluate(float x) const;
+	float sample_1d(float u) const;
+
+	EPixelFilter m_filter{ EPixelFilter::eBox };
+	float m_radius{ 0.5f };
+	// CDF at the edges of equal width bins over [-radius, radius]
+	std::vector<float> m_vCdf{};
+};
\ No newline at end of file
@@ -133,6 +133,9 @@ void run_preview(CRayEngine* engine)
 
 	std::vector<uint32_t> display(static_cast<size_t>(preview_width) * preview_height);
 
+	// The scene was built with the preview builder; the first full render rebuilds it with the final one.
+	bool final_tree = config.m_bvhcfg.m_preview_builder == config.m_bvhcfg.m_builder;
+
 	uint32_t frame_index = 0u;
 	bool need_reset = true;
 
@@ -248,6 +251,12 @@ void run_preview(CRayEngine* engine)
 		{
 			log_info("Starting full-quality render ({} spp)...", config.m_icfg.m_sample_count);
 
+			if (!final_tree)
+			{
+				scene->build_acceleration(config.m_bvhcfg);
+				final_tree = true;
+			}
+
 			auto full_extent = full_renderer->get_framebuffer()->get_extent();
 
 			camera->m_bWasMoved = true;
@@ -0,0 +1,175 @@
+#include "tile_scheduler.h"
+#include "thread_pool.h"
+
+namespace
+{
+	uint64_t pack(uint32_t begin, uint32_t end)
+	{
+		return static_cast<uint64_t>(begin) << 32u | end;
+	}
+
+	// Spreads the low 16 bits of value to the even bits
+	uint32_t expand_bits_2d(uint32_t value)
+	{
+		value &= 0x0000FFFFu;
+		value = (value | (value << 8u)) & 0x00FF00FFu;
+		value = (value | (value << 4u)) & 0x0F0F0F0Fu;
+		value = (value | (value << 2u)) & 0x33333333u;
+		value = (value | (value << 1u)) & 0x55555555u;
+		return value;
+	}
+
+	uint32_t morton_index(uint32_t x, uint32_t y)
+	{
+		return (expand_bits_2d(y) << 1u) | expand_bits_2d(x);
+	}
+
+	// Distance of (x, y) along the Hilbert curve filling a side x side grid, side a power of two
+	uint64_t hilbert_index(uint32_t side, uint32_t x, uint32_t y)
+	{
+		uint64_t index{ 0ull };
+		for (uint32_t s = side / 2u; s > 0u; s /= 2u)
+		{
+			uint32_t rx = (x & s) > 0u ? 1u : 0u;
+			uint32_t ry = (y & s) > 0u ? 1u : 0u;
+			index += static_cast<uint64_t>(s) * s * ((3u * rx) ^ ry);
+
+			// Rotate the quadrant so the curve continues where the previous one ended
+			if (ry == 0u)
+			{
+				if (rx == 1u)
+				{
+					x = side - 1u - x;
+					y = side - 1u - y;
+				}
+				std::swap(x, y);
+			}
+		}
+		return index;
+	}
+}
+
+void CTileScheduler::create(const glm::uvec2& extent, uint32_t tile_size, ETileOrder order)
+{
+	tile_size = glm::max(tile_size, 1u);
+	auto deque_count = CThreadPool::getInstance()->worker_count();
+	if (!m_vTiles.empty() && m_extent == extent && m_tile_size == tile_size && m_order == order && m_deque_count == deque_count)
+		return;
+
+	m_extent = extent;
+	m_tile_size = tile_size;
+	m_order = order;
+
+	glm::uvec2 tiles = (extent + tile_size - 1u) / tile_size;
+	uint32_t side{ 1u };
+	while (side < glm::max(tiles.x, tiles.y))
+		side *= 2u;
+
+	std::vector<std::pair<uint64_t, FTile>> ordered{};
+	ordered.reserve(tiles.x * tiles.y);
+	for (uint32_t y = 0u; y < tiles.y; ++y)
+	{
+		for (uint32_t x = 0u; x < tiles.x; ++x)
+		{
+			uint64_t key{ 0ull };
+			switch (order)
+			{
+			case ETileOrder::eMorton: key = morton_index(x, y); break;
+			case ETileOrder::eHilbert: key = hilbert_index(side, x, y); break;
+			default: key = y * tiles.x + x; break;
+			}
+
+			FTile tile{};
+			tile.m_min = glm::uvec2(x, y) * tile_size;
+			tile.m_max = glm::min(tile.m_min + tile_size, extent);
+			ordered.emplace_back(key, tile);
+		}
+	}
+	std::sort(ordered.begin(), ordered.end(), [](const auto& lhs, const auto& rhs) { return lhs.first < rhs.first; });
+
+	m_vTiles.clear();
+	m_vTiles.reserve(ordered.size());
+	for (auto& [key, tile] : ordered)
+		m_vTiles.emplace_back(tile);
+
+	// One deque per thread able to take part
+	m_deque_count = deque_count;
+	m_pDeques = std::make_unique<FTileDeque[]>(m_deque_count);
+}
+
+void CTileScheduler::run(const std::function<void(const FTile&, uint32_t)>& function)
+{
+	auto tile_count = static_cast<uint64_t>(m_vTiles.size());
+	for (uint32_t deque = 0u; deque < m_deque_count; ++deque)
+	{
+		auto begin = static_cast<uint32_t>(tile_count * deque / m_deque_count);
+		auto end = static_cast<uint32_t>(tile_count * (deque + 1u) / m_deque_count);
+		m_pDeques[deque].m_range.store(pack(begin, end), std::memory_order_relaxed);
+	}
+
+	CThreadPool::getInstance()->parallel_for(m_deque_count,
+		[this, &function](size_t deque, uint32_t worker)
+		{
+			uint32_t tile{ 0u };
+			while (pop(static_cast<uint32_t>(deque), tile) || steal(static_cast<uint32_t>(deque), tile))
+				function(m_vTiles[tile], worker);
+		});
+}
+
+bool CTileScheduler::pop(uint32_t deque_index, uint32_t& tile)
+{
+	auto& deque = m_pDeques[deque_index];
+	auto range = deque.m_range.load(std::memory_order_relaxed);
+	while (true)
+	{
+		auto begin = static_cast<uint32_t>(range >> 32u);
+		auto end = static_cast<uint32_t>(range);
+		if (begin >= end)
+			return false;
+
+		if (deque.m_range.compare_exchange_weak(range, pack(begin + 1u, end), std::memory_order_relaxed))
+		{
+			tile = begin;
+			return true;
+		}
+	}
+}
+
+bool CTileScheduler::steal(uint32_t deque, uint32_t& tile)
+{
+	// Victims are visited starting after the thief, so thieves spread over the deques
+	for (uint32_t offset = 1u; offset < m_deque_count; ++offset)
+	{
+		auto& victim = m_pDeques[(deque + offset) % m_deque_count];
+		auto range = victim.m_range.load(std::memory_order_relaxed);
+		while (true)
+		{
+			auto begin = static_cast<uint32_t>(range >> 32u);
+			auto end = static_cast<uint32_t>(range);
+			if (begin >= end)
+				break;
+
+			// The back half, including the last tile when only one is left
+			auto split = begin + (end - begin) / 2u;
+			if (victim.m_range.compare_exchange_weak(range, pack(begin, split), std::memory_order_relaxed))
+			{
+				// The own deque is empty, so no thief can be racing for it. Ranges only ever hold
+				// unclaimed tiles, so a stale compare-exchange on it can not match the new range.
+				m_pDeques[deque].m_range.store(pack(split + 1u, end), std::memory_order_relaxed);
+				tile = split;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+size_t CTileScheduler::size() const
+{
+	return m_vTiles.size();
+}
+
+const glm::uvec2& CTileScheduler::get_extent() const
+{
+	return m_extent;
+}
\ No newline at end of file
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <configuration.h>
+
+#include <atomic>
+#include <functional>
+
+// Screen rectangle [m_min, m_max) of one scheduled tile
+struct FTile
+{
+	glm::uvec2 m_min{ 0u };
+	glm::uvec2 m_max{ 0u };
+};
+
+// Splits the viewport into square tiles, orders them along a space-filling curve and hands them
+// out to workers. Every worker starts on its own contiguous run of the curve, so the tiles one
+// thread renders in a row are neighbours on screen and share geometry and texture cache lines.
+// A worker pops tiles from the front of its deque and, once it is empty, steals the back half of
+// another worker's.
+class CTileScheduler
+{
+public:
+	void create(const glm::uvec2& extent, uint32_t tile_size, ETileOrder order);
+
+	// Calls function(tile, worker) once per tile on the thread pool, returns when every tile is
+	// done. worker is the CThreadPool index of the calling thread.
+	void run(const std::function<void(const FTile&, uint32_t)>& function);
+
+	size_t size() const;
+	const glm::uvec2& get_extent() const;
+private:
+	// Unclaimed tiles [begin, end) of the curve, packed as begin << 32 | end so that popping and
+	// stealing are a single compare-exchange. Own cache line, owners poll it on every tile.
+	struct alignas(64) FTileDeque
+	{
+		std::atomic<uint64_t> m_range{ 0ull };
+	};
+
+	bool pop(uint32_t deque, uint32_t& tile);
+	bool steal(uint32_t deque, uint32_t& tile);
+
+	std::vector<FTile> m_vTiles{};
+	std::unique_ptr<FTileDeque[]> m_pDeques{};
+	uint32_t m_deque_count{ 0u };
+
+	glm::uvec2 m_extent{ 0u };
+	uint32_t m_tile_size{ 0u };
+	ETileOrder m_order{ ETileOrder::eHilbert };
+};
\ No newline at end of file
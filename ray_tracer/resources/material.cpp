@@ -43,11 +43,11 @@ glm::vec3 CMaterial::get_absorption() const
 	return -glm::log(color) / m_attenuationDistance;
 }
 
-glm::vec3 CMaterial::emit(const FHitResult& hit_result) const
+glm::vec3 CMaterial::emit(const FSurfaceInteraction& surface) const
 {
 	glm::vec3 emission{ m_emissive };
 	if (m_textures.count(ETextureType::eEmission))
-		emission *= glm::vec3(srgb_to_linear(sample_texture(ETextureType::eEmission, hit_result.m_texcoord)));
+		emission *= glm::vec3(srgb_to_linear(sample_texture(ETextureType::eEmission, surface.m_texcoord)));
 
 	return emission * m_emissionStrength;
 }
@@ -177,25 +177,25 @@ float CMaterial::pdf(const glm::vec3& wi, const glm::vec3& wo, const glm::vec3&
 	return diffuse_weight * cosine_weighted_pdf(wi, wo) + specular_weight * ggx_vndf_reflection_pdf(wi, wo, n, metallicRoughness.g) + transmission_weight * ggx_vndf_transmission_pdf(wi, wo, eta, metallicRoughness.g);
 }
 
-glm::vec3 CMaterial::sample_surface_normal(const FHitResult& hit_result) const
+glm::vec3 CMaterial::sample_surface_normal(const FSurfaceInteraction& surface) const
 {
-	return sample_tangent_space_normal(hit_result.m_texcoord, hit_result.m_tangent, hit_result.m_bitangent, hit_result.m_normal);
+	return sample_tangent_space_normal(surface.m_texcoord, surface.m_tangent, surface.m_bitangent, surface.m_normal);
 }
 
-glm::vec4 CMaterial::sample_diffuse_color(const FHitResult& hit_result)
+glm::vec4 CMaterial::sample_diffuse_color(const FSurfaceInteraction& surface)
 {
-	auto diffuse = m_albedo * glm::vec4(hit_result.m_color, 1.f);
+	auto diffuse = m_albedo * glm::vec4(surface.m_color, 1.f);
 	if (m_textures.count(ETextureType::eAlbedo))
-		diffuse *= srgb_to_linear(sample_texture(ETextureType::eAlbedo, hit_result.m_texcoord));
+		diffuse *= srgb_to_linear(sample_texture(ETextureType::eAlbedo, surface.m_texcoord));
 	return diffuse;
 }
 
-glm::vec2 CMaterial::sample_surface_metallic_roughness(const FHitResult& hit_result) const
+glm::vec2 CMaterial::sample_surface_metallic_roughness(const FSurfaceInteraction& surface) const
 {
 	glm::vec2 mr{ m_metallic, m_roughness };
 	if (m_textures.count(ETextureType::eMetallRoughness))
 	{
-		auto sampled_mr = sample_texture(ETextureType::eMetallRoughness, hit_result.m_texcoord);
+		auto sampled_mr = sample_texture(ETextureType::eMetallRoughness, surface.m_texcoord);
 
 		mr.y = mr.y * sampled_mr.g;
 		mr.x = mr.x * sampled_mr.b;
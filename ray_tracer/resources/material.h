@@ -88,7 +88,7 @@ public:
 
 	void create(const FMaterialCreateInfo& createInfo);
 
-	glm::vec3 emit(const FHitResult& hit_result) const;
+	glm::vec3 emit(const FSurfaceInteraction& surface) const;
 	bool can_emit_light() const;
 	bool can_scatter_light() const;
 	bool can_refract_light() const;
@@ -102,9 +102,9 @@ public:
 	glm::vec3 eval(const glm::vec3& wi, const glm::vec3& wo, const glm::vec3& n, const glm::vec4& color, const glm::vec2& metallicRoughness) const;
 	float pdf(const glm::vec3& wi, const glm::vec3& wo, const glm::vec3& n, const glm::vec4& color, const glm::vec2& metallicRoughness) const;
 
-	glm::vec4 sample_diffuse_color(const FHitResult& hit_result);
-	glm::vec3 sample_surface_normal(const FHitResult& hit_result) const;
-	glm::vec2 sample_surface_metallic_roughness(const FHitResult& hit_result) const;
+	glm::vec4 sample_diffuse_color(const FSurfaceInteraction& surface);
+	glm::vec3 sample_surface_normal(const FSurfaceInteraction& surface) const;
+	glm::vec2 sample_surface_metallic_roughness(const FSurfaceInteraction& surface) const;
 	
 protected:
 	glm::vec4 sample_texture(ETextureType texture, const glm::vec2& uv) const;
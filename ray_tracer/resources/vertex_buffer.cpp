@@ -27,12 +27,12 @@ void CVertexBuffer::add_mesh_data(const std::vector<FVertex>& vertices, const st
 	add_indices(indices);
 }
 
-const FVertex& CVertexBuffer::get_vertex(size_t index)
+const FVertex& CVertexBuffer::get_vertex(size_t index) const
 {
 	return m_vertices.at(index);
 }
 
-uint32_t CVertexBuffer::get_index(size_t index)
+uint32_t CVertexBuffer::get_index(size_t index) const
 {
 	return m_indices.at(index);
 }
@@ -47,6 +47,11 @@ size_t CVertexBuffer::get_last_index() const
 	return m_indices.size();
 }
 
+size_t CVertexBuffer::memory() const
+{
+	return m_vertices.capacity() * sizeof(FVertex) + m_indices.capacity() * sizeof(uint32_t);
+}
+
 void CVertexBuffer::clear()
 {
 	m_vertices.clear();
@@ -80,11 +80,13 @@ public:
 	void add_mesh_data(std::unique_ptr<mesh_template>&& mesh_template);
 	void add_mesh_data(const std::vector<FVertex>& vertices, const std::vector<uint32_t>& indices);
 
-	const FVertex& get_vertex(size_t index);
-	uint32_t get_index(size_t index);
+	const FVertex& get_vertex(size_t index) const;
+	uint32_t get_index(size_t index) const;
 
 	size_t get_last_vertex() const;
 	size_t get_last_index() const;
+	// Bytes held by vertices and indices
+	size_t memory() const;
 
 	void clear();
 private:
@@ -8,12 +8,44 @@
 #include "resources/resource_manager.h"
 
 #include "resources/material.h"
+#include "bvh_stats.h"
 
 #define TINYGLTF_IMPLEMENTATION
 #include <tiny_gltf.h>
 
 #include <logger/logger.h>
 #include <utime.hpp>
+#include <json.hpp>
+#include <fstream>
+
+void to_json(nlohmann::json& json, const FBVHStats& type)
+{
+	json["sah_cost"] = type.m_sah_cost;
+	json["inner_nodes"] = type.m_inner_nodes;
+	json["leaves"] = type.m_leaves;
+	json["primitives"] = type.m_primitives;
+	json["leaf_sizes"] = type.m_leaf_sizes;
+	json["max_depth"] = type.m_max_depth;
+	json["average_depth"] = type.m_average_depth;
+	json["overlap"] = type.m_overlap;
+	json["node_memory"] = type.m_node_memory;
+	json["leaf_memory"] = type.m_leaf_memory;
+}
+
+void log_bvh_stats(const std::string& level, const FBVHStats& stats)
+{
+	log_info("BVH {}: SAH cost {:.2f}, {} inner nodes, {} leaves, {} primitives, depth {:.1f} average / {} max, sibling overlap {:.3f}, {:.2f}MB nodes, {:.2f}MB leaves.",
+		level, stats.m_sah_cost, stats.m_inner_nodes, stats.m_leaves, stats.m_primitives, stats.m_average_depth, stats.m_max_depth, stats.m_overlap,
+		static_cast<float>(stats.m_node_memory) / 1048576.f, static_cast<float>(stats.m_leaf_memory) / 1048576.f);
+
+	std::string histogram{};
+	for (size_t size = 0ull; size < stats.m_leaf_sizes.size(); ++size)
+	{
+		if (stats.m_leaf_sizes[size] > 0ull)
+			histogram += std::format(" {}:{}", size, stats.m_leaf_sizes[size]);
+	}
+	log_info("BVH {} leaf sizes (primitives:leaves):{}", level, histogram);
+}
 
 double getDoubleValueOrDefault(const std::string& name, const tinygltf::Value& val, double _default = 0.0)
 {
@@ -133,46 +165,141 @@ void CScene::create(const std::filesystem::path& scenepath)
 	m_parentPath = scenepath.parent_path();
 
 	//m_pBVHTree = new CBVHTree();
-	m_pBVHTree = new CBVHTreeNew();
+	m_pBVHTree = new CInstanceTree();
 
 	utl::stopwatch sw;
 	load_gltf_scene(scenepath, 0u);
 	log_info("Scene loaded by {}s.", sw.stop<float>());
+
+	size_t vertex_memory{ 0ull };
+	for (auto vertex_buffer_id : m_vVertexBufferIds)
+		vertex_memory += m_pResourceManager->get_vertex_buffer(vertex_buffer_id)->memory();
+	log_info("Geometry memory: {:.2f}MB in shared vertex buffers, {:.2f}MB in indexed triangles.", static_cast<float>(vertex_memory) / 1048576.f, static_cast<float>(m_pBVHTree->size() * sizeof(CTriangle)) / 1048576.f);
+}
+
+void CScene::build_acceleration(const FBVHConfig& config)
+{
+	utl::stopwatch sw;
+	m_pBVHTree->create(m_registry, config);
+
+	auto build_time = sw.stop<float>();
+	auto triangle_count = m_pBVHTree->size();
+	log_info("BVH tree built by {}s with the {} builder: {} triangles in {} meshes, {} instances, {:.2f}M triangles/s.", build_time, to_string(config.m_builder), triangle_count, m_pBVHTree->mesh_count(), m_pBVHTree->instance_count(), static_cast<float>(triangle_count) / glm::max(build_time, 1e-6f) * 1e-6f);
+	log_info("BVH memory: {:.2f}MB in {} nodes, {:.2f}MB in leaf triangle blocks.", static_cast<float>(m_pBVHTree->node_memory()) / 1048576.f, config.m_compressed_nodes ? "compressed" : "uncompressed", static_cast<float>(m_pBVHTree->leaf_memory()) / 1048576.f);
+	if (auto* pager = m_pBVHTree->get_pager())
+		log_info("Out-of-core geometry: {:.2f}MB of leaves and primitives paged from {} under a {}MB budget.", static_cast<float>(pager->size()) / 1048576.f, pager->get_path().string(), config.m_memory_budget);
+
+	// Every instance of an emissive mesh is its own set of area lights
+	m_vAreaLights.clear();
+	for (uint32_t instance = 0u; instance < m_pBVHTree->instance_count(); ++instance)
+	{
+		for (auto primitive : m_vMeshEmitters[m_pBVHTree->get_instance(instance).m_mesh])
+			m_vAreaLights.push_back({ instance, primitive });
+	}
 }
 
-void CScene::build_acceleration()
+void CScene::report_acceleration(const FBVHConfig& config, const std::filesystem::path& path) const
+{
+	auto top_level = m_pBVHTree->analyze(config);
+
+	FBVHStats bottom_level{};
+	auto meshes = nlohmann::json::array();
+	for (uint32_t mesh = 0u; mesh < m_pBVHTree->mesh_count(); ++mesh)
+	{
+		auto stats = m_pBVHTree->get_mesh(mesh).analyze();
+		bottom_level.merge(stats);
+		meshes.push_back(stats);
+	}
+
+	log_bvh_stats("top level", top_level);
+	log_bvh_stats("bottom levels", bottom_level);
+
+	nlohmann::json json{};
+	json["builder"] = to_string(config.m_builder);
+	json["preset"] = to_string(config.m_preset);
+	json["compressed_nodes"] = config.m_compressed_nodes;
+	json["top_level"] = top_level;
+	json["bottom_levels"] = bottom_level;
+	json["meshes"] = meshes;
+
+	std::ofstream file(path);
+	if (!file.is_open())
+	{
+		log_error("Failed to write BVH statistics to {}.", path.string());
+		return;
+	}
+	file << json.dump(4);
+	log_info("BVH statistics written to {}.", path.string());
+}
+
+bool CScene::update_acceleration(const FBVHConfig& config)
 {
 	utl::stopwatch sw;
-	m_pBVHTree->create();
-	log_info("BVH tree built by {}s.", sw.stop<float>());
+	auto update = m_pBVHTree->refit(m_registry, config);
+
+	if (update == ETreeUpdate::eRefit)
+		log_debug("BVH tree refit by {}s.", sw.stop<float>());
+	else if (update == ETreeUpdate::eRebuild)
+		log_info("BVH top level degraded past the refit threshold and was rebuilt by {}s.", sw.stop<float>());
+
+	return update != ETreeUpdate::eNone;
 }
 
 bool CScene::trace_ray(const FRay& ray, float t_min, float t_max, FHitResult& hit_result)
 {
-	return m_pBVHTree->hit(ray, t_min, t_max, hit_result);
+	BVH_STATS(bvh_stats::begin(1u));
+	bool has_hit = m_pBVHTree->hit(ray, t_min, t_max, hit_result);
+	BVH_STATS(bvh_stats::end(1u));
+	return has_hit;
+}
+
+void CScene::trace_packet(FRayPacket& packet, float t_min, float t_max) const
+{
+	packet.prepare();
+	BVH_STATS(bvh_stats::begin(packet.m_size));
+	m_pBVHTree->hit(packet, t_min, t_max);
+	BVH_STATS(bvh_stats::end(packet.m_size));
+}
+
+void CScene::resolve_hit(const FRay& ray, const FHitResult& hit_result, FSurfaceInteraction& surface) const
+{
+	m_pBVHTree->resolve_hit(ray, hit_result, surface);
+}
+
+bool CScene::occluded(const FRay& ray, float t_min, float t_max) const
+{
+	return m_pBVHTree->occluded(ray, t_min, t_max);
+}
+
+bool CScene::has_alpha_cutouts() const
+{
+	return m_bHasAlphaCutouts;
 }
 
 FAxixAlignedBoundingBox CScene::get_bounds() const
 {
-	FAxixAlignedBoundingBox bounds{};
-	for (size_t i = 0ull; i < m_pBVHTree->size(); ++i)
-		bounds.grow(m_pBVHTree->get_triangle(i).bounds());
-	return bounds;
+	return m_pBVHTree->get_bounds();
 }
 
 size_t CScene::get_area_light_index(float index) const
 {
-	return m_vLightIds.at(static_cast<size_t>(index * m_vLightIds.size()));
+	return static_cast<size_t>(index * m_vAreaLights.size());
 }
 
-const CTriangle& CScene::get_area_light(size_t index) const
+float CScene::get_area_light_probability() const
 {
-	return m_pBVHTree->get_triangle(index);
+	return 1.f / static_cast<float>(m_vAreaLights.size());
 }
 
-float CScene::get_area_light_probability() const
+glm::vec3 CScene::sample_area_light(size_t index, const glm::vec3& p, const glm::vec2& sample, float& pdf, FSurfaceInteraction& light_hit) const
+{
+	auto& light = m_vAreaLights.at(index);
+	return m_pBVHTree->sample(light.m_instance_id, light.m_primitive_id, p, sample, pdf, light_hit);
+}
+
+float CScene::get_area_light_pdf(const FHitResult& hit_result, const glm::vec3& p, const glm::vec3& wi) const
 {
-	return 1.f / static_cast<float>(m_vLightIds.size());
+	return m_pBVHTree->pdf(hit_result.m_instance_id, hit_result.m_primitive_id, p, wi);
 }
 
 size_t CScene::get_light_index(float index) const
@@ -239,6 +366,10 @@ void CScene::load_gltf_scene(const std::filesystem::path& path, uint32_t scene_i
 	load_textures(gltfModel);
 	load_materials(gltfModel);
 
+	// Meshes are loaded on first reference, then instanced
+	m_vMeshIds.assign(gltfModel.meshes.size(), std::numeric_limits<uint32_t>::max());
+	m_vShapeMeshIds.assign(gltfModel.meshes.size(), std::numeric_limits<uint32_t>::max());
+
 	// Load scene nodes
 	const tinygltf::Scene& scene = gltfModel.scenes[gltfModel.defaultScene > -1 ? gltfModel.defaultScene : 0];
 	for (auto& node_idx : scene.nodes)
@@ -414,6 +545,9 @@ void CScene::load_materials(const tinygltf::Model& model)
 				material_ci.m_alphaMode = EAlphaMode::eOpaque;
 		}
 
+		if (material_ci.m_alphaMode != EAlphaMode::eOpaque)
+			m_bHasAlphaCutouts = true;
+
 		if (mat.additionalValues.find("alphaCutoff") != mat.additionalValues.end())
 			material_ci.m_alphaCutoff = static_cast<float>(mat.additionalValues.at("alphaCutoff").Factor());
 
@@ -511,7 +645,98 @@ void CScene::load_node(const entt::entity& parent, const tinygltf::Node& node, u
 
 void CScene::load_mesh_component(const entt::entity& target, const tinygltf::Node& node, const tinygltf::Model& model)
 {
-	const tinygltf::Mesh& mesh = model.meshes[node.mesh];
+	auto& mesh_id = m_vMeshIds.at(node.mesh);
+	auto& shape_mesh_id = m_vShapeMeshIds.at(node.mesh);
+	if (mesh_id == std::numeric_limits<uint32_t>::max())
+	{
+		mesh_id = m_pBVHTree->add_mesh();
+		m_vMeshEmitters.emplace_back();
+		load_mesh(mesh_id, model.meshes[node.mesh], model);
+
+		// Shapes get a bottom level of their own, instanced alongside the triangles. They are
+		// not light sampled, so their emitter list stays empty and CInstanceTree::pdf gives 0.
+		if (has_shapes(model.meshes[node.mesh]))
+		{
+			shape_mesh_id = m_pBVHTree->add_mesh();
+			m_vMeshEmitters.emplace_back();
+			load_shapes(shape_mesh_id, model.meshes[node.mesh], model);
+		}
+	}
+
+	auto gpu_instances = load_gpu_instances(node, model);
+	if (gpu_instances.empty())
+		gpu_instances.emplace_back(1.f);
+
+	for (auto& local : gpu_instances)
+	{
+		m_pBVHTree->add_instance(target, mesh_id, local);
+		if (shape_mesh_id != std::numeric_limits<uint32_t>::max())
+			m_pBVHTree->add_instance(target, shape_mesh_id, local);
+	}
+}
+
+std::vector<glm::mat4> CScene::load_gpu_instances(const tinygltf::Node& node, const tinygltf::Model& model)
+{
+	std::vector<glm::mat4> instances{};
+
+	auto extension = node.extensions.find("EXT_mesh_gpu_instancing");
+	if (extension == node.extensions.end())
+		return instances;
+
+	auto& attributes = extension->second.Get("attributes");
+
+	// Reads one float attribute per instance; components is 3 or 4
+	auto read_attribute = [&](const std::string& name, uint32_t components, std::vector<float>& out) -> size_t
+		{
+			if (!attributes.Has(name))
+				return 0ull;
+
+			const tinygltf::Accessor& accessor = model.accessors[attributes.Get(name).GetNumberAsInt()];
+			if (accessor.componentType != TINYGLTF_PARAMETER_TYPE_FLOAT)
+			{
+				log_warning("EXT_mesh_gpu_instancing: {} must be stored as float, attribute ignored.", name);
+				return 0ull;
+			}
+
+			const tinygltf::BufferView& view = model.bufferViews[accessor.bufferView];
+			auto stride = accessor.ByteStride(view);
+			auto* data = &model.buffers[view.buffer].data[accessor.byteOffset + view.byteOffset];
+
+			out.resize(accessor.count * components);
+			for (size_t i = 0ull; i < accessor.count; ++i)
+				memcpy(&out[i * components], data + i * stride, components * sizeof(float));
+
+			return accessor.count;
+		};
+
+	std::vector<float> translations, rotations, scales;
+	size_t count = read_attribute("TRANSLATION", 3u, translations);
+	count = glm::max(count, read_attribute("ROTATION", 4u, rotations));
+	count = glm::max(count, read_attribute("SCALE", 3u, scales));
+
+	instances.reserve(count);
+	for (size_t i = 0ull; i < count; ++i)
+	{
+		glm::vec3 translation = translations.empty() ? glm::vec3(0.f) : glm::make_vec3(&translations[i * 3ull]);
+		glm::quat rotation = rotations.empty() ? glm::quat(1.f, 0.f, 0.f, 0.f) : glm::make_quat(&rotations[i * 4ull]);
+		glm::vec3 scale = scales.empty() ? glm::vec3(1.f) : glm::make_vec3(&scales[i * 3ull]);
+
+		instances.emplace_back(glm::translate(glm::mat4(1.f), translation) * glm::mat4(rotation) * glm::scale(glm::mat4(1.f), scale));
+	}
+
+	log_verbose("Loaded {} GPU instances.", count);
+
+	return instances;
+}
+
+void CScene::load_mesh(uint32_t mesh_id, const tinygltf::Mesh& mesh, const tinygltf::Model& model)
+{
+	auto& tree = m_pBVHTree->get_mesh(mesh_id);
+	auto& emitters = m_vMeshEmitters.at(mesh_id);
+
+	// Vertices of every primitive of the mesh, stored once and referenced by index from the triangles
+	auto vertex_buffer_id = m_vVertexBufferIds.emplace_back(m_pResourceManager->add_vertex_buffer(std::format("vertex_buffer_{}_{}", mesh.name, mesh_id)));
+	auto& vertex_buffer = m_pResourceManager->get_vertex_buffer(vertex_buffer_id);
 
 	for (size_t j = 0; j < mesh.primitives.size(); j++)
 	{
@@ -519,6 +744,9 @@ void CScene::load_mesh_component(const entt::entity& target, const tinygltf::Nod
 		std::vector<FVertex> vertexBuffer;
 
 		const tinygltf::Primitive& primitive = mesh.primitives[j];
+		// Loaded as spheres by load_shapes
+		if (primitive.mode == TINYGLTF_MODE_POINTS)
+			continue;
 
 		uint32_t indexStart = static_cast<uint32_t>(0);
 		uint32_t vertexStart = static_cast<uint32_t>(0);
@@ -725,27 +953,131 @@ void CScene::load_mesh_component(const entt::entity& target, const tinygltf::Nod
 		auto& material = m_pResourceManager->get_material(material_id);
 		bool is_light_emitter = material->can_emit_light();// && !material->can_scatter_light();
 
+		// Indices of the primitive are local to its own vertices
+		auto vertex_base = static_cast<uint32_t>(vertex_buffer->get_last_vertex());
+		vertex_buffer->add_vertices(vertexBuffer);
+
 		for (uint32_t index = 0u; index < indexBuffer.size(); index += 3u)
 		{
-			auto i0 = indexBuffer.at(index);
-			auto i1 = indexBuffer.at(index + 1u);
-			auto i2 = indexBuffer.at(index + 2u);
+			auto i0 = vertex_base + indexBuffer.at(index);
+			auto i1 = vertex_base + indexBuffer.at(index + 1u);
+			auto i2 = vertex_base + indexBuffer.at(index + 2u);
 
-			auto& v0 = vertexBuffer.at(i0);
-			auto& v1 = vertexBuffer.at(i1);
-			auto& v2 = vertexBuffer.at(i2);
-
-			auto triangle_index = m_pBVHTree->size();
-			m_pBVHTree->emplace(CTriangle(m_registry, target, material_id, v0, v1, v2, triangle_index));
+			auto triangle_index = tree.size();
+			tree.emplace(CTriangle(material_id, vertex_buffer.get(), i0, i1, i2, triangle_index));
 
 			if (is_light_emitter)
-				m_vLightIds.emplace_back(triangle_index);
+				emitters.emplace_back(static_cast<uint32_t>(triangle_index));
 		}
 
 		log_verbose("Loaded {} triangles.", indexBuffer.size() / 3);
 	}
 }
 
+bool CScene::has_shapes(const tinygltf::Mesh& mesh)
+{
+	if (mesh.extensions.contains("RT_analytic_shapes"))
+		return true;
+
+	return std::any_of(mesh.primitives.begin(), mesh.primitives.end(), [](const tinygltf::Primitive& primitive) { return primitive.mode == TINYGLTF_MODE_POINTS; });
+}
+
+void CScene::load_shapes(uint32_t mesh_id, const tinygltf::Mesh& mesh, const tinygltf::Model& model)
+{
+	// Points carry no size of their own
+	constexpr const float default_point_radius{ 0.01f };
+
+	auto& tree = m_pBVHTree->get_mesh(mesh_id);
+
+	auto get_material = [&](int material) -> resource_id_t
+		{
+			if (m_vMaterialIds.empty())
+				return invalid_index;
+			return material != invalid_index ? m_vMaterialIds.at(material) : m_vMaterialIds.back();
+		};
+
+	// Float attribute of a primitive, nullptr if it is missing or not stored as float
+	auto get_attribute = [&](const tinygltf::Primitive& primitive, const std::string& name, const tinygltf::Accessor*& accessor) -> const float*
+		{
+			auto attribute = primitive.attributes.find(name);
+			if (attribute == primitive.attributes.end())
+				return nullptr;
+
+			accessor = &model.accessors[attribute->second];
+			if (accessor->componentType != TINYGLTF_PARAMETER_TYPE_FLOAT)
+				return nullptr;
+
+			const tinygltf::BufferView& view = model.bufferViews[accessor->bufferView];
+			return reinterpret_cast<const float*>(&model.buffers[view.buffer].data[accessor->byteOffset + view.byteOffset]);
+		};
+
+	// Every point of a POINTS primitive is a sphere, sized by the _RADIUS attribute or the radius extra
+	for (auto& primitive : mesh.primitives)
+	{
+		if (primitive.mode != TINYGLTF_MODE_POINTS)
+			continue;
+
+		const tinygltf::Accessor* position_accessor{ nullptr };
+		const tinygltf::Accessor* radius_accessor{ nullptr };
+		const tinygltf::Accessor* color_accessor{ nullptr };
+		auto* positions = get_attribute(primitive, "POSITION", position_accessor);
+		auto* radii = get_attribute(primitive, "_RADIUS", radius_accessor);
+		auto* colors = get_attribute(primitive, "COLOR_0", color_accessor);
+		if (!positions)
+		{
+			log_warning("Points primitive of mesh {} has no float positions, skipped.", mesh.name);
+			continue;
+		}
+
+		float radius = primitive.extras.Has("radius") ? static_cast<float>(primitive.extras.Get("radius").GetNumberAsDouble()) : default_point_radius;
+		uint32_t color_components = color_accessor && color_accessor->type == TINYGLTF_TYPE_VEC4 ? 4u : 3u;
+		auto material_id = get_material(primitive.material);
+
+		for (size_t v = 0ull; v < position_accessor->count; ++v)
+		{
+			auto shape_index = tree.size();
+			tree.emplace(CShape(EShapeType::eSphere, material_id, glm::make_vec3(&positions[v * 3ull]), glm::vec3(0.f, 1.f, 0.f),
+				radii ? radii[v] : radius, colors ? glm::make_vec3(&colors[v * color_components]) : glm::vec3(1.f), shape_index));
+		}
+
+		log_verbose("Loaded {} point spheres.", position_accessor->count);
+	}
+
+	// "RT_analytic_shapes": { "shapes": [ { "type": "sphere" | "disk", "center": [x, y, z], "normal": [x, y, z], "radius": r, "material": m } ] }
+	auto extension = mesh.extensions.find("RT_analytic_shapes");
+	if (extension == mesh.extensions.end() || !extension->second.Has("shapes"))
+		return;
+
+	auto get_vec3 = [](const tinygltf::Value& value, const std::string& name, const glm::vec3& fallback) -> glm::vec3
+		{
+			if (!value.Has(name) || value.Get(name).ArrayLen() != 3ull)
+				return fallback;
+
+			auto& array = value.Get(name);
+			return glm::vec3(array.Get(0).GetNumberAsDouble(), array.Get(1).GetNumberAsDouble(), array.Get(2).GetNumberAsDouble());
+		};
+
+	auto& shapes = extension->second.Get("shapes");
+	for (size_t i = 0ull; i < shapes.ArrayLen(); ++i)
+	{
+		auto& shape = shapes.Get(static_cast<int>(i));
+		auto type = shape.Has("type") ? shape.Get("type").Get<std::string>() : std::string("sphere");
+		if (type != "sphere" && type != "disk")
+		{
+			log_warning("RT_analytic_shapes: unknown shape type {}, shape skipped.", type);
+			continue;
+		}
+
+		auto radius = shape.Has("radius") ? static_cast<float>(shape.Get("radius").GetNumberAsDouble()) : 1.f;
+		auto material = shape.Has("material") ? shape.Get("material").GetNumberAsInt() : -1;
+		auto shape_index = tree.size();
+		tree.emplace(CShape(type == "disk" ? EShapeType::eDisk : EShapeType::eSphere, get_material(material), get_vec3(shape, "center", glm::vec3(0.f)),
+			get_vec3(shape, "normal", glm::vec3(0.f, 1.f, 0.f)), radius, glm::vec3(1.f), shape_index));
+	}
+
+	log_verbose("Loaded {} analytic shapes.", shapes.ArrayLen());
+}
+
 void CScene::load_camera_component(const entt::entity& target, const tinygltf::Node& node, const tinygltf::Model& model)
 {
 	const tinygltf::Camera camera = model.cameras[node.camera];
@@ -3,7 +3,7 @@
 #include <tiny_gltf.h>
 #include "light_source.h"
 #include "ecs/components/fwdecl.h"
-#include "bvh_tree.h"
+#include "instance_tree.h"
 
 //class Sphere : public Hittable
 //{
@@ -21,6 +21,13 @@
 
 class CResourceManager;
 
+// Emissive triangle of one instance
+struct FAreaLight
+{
+	uint32_t m_instance_id{};
+	uint32_t m_primitive_id{};
+};
+
 class CScene
 {
 public:
@@ -29,16 +36,32 @@ public:
 	~CScene();
 
 	void create(const std::filesystem::path& scenepath);
-	void build_acceleration();
+	void build_acceleration(const FBVHConfig& config);
+	// Follows transform changes since the last build or update. Returns true if any geometry moved.
+	bool update_acceleration(const FBVHConfig& config);
+	// Logs the quality metrics of the built acceleration structure and writes them as JSON to path
+	void report_acceleration(const FBVHConfig& config, const std::filesystem::path& path) const;
 
 	bool trace_ray(const FRay& ray, float t_min, float t_max, FHitResult& hit_result);
+	// Closest hits of a coherent packet, such as one tile of primary rays
+	void trace_packet(FRayPacket& packet, float t_min, float t_max) const;
+	// Interpolates shading data for a hit returned by trace_ray. Call once per hit that is shaded.
+	void resolve_hit(const FRay& ray, const FHitResult& hit_result, FSurfaceInteraction& surface) const;
+	// Visibility query for shadow rays. Stops at the first hit and never computes shading data.
+	bool occluded(const FRay& ray, float t_min, float t_max) const;
+
+	// True if any material can cut out geometry by alpha, so an occluder may not cast a shadow.
+	bool has_alpha_cutouts() const;
 
 	// World-space bounds of all scene geometry. Valid after build_acceleration().
 	FAxixAlignedBoundingBox get_bounds() const;
 
 	size_t get_area_light_index(float index) const;
-	const CTriangle& get_area_light(size_t index) const;
 	float get_area_light_probability() const;
+	// Solid-angle sampling of an emissive triangle (see CTriangle::sample) and its pdf.
+	glm::vec3 sample_area_light(size_t index, const glm::vec3& p, const glm::vec2& sample, float& pdf, FSurfaceInteraction& light_hit) const;
+	// Pdf of reaching the emitter hit by hit_result through light sampling
+	float get_area_light_pdf(const FHitResult& hit_result, const glm::vec3& p, const glm::vec3& wi) const;
 
 	size_t get_light_index(float index) const;
 	const std::unique_ptr<CLightSource>& get_light(size_t index) const;
@@ -58,6 +81,12 @@ private:
 
 	void load_node(const entt::entity& parent, const tinygltf::Node& node, uint32_t nodeIndex, const tinygltf::Model& model, float globalscale);
 	void load_mesh_component(const entt::entity& target, const tinygltf::Node& node, const tinygltf::Model& model);
+	void load_mesh(uint32_t mesh_id, const tinygltf::Mesh& mesh, const tinygltf::Model& model);
+	// Spheres of POINTS primitives and shapes of the RT_analytic_shapes extension
+	void load_shapes(uint32_t mesh_id, const tinygltf::Mesh& mesh, const tinygltf::Model& model);
+	static bool has_shapes(const tinygltf::Mesh& mesh);
+	// Per-instance transforms of EXT_mesh_gpu_instancing, empty if the node has none
+	std::vector<glm::mat4> load_gpu_instances(const tinygltf::Node& node, const tinygltf::Model& model);
 	void load_camera_component(const entt::entity& target, const tinygltf::Node& node, const tinygltf::Model& model);
 	void load_light_component(const entt::entity& target, uint32_t light_index, const tinygltf::Node& node, const tinygltf::Model& model);
 
@@ -67,16 +96,27 @@ private:
 	entt::entity m_root{};
 
 	//CBVHTree* m_pBVHTree{ nullptr };
-	CBVHTreeNew* m_pBVHTree{ nullptr };
+	CInstanceTree* m_pBVHTree{ nullptr };
 
 	std::vector<resource_id_t> m_vSamplerIds{};
 	std::vector<resource_id_t> m_vImageIds{};
 	std::vector<resource_id_t> m_vTextureIds{};
 	std::vector<resource_id_t> m_vMaterialIds{};
-	std::vector<size_t> m_vLightIds{};
+	// Shared vertices of every triangle mesh loaded
+	std::vector<resource_id_t> m_vVertexBufferIds{};
+	// Bottom-level mesh per glTF mesh index of the file being loaded, created on first use
+	std::vector<uint32_t> m_vMeshIds{};
+	// Bottom-level shape mesh per glTF mesh index, only for meshes with analytic shapes
+	std::vector<uint32_t> m_vShapeMeshIds{};
+	// Emissive triangles of every bottom-level mesh
+	std::vector<std::vector<uint32_t>> m_vMeshEmitters{};
+	// Emissive triangles of every instance, gathered in build_acceleration
+	std::vector<FAreaLight> m_vAreaLights{};
 
 	std::vector<std::unique_ptr<CLightSource>> m_vLightSources{};
 
+	bool m_bHasAlphaCutouts{ false };
+
 	std::filesystem::path m_parentPath{};
 
 	CResourceManager* m_pResourceManager{ nullptr };
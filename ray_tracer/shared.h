@@ -26,7 +26,68 @@ struct FRay
 	glm::vec3 m_inv_direction{};
 };
 
+// Compact hit record written by traversal: distance, barycentrics, instance and primitive only.
+// Shading data is resolved once per hit into FSurfaceInteraction (see CScene::resolve_hit).
 struct FHitResult
+{
+	float m_distance{ std::numeric_limits<float>::infinity() };
+	// Barycentric weights of the second and third vertex, or the surface parameters of a CShape
+	glm::vec2 m_barycentric{};
+	// Triangle or shape within the instanced mesh
+	uint32_t m_primitive_id{ std::numeric_limits<uint32_t>::max() };
+	uint32_t m_instance_id{ std::numeric_limits<uint32_t>::max() };
+
+	bool is_hit() const 
+	{
+		return m_distance < std::numeric_limits<float>::infinity();
+	}
+
+	bool is_same_primitive(const FHitResult& rhs) const
+	{
+		return m_primitive_id == rhs.m_primitive_id && m_instance_id == rhs.m_instance_id;
+	}
+};
+
+// Rays traced together through the BVH, one 8x8 tile of primary rays. Each ray's hit record
+// also holds its current t_max, so it starts out as a miss.
+struct FRayPacket
+{
+	static constexpr const uint32_t max_size{ 64u };
+
+	FRay m_rays[max_size]{};
+	FHitResult m_hits[max_size]{};
+	uint32_t m_size{ 0u };
+
+	// Interval bounds over all rays of the packet, see prepare
+	glm::vec3 m_origin_min{}, m_origin_max{};
+	glm::vec3 m_inv_direction_min{}, m_inv_direction_max{};
+	// True if the directions agree in sign on every axis. Otherwise the interval bounds cull
+	// nothing and the rays are better traced one by one.
+	bool m_bCoherent{ false };
+
+	// Call after the rays are set
+	void prepare()
+	{
+		m_origin_min = m_inv_direction_min = glm::vec3(std::numeric_limits<float>::max());
+		m_origin_max = m_inv_direction_max = glm::vec3(std::numeric_limits<float>::lowest());
+		m_bCoherent = m_size > 0u;
+
+		for (uint32_t i = 0u; i < m_size; ++i)
+		{
+			auto& ray = m_rays[i];
+			m_origin_min = glm::min(m_origin_min, ray.m_origin);
+			m_origin_max = glm::max(m_origin_max, ray.m_origin);
+			m_inv_direction_min = glm::min(m_inv_direction_min, ray.m_inv_direction);
+			m_inv_direction_max = glm::max(m_inv_direction_max, ray.m_inv_direction);
+			m_bCoherent = m_bCoherent && glm::all(glm::lessThan(glm::abs(ray.m_inv_direction), glm::vec3(std::numeric_limits<float>::max())));
+		}
+
+		m_bCoherent = m_bCoherent && glm::all(glm::equal(glm::sign(m_inv_direction_min), glm::sign(m_inv_direction_max)));
+	}
+};
+
+// Surface data at a hit point, interpolated on demand from the primitive's attributes.
+struct FSurfaceInteraction
 {
 	glm::vec3 m_color{};
 	glm::vec3 m_position{};
@@ -36,12 +97,13 @@ struct FHitResult
 	glm::vec2 m_texcoord{};
 	float m_distance{ std::numeric_limits<float>::infinity() };
 	bool m_bFrontFace{ false };
-	size_t m_primitive_id{ invalid_index };
+	uint32_t m_primitive_id{ std::numeric_limits<uint32_t>::max() };
+	uint32_t m_instance_id{ std::numeric_limits<uint32_t>::max() };
 	resource_id_t m_material_id{ invalid_index };
 
-	bool is_hit() const 
+	bool is_same_primitive(const FHitResult& hit_result) const
 	{
-		return m_distance < std::numeric_limits<float>::infinity();
+		return m_primitive_id == hit_result.m_primitive_id && m_instance_id == hit_result.m_instance_id;
 	}
 
 	inline void set_face_normal(const FRay& ray, const glm::vec3& outward_normal)
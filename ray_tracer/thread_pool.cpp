@@ -0,0 +1,63 @@
+#include "thread_pool.h"
+
+#include <logger/logger.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace
+{
+	// Worker index of pool threads, set once when they start
+	thread_local int32_t worker_index{ -1 };
+
+	bool pin_to_core(uint32_t core)
+	{
+#if defined(_WIN32)
+		// Affinity masks cover the first processor group only
+		if (core >= sizeof(DWORD_PTR) * 8u)
+			return false;
+		return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1ull) << core) != 0;
+#elif defined(__linux__)
+		cpu_set_t set{};
+		CPU_ZERO(&set);
+		CPU_SET(core, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+		return false;
+#endif
+	}
+}
+
+void CThreadPool::create(uint32_t thread_count, bool affinity)
+{
+	auto hardware_threads = glm::max(std::thread::hardware_concurrency(), 1u);
+	if (thread_count == 0u)
+		thread_count = hardware_threads;
+
+	m_pool.create(thread_count - 1u,
+		[affinity, hardware_threads](size_t worker)
+		{
+			worker_index = static_cast<int32_t>(worker);
+			auto core = static_cast<uint32_t>(worker + 1ull) % hardware_threads;
+			if (affinity && !pin_to_core(core))
+				log_warning("Failed to pin worker thread {} to core {}.", worker, core);
+		});
+
+	log_info("Running on {} threads{}.", thread_count, affinity ? ", pinned to cores" : "");
+}
+
+uint32_t CThreadPool::worker_count() const
+{
+	return static_cast<uint32_t>(m_pool.size()) + 1u;
+}
+
+uint32_t CThreadPool::current_worker() const
+{
+	return worker_index >= 0 ? static_cast<uint32_t>(worker_index) : static_cast<uint32_t>(m_pool.size());
+}
\ No newline at end of file
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <threading.hpp>
+#include <upattern.hpp>
+
+// Worker threads shared by rendering and acceleration structure builds, replacing the standard
+// parallel algorithms whose thread count can not be capped and which run serially unless the
+// standard library has a backend linked. Every thread taking part in parallel_for has a worker
+// index in [0, worker_count()), so callers keep per-thread scratch state in plain arrays.
+class CThreadPool : public utl::singleton<CThreadPool>
+{
+public:
+	// thread_count counts the calling thread, 0 uses every hardware thread. With affinity each
+	// pool thread is pinned to its own logical core, leaving the first one to the caller.
+	// Until this is called everything runs on the calling thread.
+	void create(uint32_t thread_count, bool affinity);
+
+	// Calls function(index, worker) for every index in [0, count), see utl::threadpool::parallel_for
+	template<class _Lambda>
+	void parallel_for(size_t count, _Lambda&& function, size_t grain = 1ull)
+	{
+		m_pool.parallel_for(count,
+			[this, &function](size_t index)
+			{
+				function(index, current_worker());
+			}, grain);
+	}
+
+	// Pool threads plus one for the thread calling parallel_for from outside the pool
+	uint32_t worker_count() const;
+	// Index of the calling thread, worker_count() - 1 on threads outside the pool. Callers outside
+	// the pool share that index, so they must not run parallel_for over the same scratch state.
+	uint32_t current_worker() const;
+private:
+	utl::threadpool m_pool{};
+};
\ No newline at end of file
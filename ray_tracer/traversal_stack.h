@@ -0,0 +1,50 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
+// Traversal stack entries kept inline before spilling to the heap
+constexpr const uint32_t traversal_stack_size{ 128u };
+
+// Traversal stack, inline on the thread's stack. Wide nodes push up to three entries more than they
+// pop, so degenerate trees (many coincident centroids split off one primitive at a time) can
+// outgrow any fixed size, the stack then moves to the heap.
+template<class _Ty>
+class CTraversalStack
+{
+public:
+	CTraversalStack() = default;
+	CTraversalStack(const CTraversalStack&) = delete;
+	CTraversalStack& operator=(const CTraversalStack&) = delete;
+
+	void push(const _Ty& entry)
+	{
+		if (m_size == m_capacity)
+			grow();
+		m_pData[m_size++] = entry;
+	}
+
+	_Ty pop()
+	{
+		return m_pData[--m_size];
+	}
+
+	bool empty() const { return m_size == 0u; }
+	uint32_t size() const { return m_size; }
+private:
+	void grow()
+	{
+		auto data = std::make_unique<_Ty[]>(m_capacity * 2ull);
+		std::copy(m_pData, m_pData + m_size, data.get());
+		m_pHeap = std::move(data);
+		m_pData = m_pHeap.get();
+		m_capacity *= 2u;
+	}
+
+	_Ty m_inline[traversal_stack_size];
+	_Ty* m_pData{ m_inline };
+	uint32_t m_size{ 0u };
+	uint32_t m_capacity{ traversal_stack_size };
+	std::unique_ptr<_Ty[]> m_pHeap{};
+};
\ No newline at end of file
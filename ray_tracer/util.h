@@ -1,6 +1,45 @@
 #pragma once
 
 #include <cstdlib>
+#include <new>
+
+constexpr const size_t cache_line_size{ 64ull };
+
+// Places arrays on _Alignment boundaries, so traversal arrays start on a cache line
+template<class _Ty, size_t _Alignment = cache_line_size>
+struct FAlignedAllocator
+{
+	using value_type = _Ty;
+
+	template<class _Other>
+	struct rebind
+	{
+		using other = FAlignedAllocator<_Other, _Alignment>;
+	};
+
+	FAlignedAllocator() = default;
+	template<class _Other>
+	FAlignedAllocator(const FAlignedAllocator<_Other, _Alignment>&) noexcept {}
+
+	_Ty* allocate(size_t count)
+	{
+		return static_cast<_Ty*>(::operator new(count * sizeof(_Ty), std::align_val_t{ _Alignment }));
+	}
+
+	void deallocate(_Ty* pointer, size_t) noexcept
+	{
+		::operator delete(pointer, std::align_val_t{ _Alignment });
+	}
+
+	template<class _Other>
+	bool operator==(const FAlignedAllocator<_Other, _Alignment>&) const noexcept
+	{
+		return true;
+	}
+};
+
+template<class _Ty>
+using cache_aligned_vector = std::vector<_Ty, FAlignedAllocator<_Ty>>;
 
 //inline void pcg_hash(uint32_t& seed)
 //{